@@ -31,6 +31,9 @@ ffi.cdef [[
 local ENTRY_T = ffi.typeof("struct entry")
 local ENTRY_P = ffi.typeof("struct entry *")
 
+-- optional correction of the post-DuT clock, see moonsniff-drift
+local correction
+
 --- Main matching function
 --- Tries to match timestamps and identifications from two mscap files
 --- Call this function from the outside
@@ -46,7 +49,12 @@ function mod.match(PRE, POST, args)
 		return
 	end
 
+	if not args.luaMatcher then
+		return matchNative(PRE, POST, args)
+	end
+
 	log:info("Using array matching")
+	correction = args.clockCorrection
 
 	-- increase the size of map by one to make BITMASK a valid identifier
 	local map = C.malloc(ffi.sizeof(ENTRY_T) * (INDEX_BITMASK + 1))
@@ -127,6 +135,51 @@ function mod.match(PRE, POST, args)
 	return pre_pkts + post_pkts
 end
 
+--- Match with the native multi-threaded matcher, see src/moonsniff-match.cpp
+function matchNative(PRE, POST, args)
+	log:info("Using native array matching with %s threads", args.threads == 0 and "all" or args.threads)
+	local cfg = ffi.new("struct ms_match_config")
+	cfg.id_bits = args.idBits
+	cfg.threads = args.threads
+	cfg.thresh = TIME_THRESH
+	local times, offsets
+	if args.clockCorrection then
+		local n = args.clockCorrection:size()
+		times = ffi.new("double[?]", n, args.clockCorrection.times)
+		offsets = ffi.new("double[?]", n, args.clockCorrection.offsets)
+		cfg.num_offsets = n
+		cfg.offset_times = times
+		cfg.offsets = offsets
+	end
+	if args.series then
+		cfg.series_file = args.series
+		cfg.series_window = args.seriesWindow
+	end
+
+	C.hs_initialize(args.nrbuckets)
+	local stats = ffi.new("struct ms_match_stats")
+	if not C.ms_match_mscap(PRE, POST, cfg, stats) then
+		log:fatal("Matching failed")
+	end
+	log:info("Finished timestamp matching")
+	C.hs_finalize()
+
+	local pre_pkts, post_pkts = tonumber(stats.pre_pkts), tonumber(stats.post_pkts)
+	printStats(pre_pkts, post_pkts, tonumber(stats.overwrites), tonumber(stats.misses))
+	if stats.inval_ts > 0 then
+		log:warn("%d latencies were smaller than the threshold of %d ns and were ignored", tonumber(stats.inval_ts), TIME_THRESH)
+	end
+	if stats.late > 0 then
+		log:warn("%d packets arrived after their window of the latency series was written", tonumber(stats.late))
+	end
+
+	log:info("Finished processing. Writing histogram ...")
+	C.hs_write(args.output .. ".csv")
+	C.hs_destroy()
+
+	return pre_pkts + post_pkts
+end
+
 --- Zero initialize the array on which the mapping will be performed
 --
 -- @param map, pointer to the matching-array
@@ -184,7 +237,11 @@ function computeLatency(postcap, postreader, map, misses)
 	local post_identifier = getId(postcap)
 
 	if pre_identifier == post_identifier then
-		local diff = ffi.cast(INT64_T, getTs(postcap) - ts)
+		local post_ts = getTs(postcap)
+		if correction then
+			post_ts = correction:apply(post_ts)
+		end
+		local diff = ffi.cast(INT64_T, post_ts - ts)
 		-- handle weird overflow bug that was introduced when we moved to the C++ capturer
 		-- no idea what exactly causes this, but this work-around fixes it for all latencies less than 2 seconds
 		if ts ~= 0 and diff < -2^31 and diff > -2^32 then
@@ -193,7 +250,7 @@ function computeLatency(postcap, postreader, map, misses)
 		if ts ~= 0 and diff < TIME_THRESH then
 			log:warn("Got latency smaller than defined thresh value")
 			log:warn("Identification " .. ident)
-			log:warn("Pre: " .. tostring(ts) .. "; post: " .. tostring(getTs(postcap)))
+			log:warn("Pre: " .. tostring(ts) .. "; post: " .. tostring(post_ts))
 			log:warn("Difference: " .. tostring(diff) .. ", thresh: " .. tostring(TIME_THRESH))
 		else
 			if ts ~= 0 then
@@ -238,6 +295,11 @@ end
 -- @param infile, the mscap file to read from
 -- @param outfile, the name of the file to write to
 -- @param range, print up to range entries if there are enough entries
+-- decimal representation of 64 bit cdata numbers, tostring() would append ULL and tonumber() lose precision
+local function u64tostring(value)
+	return (tostring(UINT64_T(value)):gsub("ULL$", ""))
+end
+
 function writeMSCAPasText(infile, outfile, range)
 	local reader = ms:newReader(infile)
 	local mscap = reader:readSingle()
@@ -247,7 +309,7 @@ function writeMSCAPasText(infile, outfile, range)
 	for i = 0, range do
 		local ident = band(mscap.identification, INDEX_BITMASK)
 
-		textf:write(tostring(mscap.identification), ", ", tostring(ident), ", ", tostring(mscap.timestamp), "\n")
+		textf:write(u64tostring(mscap.identification), ", ", tostring(tonumber(ident)), ", ", u64tostring(mscap.timestamp), "\n")
 		mscap = reader:readSingle()
 
 		if mscap == nil then break end
@@ -270,9 +332,9 @@ end
 
 
 --- Compute an identification of pcap files
---- Has no effect on mscap files
+--- For mscap files, the array stores the lower 32 bits of the identification
 function getId(cap)
-	return cap.identification
+	return tonumber(band(cap.identification, 0xFFFFFFFFULL))
 end
 
 --- Extract timestamp from pcap and mscaps
@@ -9,6 +9,7 @@ local log       = require "log"
 local dpdk      = require "dpdk"
 local pcap      = require "pcap"
 local profile   = require "jit.p"
+local drift     = require "moonsniff-drift"
 
 local ffi       = require "ffi"
 local C = ffi.C
@@ -25,6 +26,14 @@ function configure(parser)
 	parser:option("-s --second-input", "Path to second input file. Supports .mscap or .pcap files."):args(1):target("second")
 	parser:option("-o --output", "Name of the histogram which is generated."):args(1):default("hist")
 	parser:option("-n --nrbuckets", "Size of a bucket for the resulting histogram."):args(1):convert(tonumber):default(1)
+	parser:option("--drift", "Clock offsets recorded by sniffer.lua, post-DuT timestamps are corrected with them. Defaults to <name>-drift.csv next to the post file if it exists."):args(1)
+	parser:option("--key", "PCAP mode only! Fields which identify a packet, extracted natively instead of calling pkt-matcher.lua for each packet. See lua/moonsniff-key.lua for the syntax."):args(1)
+	parser:option("--threads", "Number of matching threads, 0 for all cores. PCAP mode is only multi-threaded with --key."):args(1):convert(tonumber):default(0)
+	parser:option("--id-bits", "MSCAP mode only! Number of lower bits of the identifier used to index the matching table. The table needs 16 bytes per possible identifier, captures with more packets are matched in rounds of a quarter of the table."):args(1):convert(tonumber):default(28):target("idBits")
+	parser:option("--series", "Write latency statistics per time window of the pre-DuT timestamps to this file (native matchers only). See src/latency-series.hpp for the format."):args(1)
+	parser:option("--series-window", "Window length of --series: 1ms, 100ms or 1s."):args(1):default("100ms"):target("seriesWindow")
+	parser:flag("--lua-matcher", "Use the single-threaded Lua matchers instead of the native ones."):target("luaMatcher")
+	parser:flag("--no-drift", "Do not correct the clock drift between pre and post timestamps."):target("noDrift")
 	parser:flag("-d --debug", "Create debug information. Instead of processing the input files normally, they are translated into human readable csv files.")
 	parser:flag("-p --profile", "Profile the application. May decrease the overall performance.")
 	return parser:parse()
@@ -85,6 +94,35 @@ function master(args)
 	print(PRE)
 	print(POST)
 
+	if args.series then
+		if args.luaMatcher or (MODE == MODE_PCAP and not args.key) then
+			log:fatal("--series is only supported by the native matchers, PCAP mode needs --key.")
+		end
+		local windows = { ["1ms"] = 1e6, ["100ms"] = 1e8, ["1s"] = 1e9 }
+		if not windows[args.seriesWindow] then
+			log:fatal("Invalid window length %s, use 1ms, 100ms or 1s.", args.seriesWindow)
+		end
+		args.seriesWindow = windows[args.seriesWindow]
+	end
+
+	-- correct the drift of the post-DuT clock relative to the pre-DuT clock
+	if not args.noDrift then
+		local driftFile = args.drift
+		if not driftFile then
+			-- only captures named like the ones of the capture script have a default drift file
+			local name, n = POST:gsub("%-post%.%a+$", "-drift.csv")
+			driftFile = n == 1 and name or nil
+		end
+		if driftFile then
+			args.clockCorrection = drift.load(driftFile)
+		end
+		if args.clockCorrection then
+			log:info("Correcting clock drift with %d offsets from %s", args.clockCorrection:size(), driftFile)
+		elseif args.drift then
+			log:fatal("Could not read clock offsets from %s", args.drift)
+		end
+	end
+
 
 	-- retrieve file size in order to give an estimation for the processing speed
 	local file = assert(io.open(PRE, "r"))
@@ -11,6 +11,8 @@ local stats  	= require "stats"
 local barrier 	= require "barrier"
 local pcap	= require "pcap"
 local ms	= require "moonsniff-io"
+local drift	= require "moonsniff-drift"
+local key	= require "moonsniff-key"
 
 local ffi    = require "ffi"
 local C = ffi.C
@@ -26,10 +28,15 @@ function configure(parser)
 	parser:option("-o --output", "Path to output file."):args(1):default("latencies")
 	parser:option("-t --time", "Sets the length of the measurement period in seconds."):args(1):convert(tonumber):default(10)
 	parser:option("--seq-offset", "Offset of the sequence number in bytes."):args(1):convert(tonumber)
+	parser:option("--key", "Fields which identify a packet, extracted natively for live and MSCAP mode instead of the payload identifier or --seq-offset. E.g. \"payload+0:4\" or \"hash:ip.src,ip.dst,l4.sport,l4.dport,ip.id\", see lua/moonsniff-key.lua."):args(1)
 	parser:flag("-l --live", "Do some live processing during packet capture. Lower performance than standard mode.")
+	parser:option("--id-bits", "Live mode only! Number of lower bits of the identifier used to match packets. The matching table needs 16 bytes per possible identifier."):args(1):convert(tonumber):default(24)
+	parser:option("--rx-queues", "Live mode only! Number of RX queues and cores per tap, packets are distributed with RSS. RSS hashes IP addresses and ports, so the test traffic needs to vary them."):args(1):convert(tonumber):default(1)
+	parser:option("--stats-interval", "Live mode only! Interval in seconds in which latency percentiles are printed during the capture, 0 to disable."):args(1):convert(tonumber):default(1)
 	parser:flag("-f --fast", "Set fast flag to reduce the amount of live processing for higher performance. Only has effect if live flag is also set")
 	parser:flag("-c --capture", "If set, all incoming packets are captured as a whole.")
 	parser:flag("-d --debug", "Insted of reading real input, some fake input is generated and written to the output files.")
+	parser:option("--drift-interval", "Interval in milliseconds in which the offset between the two clocks is measured during the capture, 0 to disable. The offsets are written to <output>-drift.csv and used by post-processing.lua, live mode corrects timestamps directly."):args(1):convert(tonumber):default(1000)
 	return parser:parse()
 end
 
@@ -38,13 +45,14 @@ function master(args)
 		-- used mainly to test functionality of io
 		iodebug(args)
 	else
-		args.dev[1] = device.config{port = args.dev[1], txQueues = 1, rxQueues = 1, rxDescs = 4096, dropEnable = false}
-		args.dev[2] = device.config{port = args.dev[2], txQueues = 1, rxQueues = 1, rxDescs = 4096, dropEnable = false}
+		if not args.live and args.rx_queues > 1 then
+			log:warn("Multiple RX queues are only supported in live mode, using one queue per tap.")
+			args.rx_queues = 1
+		end
+		local rxQueues = args.rx_queues
+		args.dev[1] = device.config{port = args.dev[1], txQueues = 1, rxQueues = rxQueues, rssQueues = rxQueues, rxDescs = 4096, dropEnable = false}
+		args.dev[2] = device.config{port = args.dev[2], txQueues = 1, rxQueues = rxQueues, rssQueues = rxQueues, rxDescs = 4096, dropEnable = false}
 		device.waitForLinks()
-		local dev0tx = args.dev[1]:getTxQueue(0)
-		local dev0rx = args.dev[1]:getRxQueue(0)
-		local dev1tx = args.dev[2]:getTxQueue(0)
-		local dev1rx = args.dev[2]:getRxQueue(0)
 
 		if args.live then
 			stats.startStatsTask{rxDevices = {args.dev[1], args.dev[2]}}
@@ -53,10 +61,16 @@ function master(args)
 			-- available for post-processing
 			stats.startStatsTask{rxDevices = {args.dev[1], args.dev[2]}, file = args.output .. "-stats.csv", format = "csv"}
 		end
-		args.dev[1]:enableRxTimestampsAllPackets(dev0rx)
-		args.dev[2]:enableRxTimestampsAllPackets(dev1rx)
+		for i = 0, rxQueues - 1 do
+			args.dev[1]:enableRxTimestampsAllPackets(args.dev[1]:getRxQueue(i))
+			args.dev[2]:enableRxTimestampsAllPackets(args.dev[2]:getRxQueue(i))
+		end
+
+		local bar = barrier:new(2 * rxQueues)
 
-		local bar = barrier:new(2)
+		if args.live then
+			C.ms_init(args.id_bits)
+		end
 
 		ts.syncClocks(args.dev[1], args.dev[2])
 		args.dev[1]:clearTimestamps()
@@ -65,13 +79,30 @@ function master(args)
 
 		-- start the tasks to sample incoming packets
 		-- correct mesurement requires a packet to arrive at Pre before Post
-		local receiver0 = lm.startTask("timestamp", dev0rx, args.dev[2], bar, true, args)
-		local receiver1 = lm.startTask("timestamp", dev1rx, args.dev[1], bar, false, args)
+		-- the matching table is shared, so pre and post packets of a flow may end up on different queues
+		local receivers = {}
+		for i = 0, rxQueues - 1 do
+			receivers[#receivers + 1] = lm.startTask("timestamp", args.dev[1]:getRxQueue(i), args.dev[2], bar, true, args)
+			receivers[#receivers + 1] = lm.startTask("timestamp", args.dev[2]:getRxQueue(i), args.dev[1], bar, false, args)
+		end
 
+		if args.live and args.stats_interval > 0 then
+			lm.startTask("liveStats", args)
+		end
 
-		receiver0:wait()
-		receiver1:wait()
+		-- the clocks drift apart during long captures, keep track of their offset
+		local tracker
+		if args.drift_interval > 0 then
+			tracker = lm.startTask("clockTracker", args.dev[1], args.dev[2], args)
+		end
+
+		for _, receiver in ipairs(receivers) do
+			receiver:wait()
+		end
 		lm.stop()
+		if tracker then
+			tracker:wait()
+		end
 
 		log:info("Finished all capturing/writing operations")
 
@@ -125,8 +156,8 @@ function timestamp(queue, otherdev, bar, pre, args)
 			filename = args.output .. "-post.mscap"
 		end
 
-		if not args.seq_offset then
-			log:error("Specify offset of sequence number with --seq-offset.")
+		if not args.seq_offset and not args.key then
+			log:error("Specify offset of sequence number with --seq-offset or the key with --key.")
 		else
 			bar:wait()
 			core_offline(queue, bufs, filename, args)
@@ -134,7 +165,31 @@ function timestamp(queue, otherdev, bar, pre, args)
 	end
 end
 
+function clockTracker(preDev, postDev, args)
+	local filename = not args.live and args.output .. "-drift.csv" or nil
+	drift.track(preDev, postDev, args.drift_interval, filename, args.live)
+end
+
+function liveStats(args)
+	local snap = ffi.new("struct ms_snapshot")
+	-- discard everything before the capture starts
+	C.ms_fetch_snapshot(snap)
+	local runtime = timer:new(args.time + 0.5)
+	while lm.running() and runtime:running() do
+		lm.sleepMillisIdle(args.stats_interval * 1000)
+		C.ms_fetch_snapshot(snap)
+		local received = tonumber(snap.hits + snap.misses)
+		log:info("[MoonSniff] %d packets, %d misses, %d invalid, latency [us]: avg %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f",
+			received, tonumber(snap.misses), tonumber(snap.inval_ts), snap.average_latency / 10^3,
+			tonumber(snap.p50_latency) / 10^3, tonumber(snap.p90_latency) / 10^3, tonumber(snap.p99_latency) / 10^3,
+			tonumber(snap.p999_latency) / 10^3, tonumber(snap.max_latency) / 10^3)
+	end
+end
+
 function core_online(queue, bufs, pre, hist, args)
+	if args.key then
+		return core_online_key(queue, bufs, pre, hist, args)
+	end
 	local runtime = timer:new(args.time + 0.5)
 	local lastTimestamp
 
@@ -163,8 +218,40 @@ function core_online(queue, bufs, pre, hist, args)
 
 end
 
+--- Live mode with native key extraction, packets are only touched in Lua for the inter-arrival histogram
+function core_online_key(queue, bufs, pre, hist, args)
+	local plan = key.compile(args.key)
+	local runtime = timer:new(args.time + 0.5)
+	local lastTimestamp
+
+	while lm.running() and runtime:running() do
+		local rx = queue:tryRecv(bufs, 1000)
+		if not args.fast then
+			for i = 1, rx do
+				local timestamp = bufs[i]:getTimestamp(queue.dev)
+				if timestamp then
+					if lastTimestamp and timestamp - lastTimestamp < 10^9 then
+						hist:update(timestamp - lastTimestamp)
+					end
+					lastTimestamp = timestamp
+				end
+			end
+		end
+		if pre then
+			plan:addPkts(bufs, rx)
+		else
+			plan:testPkts(bufs, rx)
+		end
+		bufs:free(rx)
+	end
+end
+
 function core_offline(queue, bufs, filename, args)
-	C.ms_log_pkts(queue.id, queue.qid, bufs.array, bufs.size, args.seq_offset, filename)
+	if args.key then
+		C.ms_log_pkts_key(queue.id, queue.qid, bufs.array, bufs.size, key.compile(args.key), filename)
+	else
+		C.ms_log_pkts(queue.id, queue.qid, bufs.array, bufs.size, args.seq_offset, filename)
+	end
 end
 
 function core_capture(queue, bufs, writer, args)
@@ -202,6 +289,11 @@ function printStats(args)
 	print("\tTotal loss: " .. ((misses + invalidTS)/(misses + hits)) * 100 .. "%")
 	print("Average latency: " .. tostring(tonumber(stats.average_latency)/10^3) .. " us")
 	print("Variance of latency: " .. tostring(tonumber(stats.variance_latency)/10^3) .. " us")
+	print("Latency percentiles:")
+	print("\t50th: " .. tostring(tonumber(stats.p50_latency)/10^3) .. " us")
+	print("\t99th: " .. tostring(tonumber(stats.p99_latency)/10^3) .. " us")
+	print("\t99.9th: " .. tostring(tonumber(stats.p999_latency)/10^3) .. " us")
+	print("\tMax: " .. tostring(tonumber(stats.max_latency)/10^3) .. " us")
 end
 
 function iodebug(args)
@@ -10,6 +10,7 @@ local ms     = require "moonsniff-io"
 local dpdk   = require "dpdk"
 local pcap   = require "pcap"
 local hmap   = require "hmap"
+local key    = require "moonsniff-key"
 
 local ffi    = require "ffi"
 local C = ffi.C
@@ -35,12 +36,16 @@ local mempool0 = nil
 local mempool1 = nil
 local next_mempool = 0 -- used to switch between mempool 0 and mempool 1
 
-local TABLE_TARGET_SIZE = 10000 -- approximate size for the used table
-local TABLE_THRESH_SIZE = 1000 -- if table size exceeds target size + thresh size the table will be searched for
-                               -- leftover entries which can be deleted
--- this value is dynamically increased during runtime
-local DELETION_THRESH = 1e9 -- delete entries only if their timestamp is this value of nanoseconds older
-                            -- than the latest entry which was successfully matched
+local TABLE_TARGET_SIZE = 10000 -- number of pre-DuT packets inserted before matching starts
+local BATCH_SIZE = 32 -- packets per batched hashmap operation
+local DELETION_THRESH = 1e9 -- unmatched pre-DuT entries expire when they are this many nanoseconds older
+                            -- than the newest pre-DuT packet
+
+-- optional correction of the post-DuT clock, see moonsniff-drift
+local correction
+
+-- native key extraction, replaces the user defined function in pkt-matcher.lua if set
+local keyPlan
 
 
 --- Main matching function
@@ -61,11 +66,68 @@ function mod.match(PRE, POST, args)
 		return
 	end
 
+	if args.key and not args.luaMatcher then
+		return matchNative(PRE, POST, args)
+	end
+
 	-- use new tbb matching mode
 	log:info("Using TBB")
+	correction = args.clockCorrection
+	if args.key then
+		keyPlan = key.compile(args.key)
+	end
 	return tbbCore(args, PRE, POST)
 end
 
+--- Match with the native pipeline, see src/moonsniff-match.cpp
+--- Packets are parsed from the pcap files directly and partitioned to worker threads by their key.
+function matchNative(PRE, POST, args)
+	log:info("Using native partitioned matching with %s worker threads", args.threads == 0 and "all" or args.threads)
+	local plan = key.compile(args.key)
+	local cfg = ffi.new("struct ms_pcap_match_config")
+	cfg.threads = args.threads
+	cfg.thresh = TIME_THRESH
+	cfg.expiry = DELETION_THRESH
+	local times, offsets
+	if args.clockCorrection then
+		local n = args.clockCorrection:size()
+		times = ffi.new("double[?]", n, args.clockCorrection.times)
+		offsets = ffi.new("double[?]", n, args.clockCorrection.offsets)
+		cfg.num_offsets = n
+		cfg.offset_times = times
+		cfg.offsets = offsets
+	end
+	if args.series then
+		cfg.series_file = args.series
+		cfg.series_window = args.seriesWindow
+	end
+
+	C.hs_initialize(args.nrbuckets)
+	local stats = ffi.new("struct ms_match_stats")
+	if not C.ms_match_pcap(PRE, POST, plan, cfg, stats) then
+		log:fatal("Matching failed")
+	end
+	C.hs_finalize()
+
+	log:info("Mean: " .. C.hs_getMean() .. " [ns], Variance: " .. C.hs_getVariance() .. " [ns]\n")
+	log:info("Pre: %d, post: %d, hits: %d, misses: %d, unmatched pre: %d, duplicate keys: %d",
+		tonumber(stats.pre_pkts), tonumber(stats.post_pkts), tonumber(stats.hits), tonumber(stats.misses),
+		tonumber(stats.expired), tonumber(stats.overwrites))
+	if stats.inval_ts > 0 then
+		log:warn("%d latencies were smaller than the threshold of %d ns and were ignored", tonumber(stats.inval_ts), TIME_THRESH)
+	end
+	if stats.skipped > 0 then
+		log:warn("Ignored %d packets without key fields or timestamp", tonumber(stats.skipped))
+	end
+	if stats.late > 0 then
+		log:warn("%d packets arrived after their window of the latency series was written", tonumber(stats.late))
+	end
+	C.hs_write(args.output .. ".csv")
+	C.hs_destroy()
+
+	return tonumber(stats.pre_pkts + stats.post_pkts + stats.skipped)
+end
+
 --- Determine the absolute path of this script
 --- Needed because relative paths do not work, depending on the working directory
 function script_path()
@@ -135,18 +197,20 @@ end
 
 
 --- Prepare HashMap for operation
---- Initializes buffers
+--- Initializes the buffers for batches of keys, pre-DuT and post-DuT timestamps and the found flags
 function initHashMap()
 	-- we need the values everywhere, therefore, global
-	tbbmap = hmap.createHashmap(SCR_SIZE, 8)
+	-- only this thread uses the map, the flat backend avoids the locking of the TBB map
+	tbbmap = hmap.createHashmap(SCR_SIZE, 8, { backend = "flat", hash = "fast", expectedSize = 2 * TABLE_TARGET_SIZE })
 	tbbmap:clear()
-	acc = tbbmap.newAccessor()
-	local keyBuf = createBytes(SCR_SIZE)
+	tbbmap:setTTL(DELETION_THRESH)
+	local keys = createBytes(SCR_SIZE * BATCH_SIZE)
 
 	-- 8 byte timestamps
-	local tsBuf = createBytes(8)
-	tsBuf = ffi.cast(ffi.typeof("uint64_t *"), tsBuf)
-	return keyBuf, tsBuf
+	local preTs = ffi.cast(UINT64_P, createBytes(8 * BATCH_SIZE))
+	local postTs = ffi.cast(UINT64_P, createBytes(8 * BATCH_SIZE))
+	local found = createBytes(BATCH_SIZE)
+	return keys, preTs, postTs, found
 end
 
 --- Create a non garbage collected zero initialized byte array
@@ -172,6 +236,13 @@ end
 -- @param tsBuf a buffer into which the timestamp is copied
 -- @param pre, true if pre-DuT packet, false otherwise
 function extractData(cap, keyBuf, tsBuf, pre)
+	if keyPlan then
+		-- packets without the key fields get an all-zero key, like packets the user defined function ignores
+		keyPlan:extract(cap, keyBuf)
+		tsBuf[0] = getTs(cap)
+		return
+	end
+
 	-- zero fill scratchpad again
 	ffi.fill(scratchpad, SCR_SIZE)
 
@@ -184,62 +255,67 @@ function extractData(cap, keyBuf, tsBuf, pre)
 end
 
 
---- Adds a given value to the HashMap
---- Should be called for pre-DuT packets
+--- Adds a batch of pre-DuT packets to the HashMap
+--- Old unmatched entries are expired incrementally by the map
 --
--- @param cap, the corresponding mbuf for the packet
--- @param keyBuf, reusable buffer for keys. Need not be zero initialized
--- @param tsBuf, reusable buffer for timestamps. Need not be zero initalized
-function addKeyVal(cap, keyBuf, tsBuf)
-	extractData(cap, keyBuf, tsBuf, true)
-
-	-- add the data to the hashmap
-	tbbmap:access(acc, keyBuf)
-	ffi.copy(acc:get(), tsBuf, 8)
-
-	acc:release()
+-- @param reader, the pre-DuT reader
+-- @param cap, the next pre-DuT mbuf
+-- @param keys, buffer for BATCH_SIZE keys
+-- @param preTs, buffer for BATCH_SIZE timestamps
+-- @return the next pre-DuT mbuf, the number of added packets
+function addBatch(reader, cap, keys, preTs)
+	local n = 0
+	while cap and n < BATCH_SIZE do
+		extractData(cap, keys + n * SCR_SIZE, preTs + n, true)
+		sfree(cap)
+		cap = readSingle(reader)
+		n = n + 1
+	end
+	tbbmap:insertBatch(keys, preTs, n)
+	return cap, n
 end
 
 
---- Try to find a match in the table for a given key
---- The key is extracted from the mbuf representing a post-DuT device
+--- Try to find matches in the table for a batch of post-DuT packets
+--- Matched entries are removed from the table
 --
--- @param cap, the post-DuT mbuf
+-- @param reader, the post-DuT reader
+-- @param cap, the next post-DuT mbuf
 -- @param misses, counter for all misses
--- @param keyBuf, reusable buffer for keys. Need not be zero initialized
--- @param tsBuf, reusable buffer for timestamps. Need not be zero initalized
--- @param lastHit, timestamp of the last successful matching operation
--- @param tableSize, the current number of entries in the table
-function getKeyVal(cap, misses, keyBuf, tsBuf, lastHit, tableSize)
-	extractData(cap, keyBuf, tsBuf, false)
-
-	local found = tbbmap:find(acc, keyBuf)
-	if found then
-		local pre_ts = acc:get()
-		local post_ts = tsBuf
-
-		pre_ts = ffi.cast(UINT64_P, pre_ts)
-
-		local diff = ffi.cast(INT64_T, post_ts[0] - pre_ts[0])
-
-		if diff < TIME_THRESH then
-			log:warn("Got latency smaller than defined thresh value")
-			log:warn("Pre: " .. tostring(pre_ts[0]) .. "; post: " .. tostring(post_ts[0]))
-			log:warn("Difference: " .. tostring(diff) .. ", thresh: " .. tostring(TIME_THRESH))
-		else
-			C.hs_update(diff)
+-- @param keys, buffer for BATCH_SIZE keys
+-- @param preTs, buffer for BATCH_SIZE timestamps
+-- @param postTs, buffer for BATCH_SIZE timestamps
+-- @param found, buffer for BATCH_SIZE flags
+-- @return the next post-DuT mbuf, the number of processed packets, misses
+function matchBatch(reader, cap, misses, keys, preTs, postTs, found)
+	local n = 0
+	while cap and n < BATCH_SIZE do
+		extractData(cap, keys + n * SCR_SIZE, postTs + n, false)
+		if correction then
+			postTs[n] = correction:apply(postTs[n])
 		end
-
-		-- delete associated data
-		tbbmap:erase(acc)
-
-		acc:release()
-		tableSize = tableSize - 1
-	else
-		misses = misses + 1
+		sfree(cap)
+		cap = readSingle(reader)
+		n = n + 1
 	end
 
-	return misses, lastHit, tableSize
+	tbbmap:findEraseBatch(keys, preTs, found, n)
+	for i = 0, n - 1 do
+		if found[i] ~= 0 then
+			local diff = ffi.cast(INT64_T, postTs[i] - preTs[i])
+
+			if diff < TIME_THRESH then
+				log:warn("Got latency smaller than defined thresh value")
+				log:warn("Pre: " .. tostring(preTs[i]) .. "; post: " .. tostring(postTs[i]))
+				log:warn("Difference: " .. tostring(diff) .. ", thresh: " .. tostring(TIME_THRESH))
+			else
+				C.hs_update(diff)
+			end
+		else
+			misses = misses + 1
+		end
+	end
+	return cap, n, misses
 end
 
 
@@ -252,10 +328,8 @@ function tbbCore(args, PRE, POST)
 	-- initialize scratchpad and mbufs
 	setUp()
 	C.hs_initialize(args.nrbuckets)
-	local keyBuf, tsBuf = initHashMap()
+	local keys, preTs, postTs, found = initHashMap()
 
-	local lastHit = 0
-	local tableSize = 0
 	local packets = 0
 
 	log:info("finished init")
@@ -265,47 +339,30 @@ function tbbCore(args, PRE, POST)
 	log:info("initialized reader")
 
 	-- prefilling
-	local ctr = TABLE_TARGET_SIZE
-	while precap and ctr > 0 do
-		addKeyVal(precap, keyBuf, tsBuf)
-		tableSize = tableSize + 1
-		-- log:info("added key")
-		sfree(precap)
-		-- log:info("freeing")
-		precap = readSingle(prereader)
-		ctr = ctr - 1
-		packets = packets + 1
+	local n, m
+	while precap and packets < TABLE_TARGET_SIZE do
+		precap, n = addBatch(prereader, precap, keys, preTs)
+		packets = packets + n
 	end
 
 
 	local postcap = readSingle(postreader)
 	local misses = 0
-	local trash = 0
 	-- map is now hot
 	while precap and postcap do
-		addKeyVal(precap, keyBuf, tsBuf)
-		tableSize = tableSize + 1
-		sfree(precap)
-		precap = readSingle(prereader)
+		precap, n = addBatch(prereader, precap, keys, preTs)
 
 		-- now try match
-		misses, lastHit, tableSize = getKeyVal(postcap, misses, keyBuf, tsBuf, lastHit, tableSize)
-		sfree(postcap)
-		postcap = readSingle(postreader)
-
-		-- remove old values if table is too big
-		tableSize = checkClean(lastHit, tableSize)
+		postcap, m, misses = matchBatch(postreader, postcap, misses, keys, preTs, postTs, found)
 
-		packets = packets + 2
+		packets = packets + n + m
 	end
 
 	-- process leftovers
 	while postcap do
-		misses, lastHit, tableSize = getKeyVal(postcap, misses, keyBuf, tsBuf, lastHit, tableSize)
-		sfree(postcap)
-		postcap = readSingle(postreader)
+		postcap, m, misses = matchBatch(postreader, postcap, misses, keys, preTs, postTs, found)
 
-		packets = packets + 1
+		packets = packets + m
 	end
 
 
@@ -320,6 +377,8 @@ function tbbCore(args, PRE, POST)
 	log:info("Mean: " .. C.hs_getMean() .. " [ns], Variance: " .. C.hs_getVariance() .. " [ns]\n")
 
 	log:info("Misses: " .. misses)
+	local mem = tbbmap:memory()
+	log:info("Unmatched pre-DuT packets left in the table: %d (%.1f MiB, load factor %.2f)", mem.entries, mem.bytes / 2^20, mem.loadFactor)
 	C.hs_write(args.output .. ".csv")
 	C.hs_destroy()
 
@@ -327,24 +386,6 @@ function tbbCore(args, PRE, POST)
 end
 
 
---- Check current table size and try to delete old entries if size exceeded threshold
---
--- @param lastHist, the timestamp of the last successful matching operation
--- @param tableSize, the current number of entries in the table
-function checkClean(lastHit, tableSize)
-	if tableSize > TABLE_TARGET_SIZE + TABLE_THRESH_SIZE then
-		log:info("Cleaning: ")
-		local cleaned = tbbmap:clean(math.max(lastHit - DELETION_THRESH, 0))
-		tableSize = tableSize - cleaned
-		log:info("Finished cleaning")
-		if cleaned == 0 then
-			TABLE_THRESH_SIZE = TABLE_THRESH_SIZE * 1.4
-		end
-	end
-	return tableSize
-end
-
-
 --- Write up to range entries from the pcap file as human readable csv file
 --
 -- @param infile, name of the pcap file
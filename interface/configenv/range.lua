@@ -1,3 +1,6 @@
+local dynvars = require "flow.dynvars"
+
+-- the functions are described for the native updates of dynamic fields, see flow/dynvars.lua
 return function(env)
 
 	function env.range(start, limit, step)
@@ -5,13 +8,13 @@ return function(env)
 		local v = start - step
 
 		if not limit then
-			return function()
+			return dynvars.describe(function()
 				v = v + step
 				return v
-			end
+			end, { "counter", start, step })
 		end
 
-		return function()
+		return dynvars.describe(function()
 			if v > limit then
 				v = start
 			else
@@ -19,18 +22,18 @@ return function(env)
 			end
 
 			return v
-		end
+		end, { "counter", start, step, limit })
 	end
 
 	function env.randomRange(start, limit)
-		return function()
+		return dynvars.describe(function()
 			return math.random(start, limit)
-		end
+		end, { "random", start, limit })
 	end
 
 	function env.list(tbl)
 		local index, len = 1, #tbl
-		return function()
+		return dynvars.describe(function()
 			local v = tbl[index]
 
 			index = index + 1
@@ -39,13 +42,13 @@ return function(env)
 			end
 
 			return v
-		end
+		end, { "list", tbl })
 	end
 
 	function env.randomList(tbl)
 		local len = #tbl
-		return function()
+		return dynvars.describe(function()
 			return tbl[math.random(len)]
-		end
+		end, { "randomList", tbl })
 	end
 end
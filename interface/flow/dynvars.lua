@@ -1,5 +1,8 @@
+local ffi   = require "ffi"
 local proto = require "proto.proto"
 
+local mutator = require "packet-mutator"
+
 local dynvar = {}
 dynvar.__index = dynvar
 
@@ -12,6 +15,32 @@ local _aliases = {
 	ethouterVlanId = proto.eth.qinq.metatype.setOuterVlanTag,
 	ethouterVlanTag = proto.eth.qinq.metatype.setOuterVlanTag,
 }
+-- generators of functions which can be reproduced natively, see dynvars.describe
+local _specs = setmetatable({}, { __mode = "k" })
+
+-- fields the native mutator can write, their size and the checksums covering them
+local _native_fields = {
+	ethSrc = { width = 6 }, ethDst = { width = 6 },
+	ip4Src = { width = 4, ip4 = true, l4 = true }, ip4Dst = { width = 4, ip4 = true, l4 = true },
+	udpSrc = { width = 2, l4 = true }, udpDst = { width = 2, l4 = true },
+	tcpSrc = { width = 2, l4 = true }, tcpDst = { width = 2, l4 = true },
+}
+
+ffi.cdef[[
+	typedef struct {
+		uint8_t data[256];
+	} dynvar_probe_t;
+]]
+
+local dynvar_probe = ffi.metatype("dynvar_probe_t", {
+	__index = {
+		getLength = function() return 256 end,
+		getData = function(self)
+			return voidPtrType(self.data) -- luacheck: globals voidPtrType
+		end,
+	}
+})
+
 local function _find_setter(pkt, var)
 	local alias = _aliases[pkt .. var]
 	if alias then
@@ -22,10 +51,12 @@ local function _find_setter(pkt, var)
 end
 
 local function _new_dynvar(pkt, var, func)
-	local self = { pkt = pkt, var = var, func = func }
+	local self = { pkt = pkt, var = var, func = func, spec = _specs[func] }
 	self.applyfn = _find_setter(pkt, var)
 	assert(self.applyfn, pkt .. var)
 	self.value = func()
+	-- position in the sequence of a counter or list for the native mutator
+	self.calls = 1
 
 	return setmetatable(self, dynvar)
 end
@@ -33,6 +64,7 @@ end
 function dynvar:update()
 	local v = self.func()
 	self.value = v
+	self.calls = self.calls + 1
 	return v
 end
 
@@ -48,6 +80,16 @@ end
 local dynvars, dv_final = {}, {}
 dynvars.__index, dv_final.__index = dynvars, dv_final
 
+--- Describe the values returned by func, the native mutator (dv_final:compile) can only update described fields.
+-- spec is one of
+--   { "counter", start, step, limit }: the sequence of range() in configenv/range.lua, limit can be nil
+--   { "random", min, max }: math.random(min, max)
+--   { "list", values } and { "randomList", values }: values in order or picked randomly
+function dynvars.describe(func, spec)
+	_specs[func] = spec
+	return func
+end
+
 function dynvars.new()
 	local self = {
 		index = {}, count = 0
@@ -98,4 +140,141 @@ function dv_final:updateApplyAll(pkt)
 	end
 end
 
+local function _isInt(v)
+	return type(v) == "number" and v % 1 == 0
+end
+
+-- returns the generator of a dynvar for the mutator or nil
+local function _generator(dv)
+	local spec = dv.spec
+	if not spec then
+		return
+	end
+	local kind = spec[1]
+	if kind == "counter" then
+		local start, step, limit = spec[2], spec[3], spec[4]
+		if not _isInt(start) or not _isInt(step) or (limit and (not _isInt(limit) or step <= 0)) then
+			return
+		end
+		local count = 0
+		if limit then
+			-- range() returns the first value above the limit before wrapping
+			count = limit >= start and math.floor((limit - start) / step) + 2 or 1
+		end
+		return function(m, field)
+			m:setCounter(field, start, step, count, count > 0 and dv.calls % count or dv.calls, dv.value)
+		end
+	elseif kind == "random" then
+		local min, max = spec[2], spec[3]
+		if not _isInt(min) or not _isInt(max) or min > max then
+			return
+		end
+		return function(m, field)
+			m:setRandom(field, min, max, dv.value)
+		end
+	elseif kind == "list" or kind == "randomList" then
+		local values = spec[2]
+		if #values == 0 then
+			return
+		end
+		for _, v in ipairs(values) do
+			if not _isInt(v) then
+				return
+			end
+		end
+		return function(m, field)
+			m:setList(field, values, kind == "randomList", dv.calls % #values, dv.value)
+		end
+	end
+end
+
+-- offset and byte order of a field, found by writing a pattern with the Lua setter to an empty packet
+local function _probe(getPacket, dv, width)
+	local probe = dynvar_probe()
+	local pattern = 0
+	for i = 1, width do
+		pattern = pattern * 256 + i
+	end
+	if not pcall(dv.applyfn, getPacket(probe)[dv.pkt], pattern) then
+		return
+	end
+	local offset
+	for i = 0, 255 do
+		if probe.data[i] ~= 0 then
+			offset = i
+			break
+		end
+	end
+	if not offset or offset + width > 256 then
+		return
+	end
+	local be, le = true, true
+	for i = 0, width - 1 do
+		be = be and probe.data[offset + i] == i + 1
+		le = le and probe.data[offset + i] == width - i
+	end
+	for i = offset + width, 255 do
+		if probe.data[i] ~= 0 then
+			return
+		end
+	end
+	if be or le then
+		return offset, be
+	end
+end
+
+-- offset of a header in the packet or nil if it does not have it
+local function _layer(pkt, name)
+	local ok, hdr = pcall(function() return pkt[name] end)
+	if ok then
+		return tonumber(ffi.cast("uint8_t*", hdr) - ffi.cast("uint8_t*", pkt))
+	end
+end
+
+--- Native updates of the fields with the semantics of a mode of interface/options/mode.lua.
+-- Only described values (see dynvars.describe) of Ethernet and IPv4 addresses and UDP and TCP ports are supported,
+-- returns nil if a field is not. The first packet is left unchanged like with the Lua modes.
+-- @param getPacket packet getter of the flow
+-- @param mode name of the update mode
+-- @return a mutator, see lua/packet-mutator.lua
+function dv_final:compile(getPacket, mode)
+	if not mutator.modes[mode] or self.count == 0 then
+		return
+	end
+
+	local pkt = getPacket(dynvar_probe())
+	local ip4 = _layer(pkt, "ip4")
+	local udp, tcp = _layer(pkt, "udp"), _layer(pkt, "tcp")
+
+	local fields = {}
+	for i = 1, self.count do
+		local dv = self[i]
+		local native = _native_fields[dv.pkt .. dv.var]
+		local gen = native and _generator(dv)
+		local offset, bigEndian
+		if gen then
+			offset, bigEndian = _probe(getPacket, dv, native.width)
+		end
+		if not offset then
+			return
+		end
+		fields[i] = { native = native, gen = gen, offset = offset, bigEndian = bigEndian }
+	end
+
+	local m = mutator.new(mode, 1)
+	for _, f in ipairs(fields) do
+		local field = m:addField(f.offset, f.native.width, f.bigEndian)
+		f.gen(m, field)
+		if f.native.ip4 and ip4 then
+			m:addChecksum(field, ip4 + 10)
+		end
+		if f.native.l4 and udp then
+			m:addChecksum(field, udp + 6, true)
+		elseif f.native.l4 and tcp then
+			m:addChecksum(field, tcp + 16)
+		end
+	end
+	return m
+end
+
 return dynvars
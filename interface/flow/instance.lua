@@ -14,6 +14,10 @@ function Flow:prepare(error, final)
 	self.isDynamic = type(self.updatePacket) ~= "nil"
 	self.packet:prepare(error, self, final)
 
+	-- the gaps of crc rate control are stored in the mbufs, replayed packets are shared by several entries of a batch
+	error:assertInvalidate(not (self:option "replay" and self:option "rateControl" == "crc"),
+		"Option 'replay' cannot be combined with rateControl 'crc'.")
+
 	if self:option "uniquePayload" then
 		local p0, p1, p2, p3 = separateUid(self:option "uid")
 		local size = self:packetSize()
@@ -62,6 +66,13 @@ function Flow:updateBuf(buf)
 	return pkt
 end
 
+-- native updates of the dynamic fields or nil if the flow has to use updateBuf
+function Flow:getMutator()
+	if self.isDynamic and self.updateMode then
+		return self.packet.dynvars:compile(self.packet.getPacket, self.updateMode)
+	end
+end
+
 function Flow:packetSize(checksum)
 	return (self.packet.fillTbl.pktLength or 0) + (checksum and 4 or 0)
 end
@@ -23,6 +23,7 @@ function configure(parser) -- luacheck: globals configure
 	local start = parser:command("start", "Send one or more flows.")
 	start:option("-c --config", "Config file directory."):default("flows")
 	start:option("-o --output", "Output directory (histograms etc.)."):default(".")
+	start:option("--limiter-flows", "Number of flows that share a core for software rate limiting."):default(1):convert(tonumber)
 	start:argument("flows", "List of flow names."):args "+"
 
 	require "cli" (parser)
@@ -68,7 +69,7 @@ function master(args) -- luacheck: globals master
 	arpThread.start(devices)
 	deviceStatsThread.start(devices)
 	countThread.start(devices)
-	loadThread.start(devices)
+	loadThread.start(devices, args.limiter_flows)
 	timestampThread.start(devices, args.output)
 
 	mg.waitForTasks()
@@ -1,7 +1,7 @@
 local options = {}
 
 for _,v in ipairs {
-	"rate", "ratePattern", "uniquePayload", "timestamp", "uid", "mode", "dataLimit", "timeLimit"
+	"rate", "ratePattern", "rateControl", "uniquePayload", "timestamp", "uid", "mode", "replay", "dataLimit", "timeLimit"
 } do
   options[v] =  require("options." .. v)
 end
@@ -95,13 +95,17 @@ function option.parse(self, mode, error)
 
 	local t = type(mode)
 	if t == "string" then
-		mode = error:assert(_valid_modes[string.lower(mode)], "Invalid value %q. Can be one of %s.",
+		-- name of the mode for the native updates, see flow/dynvars.lua
+		self.updateMode = string.lower(mode)
+		mode = error:assert(_valid_modes[self.updateMode], "Invalid value %q. Can be one of %s.",
 			mode, table.concat(_modelist, ", "))
 
 		if mode then
 			mode = mode()
 		end
-	elseif t ~= "function" and t ~= "nil" then
+	elseif t == "nil" then
+		self.updateMode = "single"
+	elseif t ~= "function" then
 		error("Invalid argument. String or function expected, got %s.", t)
 	end
 
@@ -0,0 +1,29 @@
+local _backendlist, _backendset = { "auto", "software", "crc" }, {}
+for _,v in ipairs(_backendlist) do
+	_backendset[v] = true
+end
+
+local option = {}
+
+option.description = "Select how the rate limit of this flow is enforced. (default = auto)"
+option.usage = {
+	{ "auto", "Hardware rate limiting for cbr, falls back to a software rate limiter if unsupported." },
+	{ "software", "Always use a software rate limiter on a separate core." },
+	{ "crc", "Fill the gaps between packets with CRC-invalid packets in the load thread itself."
+		.. " Works for all rate patterns, requires a patched driver." },
+}
+
+function option.parse(_, backend, error)
+	if not backend then
+		return "auto"
+	end
+
+	if not error:assert(_backendset[backend], "Invalid value %q. Can be one of %s.",
+	  tostring(backend), table.concat(_backendlist, ", ")) then
+		return "auto"
+	end
+
+	return backend
+end
+
+return option
@@ -1,6 +1,7 @@
-local _patternlist, _patternset = { "cbr", "poisson" }, {}
+local arrival = require "arrival-process"
+
+local _patternlist, _patternset = arrival.patterns, {}
 -- TODO pattern = custom (closure and buf:setDelay)
--- TODO flagOption to enable crc ratecontrol
 for _,v in ipairs(_patternlist) do
 	_patternset[v] = true
 end
@@ -8,21 +9,42 @@ end
 local option = {}
 
 option.description = "Control how bytes are distributed over time, when a ratelimit is set."
+option.configHelp = "Will also accept a table with the pattern name as first element and its"
+	.. " parameters, e.g. {\"pareto\", shape = 1.2}. Parameters: onoff: burst (mean packets"
+	.. " per burst), ratio (gap inside bursts relative to the average gap); pareto: shape;"
+	.. " uniform: jitter (max deviation relative to the average gap); empirical: cdf (list of"
+	.. " {value, probability} pairs, rescaled to the configured rate)."
 option.usage = {
-	{ "(cbr|poisson)", "Poisson will create bursts of packets instead of a constant bitrate. (default = cbr)" }
+	{ "(" .. table.concat(_patternlist, "|") .. ")",
+		"Stochastic patterns will create bursts of packets instead of a constant bitrate. (default = cbr)" }
 }
 
 function option.parse(_, pattern, error)
 	local t = type(pattern)
 
 	if t == "string" then
-		return error:assert(_patternset[pattern], "Invalid value %q. Can be one of %s.",
-		  pattern, table.concat(_patternlist, ", ")) or "cbr"
+		if not error:assert(_patternset[pattern], "Invalid value %q. Can be one of %s.",
+		  pattern, table.concat(_patternlist, ", ")) then
+			return { "cbr" }
+		end
+		error:assert(pattern ~= "empirical", "Pattern empirical requires a cdf, pass a table instead.")
+		return { pattern }
+	elseif t == "table" then
+		local name = pattern[1]
+		if not error:assert(_patternset[name], "Invalid pattern %q. Can be one of %s.",
+		  tostring(name), table.concat(_patternlist, ", ")) then
+			return { "cbr" }
+		end
+		error:assert(name ~= "empirical" or type(pattern.cdf) == "table",
+			"Pattern empirical requires a cdf.")
+		error:assert(name ~= "pareto" or not pattern.shape or pattern.shape > 1,
+			"Pareto shape has to be > 1.")
+		return pattern
 	elseif t ~= "nil" then
-		error("Invalid argument. String expected, got %s.", t)
+		error("Invalid argument. String or table expected, got %s.", t)
 	end
 
-	return "cbr"
+	return { "cbr" }
 end
 
 return option
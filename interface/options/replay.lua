@@ -0,0 +1,35 @@
+local units = require "units"
+
+-- longest cycle replayed by default
+local _default_max = 2 ^ 20
+
+local option = {}
+
+option.description = "Generate one period of the packets of this flow at startup and send these"
+	.. " packets over and over again instead of filling and updating buffers. (default = false)"
+	.. "\nOnly works if the packets repeat: dynamic fields have to be counters with a limit or lists"
+	.. " updated by one of the modes all, single or alternating, see 'help mode'."
+	.. " The size of the mempool holding the cycle is logged at start."
+	.. " Cannot be combined with the rate control 'crc'."
+option.configHelp = "Will also accept boolean values and numbers."
+option.usage = {
+	{ "<boolean>", "Replay cycles of up to 2^20 packets." },
+	{ "<number>", "Replay cycles of up to this many packets." },
+	{ nil, "Set option to true." },
+}
+
+function option.parse(_, value, error)
+	local num = tonumber(value)
+	if num and not units.bool[value] then
+		if error:assert(num >= 1 and num % 1 == 0, "Invalid number of packets %s.", tostring(value)) then
+			return num
+		end
+		return
+	end
+
+	if units.parseBool(value, false, error) then
+		return _default_max
+	end
+end
+
+return option
@@ -1,9 +1,13 @@
+local ffi     = require "ffi"
 local dpdkc   = require "dpdkc"
 local limiter = require "software-ratecontrol"
+local arrival = require "arrival-process"
 local memory  = require "memory"
 local mg      = require "moongen"
 local timer   = require "timer"
 local stats   = require "stats"
+local log     = require "log"
+local pktMutator = require "packet-mutator"
 
 local Flow = require "flow"
 
@@ -18,35 +22,135 @@ function thread.prepare(flows, devices)
 	end
 end
 
-function thread.start(devices)
+function thread.start(devices, flowsPerLimiter)
+	-- software rate limiters of up to flowsPerLimiter flows share a single core
+	local group
+	local function softwareLimiter(txQueue, pattern, delay)
+		if not flowsPerLimiter or flowsPerLimiter <= 1 then
+			return limiter:new(txQueue, pattern, delay)
+		end
+		if not group or group.size >= flowsPerLimiter then
+			if group then
+				group:start()
+			end
+			group = limiter:newGroup()
+		end
+		return group:new(txQueue, pattern, delay)
+	end
+
 	for _,flow in ipairs(thread.flows) do
 		local txQueue = devices:txQueue(flow:property "tx_dev")
 
-		-- setup rate limit
-		if flow:option "rate" then
-			if flow:option "ratePattern" == "cbr" then
+		-- setup rate limit, crc rate control runs in the load thread itself
+		if flow:option "rate" and flow:option "rateControl" ~= "crc" then
+			local pattern = flow:option "ratePattern"
+			if pattern[1] == "cbr" and flow:option "rateControl" == "auto" then
 				local rc = dpdkc.rte_eth_set_queue_rate_limit(txQueue.id, txQueue.qid, flow:option "rate")
 				if rc ~= 0 then -- fallback to software ratelimiting
-					txQueue = limiter:new(txQueue, "cbr", flow:getDelay())
+					txQueue = softwareLimiter(txQueue, "cbr", flow:getDelay())
 				end
-			elseif flow.results.ratePattern == "poisson" then
-				txQueue = limiter:new(txQueue, "poisson", flow:getDelay())
+			else
+				txQueue = softwareLimiter(txQueue, pattern, flow:getDelay())
 			end
 		end
 
 		mg.startTask("__INTERFACE_LOAD", flow, txQueue)
 	end
+
+	if group then
+		group:start()
+	end
+end
+
+-- inline rate control by filling the gaps between packets with CRC-invalid packets
+local function crcRateControl(flow, txQueue, name)
+	local delay = flow:getDelay()
+	local proc = ffi.gc(arrival.new(flow:option "ratePattern"), ffi.C.mg_arrival_delete)
+	-- ns to bytes on the wire, link speed is in mbit/s
+	local targetBytes = delay * txQueue.dev:getLinkStatus().speed / 8000
+	-- the driver uses the rate in mpps to choose the minimum filler size
+	local targetRate = 1000 / delay
+	local carry = ffi.new("double[1]")
+	txQueue:enableFillerCache()
+
+	local counter = stats:newManualTxCounter(name .. " fillers", "plain")
+	local lastPkts, lastBytes = txQueue:getFillerStats()
+
+	local crc = {}
+
+	function crc.send(bufs, n)
+		n = n or bufs.size
+		ffi.C.mg_arrival_set_gaps(proc, bufs.array, n, targetBytes, carry)
+		txQueue:sendWithDelay(bufs, targetRate, n)
+		local pkts, bytes = txQueue:getFillerStats()
+		counter:update(pkts - lastPkts, bytes - lastBytes)
+		lastPkts, lastBytes = pkts, bytes
+	end
+
+	function crc.finalize()
+		txQueue:disableFillerCache()
+		counter:finalize()
+	end
+
+	return crc
+end
+
+-- mempools need more elements than 1.5 times their per-core cache
+local REPLAY_MIN_POOL = 511
+
+-- generate one period of the packets of the flow into a dedicated mempool, nil if they do not repeat soon enough
+local function replayCycle(flow, mutator, name)
+	local max = flow:option "replay"
+	local period = 1
+	if mutator then
+		period = mutator:period(max)
+	elseif flow.isDynamic then
+		period = 0
+	end
+	if period == 0 then
+		log:warn("%s: the packets do not repeat within %d packets, they are generated while sending.", name, max)
+		return
+	end
+
+	local size = flow:packetSize()
+	local mempool = memory.createMemPool{
+		n = math.max(period, REPLAY_MIN_POOL),
+		-- the packets are never resized
+		bufSize = math.ceil(size / 64) * 64,
+		func = function(buf) flow:fillBuf(buf) end,
+	}
+	local bufs = mempool:bufArray(period)
+	bufs:alloc(size)
+	if mutator then
+		mutator:generate(bufs)
+	end
+	bufs:offloadUdpChecksums()
+
+	local cycle = pktMutator.newCycle(bufs)
+	log:info("%s: replaying %d packets from a mempool of %.1f MiB.", name, period, cycle:memory() / 2^20)
+	return cycle
 end
 
 local function loadThread(flow, sendQueue)
 	flow = Flow.restore(flow)
 
-	local counter = stats:newPktTxCounter(
-		("Flow: dev=%d uid=%#x"):format(flow:property "tx_dev", flow:option "uid")
-	)
+	local name = ("Flow: dev=%d uid=%#x"):format(flow:property "tx_dev", flow:option "uid")
+	local counter = stats:newPktTxCounter(name)
+
+	local crc
+	if flow:option "rate" and flow:option "rateControl" == "crc" then
+		crc = crcRateControl(flow, sendQueue, name)
+	end
 
-	local mempool = memory.createMemPool(function(buf) flow:fillBuf(buf) end)
-	local bufs = mempool:bufArray()
+	local mutator = flow:getMutator()
+	local cycle = flow:option "replay" and replayCycle(flow, mutator, name)
+	local bufs
+	if cycle then
+		bufs = memory.bufArray()
+	else
+		local mempool = memory.createMemPool(function(buf) flow:fillBuf(buf) end)
+		bufs = mempool:bufArray()
+	end
 
 	-- dataLimit in packets, timeLimit in seconds
 	local data, runtime = flow:option "dataLimit", nil
@@ -57,25 +161,42 @@ local function loadThread(flow, sendQueue)
 	flow:property("counter"):inc()
 
 	while mg.running() and (not runtime or runtime:running()) do
-		bufs:alloc(flow:packetSize())
-
-		if flow.isDynamic then
-			for _, buf in ipairs(bufs) do
-				flow:updateBuf(buf)
-				counter:countPacket(buf)
+		if cycle then
+			-- the packets are ready to send including the checksum offloading
+			cycle:next(bufs)
+			counter:updateWithSize(bufs.size, flow:packetSize())
+		else
+			bufs:alloc(flow:packetSize())
+
+			if mutator then
+				mutator:apply(bufs)
+				counter:updateWithSize(bufs.size, flow:packetSize())
+			elseif flow.isDynamic then
+				for _, buf in ipairs(bufs) do
+					flow:updateBuf(buf)
+					counter:countPacket(buf)
+				end
 			end
+			bufs:offloadUdpChecksums()
 		end
 
 		if data then
 			data = data - bufs.size
 			if data <= 0 then
-				sendQueue:sendN(bufs, bufs.size + data)
+				if crc then
+					crc.send(bufs, bufs.size + data)
+				else
+					sendQueue:sendN(bufs, bufs.size + data)
+				end
 				break
 			end
 		end
 
-		bufs:offloadUdpChecksums()
-		sendQueue:send(bufs)
+		if crc then
+			crc.send(bufs)
+		else
+			sendQueue:send(bufs)
+		end
 
 		counter:update()
 	end
@@ -87,6 +208,9 @@ local function loadThread(flow, sendQueue)
 	end
 
 	counter:finalize()
+	if crc then
+		crc.finalize()
+	end
 end
 
 __INTERFACE_LOAD = loadThread -- luacheck: globals __INTERFACE_LOAD
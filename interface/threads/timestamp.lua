@@ -1,4 +1,4 @@
-local hist   = require "histogram"
+local hist   = require "native-histogram"
 local mg     = require "moongen"
 local timer  = require "timer"
 local ts     = require "timestamping"
@@ -45,7 +45,7 @@ local function timestampThread(flows, directory)
 			flow:property "txQueue", flow:property "rxQueue",
 			nil, isUdp
 		)
-		hists[i] = hist()
+		hists[i] = hist.new()
 
 		local minLength = isUdp and 84 or 68
 		if flow:packetSize() < minLength then
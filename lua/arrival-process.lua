@@ -0,0 +1,91 @@
+--- Arrival processes for the software rate limiters.
+--- Inter-departure times are precomputed in C++, all distributions have a mean of 1 and are scaled by the limiter.
+
+local ffi = require "ffi"
+local log = require "log"
+
+local C = ffi.C
+
+ffi.cdef[[
+	struct arrival_process;
+	struct arrival_process* mg_arrival_create(uint32_t dist, double p1, double p2, uint64_t seed);
+	void mg_arrival_set_cdf(struct arrival_process* proc, const double* values, const double* probabilities, uint32_t n);
+	void mg_arrival_delete(struct arrival_process* proc);
+	void mg_arrival_next_n(struct arrival_process* proc, double* out, uint32_t n);
+	void mg_arrival_set_gaps(struct arrival_process* proc, struct rte_mbuf** bufs, uint32_t n, double target_bytes, double* carry);
+]]
+
+local mod = {}
+
+local distributions = {
+	cbr = 0,
+	poisson = 1,
+	onoff = 2,
+	pareto = 3,
+	uniform = 4,
+	empirical = 5,
+}
+
+--- Names of all supported patterns.
+mod.patterns = { "cbr", "poisson", "onoff", "pareto", "uniform", "empirical" }
+
+--- Get the name and parameters of a pattern.
+-- @param pattern name of the pattern or a table with the name as first element and its parameters
+-- @return name, parameter table
+function mod.getPattern(pattern)
+	if type(pattern) == "table" then
+		return pattern[1], pattern
+	end
+	return pattern, {}
+end
+
+--- Check if a pattern is supported.
+function mod.isValid(pattern)
+	return distributions[(mod.getPattern(pattern))] ~= nil
+end
+
+--- Create a new arrival process, it must only be used by a single thread.
+-- @param pattern name of the pattern or a table with the name as first element and its parameters:
+--   cbr: constant inter-departure times
+--   poisson: exponentially distributed inter-packet gaps
+--   onoff: bursts of packets, burst: mean number of packets per burst (default 16),
+--     ratio: gap inside bursts relative to the average gap (default 0.1)
+--   pareto: heavy-tailed gaps, shape: shape parameter > 1 (default 1.5)
+--   uniform: uniformly distributed jitter, jitter: maximum deviation relative to the average gap (default 0.5)
+--   empirical: cdf: list of {value, cumulative probability} pairs with ascending values,
+--     only the shape of the distribution is used, values are rescaled to the average gap
+-- @param seed optional, seed for the random number generator
+function mod.new(pattern, seed)
+	local name, params = mod.getPattern(pattern)
+	local dist = distributions[name]
+	if not dist then
+		log:fatal("Unsupported arrival pattern %s", tostring(name))
+	end
+	local p1, p2 = 0, 0
+	if name == "onoff" then
+		p1, p2 = params.burst or 16, params.ratio or 0.1
+	elseif name == "pareto" then
+		p1 = params.shape or 1.5
+		if p1 <= 1 then
+			log:fatal("Pareto shape must be > 1 for a finite mean, got %s", tostring(p1))
+		end
+	elseif name == "uniform" then
+		p1 = params.jitter or 0.5
+	end
+	local proc = C.mg_arrival_create(dist, p1, p2, seed or math.random(0, 2^31))
+	if name == "empirical" then
+		local cdf = params.cdf
+		if type(cdf) ~= "table" or #cdf == 0 then
+			log:fatal("Empirical arrival pattern requires a cdf")
+		end
+		local values = ffi.new("double[?]", #cdf)
+		local probs = ffi.new("double[?]", #cdf)
+		for i, point in ipairs(cdf) do
+			values[i - 1], probs[i - 1] = point[1], point[2]
+		end
+		C.mg_arrival_set_cdf(proc, values, probs, #cdf)
+	end
+	return proc
+end
+
+return mod
@@ -10,20 +10,19 @@ local C = ffi.C
 
 ffi.cdef[[
 	void moongen_send_all_packets_with_delay_bad_crc(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** load_pkts, uint16_t num_pkts, struct mempool* pool, uint32_t min_pkt_size);
+
+	struct filler_cache { };
+	struct filler_cache* moongen_filler_cache_create(struct mempool* pool, uint32_t min_pkt_size, uint32_t step);
+	void moongen_filler_cache_free(struct filler_cache* cache);
+	void moongen_send_all_packets_with_delay_bad_crc_cached(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** load_pkts, uint16_t num_pkts, struct filler_cache* cache);
 ]]
 
 local mempool
---- Send rate-controlled packets by filling gaps with invalid packets.
--- @param bufs
--- @param targetRate optional, hint to the driver which total rate you are trying to achieve.
---   increases precision at low non-cbr rates
--- @param n optional, number of packets to send (defaults to full bufs)
-function txQueue:sendWithDelay(bufs, targetRate, n)
+--- Get the mempool for CRC-invalid filler packets, it is shared by all queues used by a task.
+function txQueue:getFillerMempool()
 	if not self.dev.crcPatch then
 		log:fatal("Driver does not support disabling the CRC flag. This feature requires a patched driver.")
 	end
-	targetRate = targetRate or 14.88
-	self.used = true
 	mempool = mempool or memory.createMemPool{
 		func = function(buf)
 			-- this is tcp packet because the netfpga/OSNT system we use for testing this
@@ -33,6 +32,51 @@ function txQueue:sendWithDelay(bufs, targetRate, n)
 			pkt:fill()
 		end
 	}
+	return mempool
+end
+
+--- Use prebuilt filler packets for sendWithDelay() on this queue.
+-- Fillers are built once in size classes and reused, sending them requires no allocation.
+-- Gaps are rounded down to the next size class, the rounding error is carried forward to the next gap.
+-- The queue must only be used by the calling task.
+-- @param step optional, size difference between two filler size classes in bytes (default 8)
+function txQueue:enableFillerCache(step)
+	self.fillerCacheStep = step or 8
+	self.fillerCaches = self.fillerCaches or {}
+end
+
+--- Free the filler caches of this queue and return their fillers to the mempool.
+-- Fillers of sendWithDelay() are allocated for each gap afterwards.
+function txQueue:disableFillerCache()
+	for _, cache in pairs(self.fillerCaches or {}) do
+		C.moongen_filler_cache_free(ffi.gc(cache, nil))
+	end
+	self.fillerCacheStep = nil
+	self.fillerCaches = nil
+end
+
+local function getFillerCache(queue, minPktSize)
+	local cache = queue.fillerCaches[minPktSize]
+	if not cache then
+		cache = C.moongen_filler_cache_create(queue:getFillerMempool(), minPktSize, queue.fillerCacheStep)
+		if cache == nil then
+			log:fatal("Could not create filler cache, mempool exhausted?")
+		end
+		-- caches which are not freed with disableFillerCache() are freed by the garbage collector
+		queue.fillerCaches[minPktSize] = ffi.gc(cache, C.moongen_filler_cache_free)
+	end
+	return cache
+end
+
+--- Send rate-controlled packets by filling gaps with invalid packets.
+-- @param bufs
+-- @param targetRate optional, hint to the driver which total rate you are trying to achieve.
+--   increases precision at low non-cbr rates
+-- @param n optional, number of packets to send (defaults to full bufs)
+function txQueue:sendWithDelay(bufs, targetRate, n)
+	local mempool = self:getFillerMempool()
+	targetRate = targetRate or 14.88
+	self.used = true
 	n = n or bufs.size
 	local avgPacketSize = 1.25 / (targetRate * 2) * 1000
 	local minPktSize = self.dev.minPacketSize or 64
@@ -43,7 +87,11 @@ function txQueue:sendWithDelay(bufs, targetRate, n)
 	else
 		minPktSize = math.floor(10 * 10^9 / 10^6 / 8 / maxPktRate)
 	end
-	C.moongen_send_all_packets_with_delay_bad_crc(self.id, self.qid, bufs.array, n, mempool, minPktSize)
+	if self.fillerCacheStep then
+		C.moongen_send_all_packets_with_delay_bad_crc_cached(self.id, self.qid, bufs.array, n, getFillerCache(self, minPktSize))
+	else
+		C.moongen_send_all_packets_with_delay_bad_crc(self.id, self.qid, bufs.array, n, mempool, minPktSize)
+	end
 	return bufs.size
 end
 
@@ -61,8 +109,16 @@ end
 ffi.cdef[[
 uint64_t moongen_get_bad_pkts_sent(uint8_t port_id);
 uint64_t moongen_get_bad_bytes_sent(uint8_t port_id);
+uint64_t moongen_get_bad_pkts_sent_queue(uint8_t port_id, uint16_t queue_id);
+uint64_t moongen_get_bad_bytes_sent_queue(uint8_t port_id, uint16_t queue_id);
 ]]
 
+--- Get the number of CRC-invalid filler packets and bytes sent via this queue.
+-- Queues with an id >= 64 share their counters.
+function txQueue:getFillerStats()
+	return tonumber(C.moongen_get_bad_pkts_sent_queue(self.id, self.qid)), tonumber(C.moongen_get_bad_bytes_sent_queue(self.id, self.qid))
+end
+
 local function hookTxStats(dev)
 	if dev.__txStatsHooked then
 		return
@@ -5,20 +5,48 @@ local ffi = require "ffi"
 local log = require "log"
 local C = ffi.C
 
+-- common to both backends, {map} is hmap (TBB) or fmap (flat)
 local hmapTemplate = [[
-typedef struct hmapk{key_size}v{value_size} hmapk{key_size}v{value_size};
-typedef struct hmapk{key_size}v{value_size}_accessor hmapk{key_size}v{value_size}_accessor;
+typedef struct {map}k{key_size}v{value_size} {map}k{key_size}v{value_size};
+typedef struct {map}k{key_size}v{value_size}_accessor {map}k{key_size}v{value_size}_accessor;
+void {map}k{key_size}v{value_size}_delete({map}k{key_size}v{value_size}* map);
+void {map}k{key_size}v{value_size}_clear({map}k{key_size}v{value_size}* map);
+{map}k{key_size}v{value_size}_accessor* {map}k{key_size}v{value_size}_new_accessor();
+void {map}k{key_size}v{value_size}_accessor_free({map}k{key_size}v{value_size}_accessor* a);
+void {map}k{key_size}v{value_size}_accessor_release({map}k{key_size}v{value_size}_accessor* a);
+bool {map}k{key_size}v{value_size}_access({map}k{key_size}v{value_size}* map, {map}k{key_size}v{value_size}_accessor* a, const void* key);
+bool {map}k{key_size}v{value_size}_find({map}k{key_size}v{value_size}* map, {map}k{key_size}v{value_size}_accessor* a, const void* key);
+bool {map}k{key_size}v{value_size}_erase({map}k{key_size}v{value_size}* map, {map}k{key_size}v{value_size}_accessor* a);
+uint8_t* {map}k{key_size}v{value_size}_accessor_get_value({map}k{key_size}v{value_size}_accessor* a);
+uint32_t {map}k{key_size}v{value_size}_clean({map}k{key_size}v{value_size}* map, uint64_t threash);
+size_t {map}k{key_size}v{value_size}_size({map}k{key_size}v{value_size}* map);
+void {map}k{key_size}v{value_size}_set_ttl({map}k{key_size}v{value_size}* map, uint64_t ttl);
+bool {map}k{key_size}v{value_size}_access_ts({map}k{key_size}v{value_size}* map, {map}k{key_size}v{value_size}_accessor* a, const void* key, uint64_t ts);
+uint32_t {map}k{key_size}v{value_size}_expire({map}k{key_size}v{value_size}* map, uint64_t thresh);
+uint32_t {map}k{key_size}v{value_size}_insert_batch({map}k{key_size}v{value_size}* map, const void* keys, const void* values, uint32_t n);
+uint32_t {map}k{key_size}v{value_size}_find_batch({map}k{key_size}v{value_size}* map, const void* keys, void* values, uint8_t* found, uint32_t n);
+uint32_t {map}k{key_size}v{value_size}_find_erase_batch({map}k{key_size}v{value_size}* map, const void* keys, void* values, uint8_t* found, uint32_t n);
+void {map}k{key_size}v{value_size}_memory({map}k{key_size}v{value_size}* map, struct hmap_memory* out);
+]]
+
+local tbbTemplate = [[
 hmapk{key_size}v{value_size}* hmapk{key_size}v{value_size}_create();
-void hmapk{key_size}v{value_size}_delete(hmapk{key_size}v{value_size}* map);
-void hmapk{key_size}v{value_size}_clear(hmapk{key_size}v{value_size}* map);
-hmapk{key_size}v{value_size}_accessor* hmapk{key_size}v{value_size}_new_accessor();
-void hmapk{key_size}v{value_size}_accessor_free(hmapk{key_size}v{value_size}_accessor* a);
-void hmapk{key_size}v{value_size}_accessor_release(hmapk{key_size}v{value_size}_accessor* a);
-bool hmapk{key_size}v{value_size}_access(hmapk{key_size}v{value_size}* map, hmapk{key_size}v{value_size}_accessor* a, const void* key);
-bool hmapk{key_size}v{value_size}_find(hmapk{key_size}v{value_size}* map, hmapk{key_size}v{value_size}_accessor* a, const void* key);
-bool hmapk{key_size}v{value_size}_erase(hmapk{key_size}v{value_size}* map, hmapk{key_size}v{value_size}_accessor* a);
-uint8_t* hmapk{key_size}v{value_size}_accessor_get_value(hmapk{key_size}v{value_size}_accessor* a);
-uint32_t hmapk{key_size}v{value_size}_clean(hmapk{key_size}v{value_size}* map, uint64_t threash);
+hmapk{key_size}v{value_size}* hmapk{key_size}v{value_size}_create_sized(size_t expected, uint32_t flags);
+]]
+
+local flatTemplate = [[
+fmapk{key_size}v{value_size}* fmapk{key_size}v{value_size}_create(uint8_t hash);
+size_t fmapk{key_size}v{value_size}_capacity(fmapk{key_size}v{value_size}* map);
+bool fmapk{key_size}v{value_size}_reserve(fmapk{key_size}v{value_size}* map, size_t n);
+]]
+
+ffi.cdef[[
+struct hmap_memory {
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t buckets;
+    double load_factor;
+};
 ]]
 
 local module = {}
@@ -26,8 +54,29 @@ local module = {}
 local keySizes = { 8, 16, 32, 64 }
 local valueSizes = { 8, 16, 32, 64, 128 }
 
--- Get tbb hash map with fitting key and value size
-function module.createHashmap(keySize, valueSize)
+-- flags of hmapk*_create_sized(), see src/hashmap.cpp
+local HMAP_NODE_POOL = 1
+local HMAP_HUGETLB = 2
+
+-- hash functions of the flat backend, see src/flat-hashmap.cpp
+local flatHashes = {
+    sip = 0,
+    sip13 = 1,
+    highway = 2,
+    -- not resistant to chosen keys
+    fast = 3,
+}
+
+-- Get a hash map with fitting key and value size
+-- @param opts optional table:
+--   backend: "tbb" (default), a concurrent map, or "flat", an open-addressing table (src/flat-hashmap.cpp)
+--     which is faster but may only be modified by one thread
+--   hash: flat only, "sip" (default), "sip13", "highway", or "fast"
+--   expectedSize: number of entries to size the map for up front
+--   pool: tbb only, allocate the entries from a per-thread pool which is preallocated for expectedSize entries
+--   hugetlb: tbb only, back the pool with explicit huge pages if available (transparent ones otherwise)
+function module.createHashmap(keySize, valueSize, opts)
+    opts = opts or {}
     local realKeySize, realValueSize = 0, 0
     if keySize <= 8 then
         realKeySize = 8
@@ -56,28 +105,63 @@ function module.createHashmap(keySize, valueSize)
         return nil
     end
 
-    return C["hmapk" .. realKeySize .. "v" .. realValueSize .. "_create"]()
+    local backend = opts.backend or "tbb"
+    if backend == "tbb" then
+        if not opts.expectedSize then
+            return C["hmapk" .. realKeySize .. "v" .. realValueSize .. "_create"]()
+        end
+        local flags = (opts.pool and HMAP_NODE_POOL or 0) + (opts.hugetlb and HMAP_HUGETLB or 0)
+        local map = C["hmapk" .. realKeySize .. "v" .. realValueSize .. "_create_sized"](opts.expectedSize, flags)
+        if map == nil then
+            log:error("HashMap: Could not allocate memory for %d entries", opts.expectedSize)
+            return nil
+        end
+        return map
+    elseif backend ~= "flat" then
+        log:error("HashMap: Unknown backend %s", backend)
+        return nil
+    end
+    local hash = flatHashes[opts.hash or "sip"]
+    if not hash then
+        log:error("HashMap: Unknown hash function %s", opts.hash)
+        return nil
+    end
+    local map = C["fmapk" .. realKeySize .. "v" .. realValueSize .. "_create"](hash)
+    if opts.expectedSize and not map:reserve(opts.expectedSize) then
+        log:error("HashMap: Could not allocate memory for %d entries", opts.expectedSize)
+        map:delete()
+        return nil
+    end
+    return map
 end
 
-function makeHashmapFor(keySize, valueSize)
+function makeHashmapFor(name, keySize, valueSize)
+    -- resolve the functions once instead of building their names on every call
+    local prefix = name .. "k" .. keySize .. "v" .. valueSize .. "_"
+    local clear, delete, access, find = C[prefix .. "clear"], C[prefix .. "delete"], C[prefix .. "access"], C[prefix .. "find"]
+    local newAccessor, erase, clean, size = C[prefix .. "new_accessor"], C[prefix .. "erase"], C[prefix .. "clean"], C[prefix .. "size"]
+    local setTTL, accessTs, expire = C[prefix .. "set_ttl"], C[prefix .. "access_ts"], C[prefix .. "expire"]
+    local insertBatch, findBatch, findEraseBatch = C[prefix .. "insert_batch"], C[prefix .. "find_batch"], C[prefix .. "find_erase_batch"]
+    local memory = C[prefix .. "memory"]
+    local getValue, accessorFree, accessorRelease = C[prefix .. "accessor_get_value"], C[prefix .. "accessor_free"], C[prefix .. "accessor_release"]
     local map = {}
     function map:clear()
-        C["hmapk" .. keySize .. "v" .. valueSize .. "_clear"](self)
+        clear(self)
     end
     function map:delete()
-        C["hmapk" .. keySize .. "v" .. valueSize .. "_delete"](self)
+        delete(self)
     end
     function map:access(a, tpl)
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_access"](self, a, tpl)
+        return access(self, a, tpl)
     end
     function map:find(a, tpl)
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_find"](self, a, tpl)
+        return find(self, a, tpl)
     end
     function map.newAccessor()
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_new_accessor"]()
+        return newAccessor()
     end
     function map:erase(a)
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_erase"](self, a)
+        return erase(self, a)
     end
     function map.keyBufSize()
         return keySize
@@ -85,31 +169,92 @@ function makeHashmapFor(keySize, valueSize)
     function map.valueSize()
         return valueSize
     end
+    -- walks the whole map, see expire() for maps filled with accessTs()
     function map:clean(thresh)
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_clean"](self, thresh)
+        return clean(self, thresh)
+    end
+    function map:size()
+        return tonumber(size(self))
+    end
+    -- entries inserted with accessTs() more than ttl before the newest one are expired during later inserts
+    -- keys are only tracked for expiry while a TTL is set
+    function map:setTTL(ttl)
+        setTTL(self, ttl)
+    end
+    -- like access(), additionally stores the timestamp in the first 8 bytes of the value and tracks it for expiry
+    -- releases the accessor first
+    function map:accessTs(a, tpl, ts)
+        return accessTs(self, a, tpl, ts)
+    end
+    -- erase the entries inserted with accessTs() before thresh, costs O(expired) instead of O(size)
+    -- requires a TTL, entries may be erased up to ttl / 8 later than thresh
+    -- the calling thread must not hold an accessor
+    function map:expire(thresh)
+        return expire(self, thresh)
+    end
+    -- Batch operations on n keys and values in arrays with a stride of keyBufSize() and valueSize() bytes.
+    -- They do not use an accessor, the calling thread must not hold one.
+    -- insert or assign, returns the number of new keys
+    -- with a TTL the first 8 bytes of each value are its timestamp, see accessTs()
+    function map:insertBatch(keys, values, n)
+        return insertBatch(self, keys, values, n)
+    end
+    -- copy the values of the found keys to values, found is an uint8_t array set to 1 for them and 0 otherwise
+    -- returns the number of found keys
+    function map:findBatch(keys, values, found, n)
+        return findBatch(self, keys, values, found, n)
+    end
+    -- like findBatch() but also erases the found entries
+    function map:findEraseBatch(keys, values, found, n)
+        return findEraseBatch(self, keys, values, found, n)
+    end
+    -- bytes used by the map (estimated for TBB maps without a pool), entries, buckets and load factor
+    function map:memory()
+        local mem = ffi.new("struct hmap_memory")
+        memory(self, mem)
+        return {
+            bytes = tonumber(mem.bytes),
+            entries = tonumber(mem.entries),
+            buckets = tonumber(mem.buckets),
+            loadFactor = mem.load_factor,
+        }
+    end
+    if name == "fmap" then
+        local capacity, reserve = C[prefix .. "capacity"], C[prefix .. "reserve"]
+        -- number of slots, 7/8 of them can be used before the table grows
+        function map:capacity()
+            return tonumber(capacity(self))
+        end
+        -- make room for n entries, returns false if the memory cannot be allocated
+        function map:reserve(n)
+            return reserve(self, n)
+        end
     end
     local accessor = {}
     function accessor:get()
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_accessor_get_value"](self)
+        return getValue(self)
     end
     function accessor:free()
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_accessor_free"](self)
+        return accessorFree(self)
     end
     function accessor:release()
-        return C["hmapk" .. keySize .. "v" .. valueSize .. "_accessor_release"](self)
+        return accessorRelease(self)
     end
     map.__index = map
     accessor.__index = accessor
-    ffi.metatype("hmapk" .. keySize .. "v" .. valueSize, map)
-    ffi.metatype("hmapk" .. keySize .. "v" .. valueSize .. "_accessor", accessor)
+    ffi.metatype(name .. "k" .. keySize .. "v" .. valueSize, map)
+    ffi.metatype(name .. "k" .. keySize .. "v" .. valueSize .. "_accessor", accessor)
 end
 
 for _, k in pairs(keySizes) do
     for _, v in pairs(valueSizes) do
-        local definition, _ = hmapTemplate:gsub("{value_size}", v)
-        definition, _ = definition:gsub("{key_size}", k)
-        ffi.cdef(definition)
-        makeHashmapFor(k, v)
+        for name, template in pairs({ hmap = tbbTemplate, fmap = flatTemplate }) do
+            local definition, _ = hmapTemplate:gsub("{map}", name)
+            definition, _ = (definition .. template):gsub("{value_size}", v)
+            definition, _ = definition:gsub("{key_size}", k)
+            ffi.cdef(definition)
+            makeHashmapFor(name, k, v)
+        end
     end
 end
 
@@ -0,0 +1,135 @@
+--- Tracks the offset between the timestamp clocks of MoonSniff's pre-DUT and post-DUT ports during a capture.
+--- The offsets are written to a sidecar file (<output>-drift.csv) and are used to correct post-DUT timestamps
+--- with a piecewise-linear model, live mode receives the corrections directly.
+
+local mod = {}
+
+local ffi     = require "ffi"
+local log     = require "log"
+local libmoon = require "libmoon"
+require "moonsniff-io" -- ms_set_clock_correction
+
+local C = ffi.C
+
+--- Measure the offset between the clocks of two devices.
+--- The clocks are read sequentially, the pre-DUT clock is read before and after the post-DUT clock and the
+--- measurement with the shortest window is used.
+-- @return post-DUT clock time, pre-DUT clock minus post-DUT clock (both in nanoseconds)
+function mod.measureOffset(preDev, postDev)
+	local best, time, offset
+	for _ = 1, 5 do
+		local t1 = tonumber(preDev:readTime())
+		local t2 = tonumber(postDev:readTime())
+		local t3 = tonumber(preDev:readTime())
+		if not best or t3 - t1 < best then
+			best = t3 - t1
+			time = t2
+			offset = (t1 + t3) / 2 - t2
+		end
+	end
+	return time, offset
+end
+
+--- Periodically measure the clock offset until libmoon is stopped.
+-- @param preDev pre-DUT device
+-- @param postDev post-DUT device
+-- @param interval measurement interval in milliseconds
+-- @param filename optional, file to write the offsets to
+-- @param live optional, pass the corrections to MoonSniff's live mode
+function mod.track(preDev, postDev, interval, filename, live)
+	local file
+	if filename then
+		file = io.open(filename, "w")
+		if not file then
+			log:fatal("Could not open drift file %s", filename)
+		end
+		file:write("# post-DUT clock [ns], pre-DUT minus post-DUT clock [ns]\n")
+	end
+	local lastTime, lastOffset
+	while libmoon.running() do
+		local time, offset = mod.measureOffset(preDev, postDev)
+		if file then
+			file:write(("%.0f,%.1f\n"):format(time, offset))
+			-- keep the samples of aborted captures
+			file:flush()
+		end
+		if live then
+			-- extrapolate with the drift of the last interval until the next measurement
+			local drift = lastTime and time > lastTime and (offset - lastOffset) / (time - lastTime) or 0
+			C.ms_set_clock_correction(time, offset, drift)
+		end
+		lastTime, lastOffset = time, offset
+		libmoon.sleepMillisIdle(interval)
+	end
+	if file then
+		file:close()
+	end
+end
+
+local correction = {}
+correction.__index = correction
+
+--- Load the clock offsets written by mod.track().
+-- @return correction object, nil if the file does not exist or contains no samples
+function mod.load(filename)
+	local file = io.open(filename, "r")
+	if not file then
+		return nil
+	end
+	local times, offsets = {}, {}
+	for line in file:lines() do
+		local time, offset = line:match("^([%d%.%-]+),([%d%.%-]+)$")
+		if time then
+			times[#times + 1] = tonumber(time)
+			offsets[#offsets + 1] = tonumber(offset)
+		end
+	end
+	file:close()
+	if #times == 0 then
+		return nil
+	end
+	return setmetatable({ times = times, offsets = offsets, segment = 1 }, correction)
+end
+
+--- Number of offset samples.
+function correction:size()
+	return #self.times
+end
+
+--- Offset of the pre-DUT clock at the given post-DUT time in nanoseconds.
+--- Interpolates linearly between samples and extrapolates with the first/last segment.
+function correction:getOffset(time)
+	local times, offsets = self.times, self.offsets
+	local n = #times
+	if n == 1 then
+		return offsets[1]
+	end
+	-- timestamps are mostly increasing, start the search at the last segment used
+	local i = self.segment
+	if time < times[i] or (i + 1 < n and time >= times[i + 1]) then
+		local lo, hi = 1, n - 1
+		while lo < hi do
+			local mid = math.floor((lo + hi + 1) / 2)
+			if times[mid] <= time then
+				lo = mid
+			else
+				hi = mid - 1
+			end
+		end
+		i = lo
+		self.segment = i
+	end
+	if times[i + 1] == times[i] then
+		return offsets[i]
+	end
+	local slope = (offsets[i + 1] - offsets[i]) / (times[i + 1] - times[i])
+	return offsets[i] + (time - times[i]) * slope
+end
+
+--- Correct a post-DUT timestamp (nanoseconds, uint64_t cdata or number) to the pre-DUT clock.
+function correction:apply(timestamp)
+	local offset = math.floor(self:getOffset(tonumber(timestamp)) + 0.5)
+	return timestamp + offset
+end
+
+return mod
@@ -1,5 +1,10 @@
 --- Fast pcap IO, can write > 40 Gbit/s (to fs cache) and read > 30 Mpps (from fs cache).
 --- Read/write performance can saturate several NVMe SSDs from a single core.
+---
+--- Version 1 mscap files are a headerless stream of 12 byte records.
+--- Version 2 files have a header (port, clock, identifier width), delta-encoded blocks, and a block index,
+--- typical captures are 4-6 times smaller. See src/mscap.hpp for the format.
+--- Readers support both versions, writers create version 2 files unless asked otherwise.
 
 local mod = {}
 
@@ -19,12 +24,32 @@ ffi.cdef [[
 		uint32_t hits;
 		uint32_t misses;
 		uint32_t inval_ts;
+		int64_t p50_latency;
+		int64_t p99_latency;
+		int64_t p999_latency;
+		int64_t max_latency;
 	};
 
+	struct ms_snapshot {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t inval_ts;
+		uint64_t count;
+		double average_latency;
+		int64_t p50_latency;
+		int64_t p90_latency;
+		int64_t p99_latency;
+		int64_t p999_latency;
+		int64_t max_latency;
+	};
+
+	void ms_init(uint32_t id_bits);
 	void ms_set_thresh(int64_t thresh);
+	void ms_set_clock_correction(int64_t ref_time, int64_t offset, double drift);
 	void ms_add_entry(uint32_t identification, uint64_t timestamp);
 	void ms_test_for(uint32_t identification, uint64_t timestamp);
 	struct ms_stats ms_fetch_stats();
+	void ms_fetch_snapshot(struct ms_snapshot* snap);
 	void ms_log_pkts(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** rx_pkts, uint16_t nb_pkts, uint32_t seqnum_offset, const char* filename);
 
 	//---------------MSCAP Writer/Reader-------------------------
@@ -33,13 +58,107 @@ ffi.cdef [[
 		uint32_t identification;   /* identifies a received packet */
 	};
 
+	struct mscap_header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t header_size;
+		uint32_t block_size;
+		uint8_t id_bits;
+		uint8_t clock;
+		uint16_t port;
+		uint16_t queue;
+		uint16_t reserved0;
+		uint32_t reserved1;
+		uint64_t num_records;
+		uint64_t num_blocks;
+		uint64_t index_offset;
+		uint64_t first_timestamp;
+	};
+
+	struct mscap_record {
+		uint64_t timestamp;
+		uint64_t identification;
+	};
+
+	struct mscap_reader;
+	struct mscap_reader* mscap_reader_open(const char* filename);
+	void mscap_reader_close(struct mscap_reader* r);
+	const struct mscap_header* mscap_reader_info(const struct mscap_reader* r);
+	uint64_t mscap_reader_blocks(const struct mscap_reader* r);
+	uint32_t mscap_reader_max_records(const struct mscap_reader* r);
+	uint32_t mscap_reader_decode(const struct mscap_reader* r, uint64_t block, struct mscap_record* out);
+	uint64_t mscap_reader_find_block(const struct mscap_reader* r, uint64_t timestamp);
+
+	struct mscap_writer;
+	struct mscap_writer* mscap_writer_open(const char* filename, uint16_t port, uint16_t queue, uint8_t id_bits, uint8_t clock);
+	void mscap_writer_add(struct mscap_writer* w, uint64_t timestamp, uint64_t identification);
+	bool mscap_writer_close(struct mscap_writer* w);
+
+	//---------------MSCAP/PCAP Matcher--------------------------
+	struct ms_match_config {
+		uint32_t id_bits;
+		uint32_t threads;
+		int64_t thresh;
+		uint32_t num_offsets;
+		const double* offset_times;
+		const double* offsets;
+		const char* series_file;
+		uint64_t series_window;
+	};
+
+	struct ms_match_stats {
+		uint64_t pre_pkts;
+		uint64_t post_pkts;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t overwrites;
+		uint64_t inval_ts;
+		uint64_t expired;
+		uint64_t skipped;
+		uint64_t late;
+	};
+
+	bool ms_match_mscap(const char* pre_file, const char* post_file, const struct ms_match_config* cfg, struct ms_match_stats* stats);
+
+	struct ms_pcap_match_config {
+		uint32_t threads;
+		int64_t thresh;
+		uint64_t expiry;
+		uint32_t num_offsets;
+		const double* offset_times;
+		const double* offsets;
+		const char* series_file;
+		uint64_t series_window;
+	};
+
+	struct ms_key_plan;
+
+	struct ms_series_header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t window;
+		uint64_t num_windows;
+	};
+
+	struct ms_series_window {
+		uint64_t start;
+		uint32_t count;
+		uint32_t misses;
+		int64_t min;
+		int64_t p50;
+		int64_t p99;
+		int64_t max;
+	};
+	bool ms_match_pcap(const char* pre_file, const char* post_file, const struct ms_key_plan* plan, const struct ms_pcap_match_config* cfg, struct ms_match_stats* stats);
+
 	//--------------CPP Histogram--------------------------------
 	void hs_initialize(uint32_t bucket_size);
 	void hs_destroy();
-	bool hs_update(uint64_t new_val);
+	bool hs_update(int64_t new_val);
 	void hs_finalize();
 	void hs_write(const char* filename);
-	int64_t hs_getCount();
+	uint64_t hs_getCount();
 	double hs_getMean();
 	double hs_getVariance();
 ]]
@@ -47,8 +166,14 @@ ffi.cdef [[
 local INITIAL_FILE_SIZE = 512 * 1024 * 1024
 local MSCAP_SIZE = 12 -- technically 16 bytes, but the last 4 are padding
 local mscap_p = ffi.typeof("struct mscap*")
+local mscap_records = ffi.typeof("struct mscap_record[?]")
+
+--- Clock sources of the timestamps in version 2 files
+mod.CLOCK_UNKNOWN = 0
+mod.CLOCK_NIC = 1
+mod.CLOCK_WALL = 2
 
---- Set the file size for new pcap writers
+--- Set the file size for new version 1 writers
 --- @param newSizeInBytes new file size in bytes
 function mod:setInitialFilesize(newSizeInBytes)
 	INITIAL_FILE_SIZE = newSizeInBytes
@@ -57,12 +182,25 @@ end
 local writer = {}
 writer.__index = writer
 
---- Create a new fast pcap writer with the given file name.
+local writerV2 = {}
+writerV2.__index = writerV2
+
+--- Create a new fast mscap writer with the given file name.
 --- Call :close() on the writer when you are done.
 --- @param startTime posix timestamp, all timestamps of inserted packets will be relative to this timestamp
 --- default: relative to libmoon.getTime() == 0
-function mod:newWriter(filename, startTime)
+--- @param version optional, 1 for the legacy format, default: 2
+--- @param opts optional version 2 header fields: port, queue, idBits (32 or 64, default 64), clock
+function mod:newWriter(filename, startTime, version, opts)
 	startTime = startTime or wallTime() - libmoon.getTime()
+	if version ~= 1 then
+		opts = opts or {}
+		local w = C.mscap_writer_open(filename, opts.port or 0, opts.queue or 0, opts.idBits or 64, opts.clock or mod.CLOCK_UNKNOWN)
+		if w == nil then
+			log:fatal("could not create mscap file %s", filename)
+		end
+		return setmetatable({ w = w, startTime = startTime, filename = filename }, writerV2)
+	end
 	local fd = S.open(filename, "creat, rdwr, trunc", "0666")
 	if not fd then
 		log:fatal("could not create pcap file: %s", strError(S.errno()))
@@ -120,45 +258,118 @@ function writer:write(identification, timestamp)
 	self.offset = self.offset + MSCAP_SIZE
 end
 
+--- Write a record to a version 2 file
+function writerV2:write(identification, timestamp)
+	C.mscap_writer_add(self.w, timestamp, identification)
+end
+
+--- Write the index and close the file.
+function writerV2:close()
+	if not C.mscap_writer_close(self.w) then
+		log:error("could not write mscap file %s completely", self.filename)
+	end
+	self.w = nil
+end
+
 local reader = {}
 reader.__index = reader
 
---- Create a new fast pcap reader for the given file name.
+--- Create a new fast mscap reader for the given file name, version 1 and 2 files are supported.
 --- Call :close() on the reader when you are done to avoid fd leakage.
 function mod:newReader(filename)
-	local fd = S.open(filename, "rdonly")
-	if not fd then
-		log:fatal("could not open pcap file: %s", strError(S.errno()))
+	local r = C.mscap_reader_open(filename)
+	if r == nil then
+		log:fatal("could not open mscap file %s", filename)
 	end
-	local size = fd:stat().size
-	fd:nogc()
-	local ptr = S.mmap(nil, size, "read", "private", fd, 0)
-	if not ptr then
-		log:fatal("mmap failed: %s", strError(S.errno()))
-	end
-	local offset = 0
-	ptr = cast("uint8_t*", ptr)
-	return setmetatable({ fd = fd, ptr = ptr, size = size, offset = offset }, reader)
+	local maxRecords = C.mscap_reader_max_records(r)
+	return setmetatable({
+		r = r,
+		numBlocks = tonumber(C.mscap_reader_blocks(r)),
+		buf = mscap_records(maxRecords),
+		block = -1,
+		fill = 0,
+		pos = 0,
+	}, reader)
+end
+
+--- Header of the file, fields are synthesized for version 1 files.
+--- @return struct mscap_header, valid until the reader is closed
+function reader:info()
+	return C.mscap_reader_info(self.r)
+end
+
+--- Number of blocks, blocks can be decoded independently and in any order.
+function reader:blocks()
+	return self.numBlocks
 end
 
---- Read the next packet into a buf, the timestamp is stored in the udata64 field as microseconds.
---- The buffer's packet size corresponds to the original packet size, cut off bytes are zero-filled.
+--- Decode a block (0-based) into buf which must hold reader:maxRecords() struct mscap_record.
+--- @return number of records
+function reader:readBlock(block, buf)
+	return C.mscap_reader_decode(self.r, block, buf)
+end
+
+function reader:maxRecords()
+	return C.mscap_reader_max_records(self.r)
+end
+
+--- Continue sequential reading at the last block starting at or before the timestamp.
+function reader:seek(timestamp)
+	self.block = tonumber(C.mscap_reader_find_block(self.r, timestamp)) - 1
+	self.fill = 0
+	self.pos = 0
+end
+
+--- Read the next record.
+--- @return struct mscap_record, valid until the next call, or nil at the end of the file
 function reader:readSingle()
-	local fileRemaining = self.size - self.offset
-	if fileRemaining < MSCAP_SIZE then -- header size
-		return nil
+	if self.pos >= self.fill then
+		repeat
+			self.block = self.block + 1
+			if self.block >= self.numBlocks then
+				return nil
+			end
+			self.fill = C.mscap_reader_decode(self.r, self.block, self.buf)
+		until self.fill > 0
+		self.pos = 0
 	end
-
-	local mscap = cast(mscap_p, self.ptr + self.offset)
-	self.offset = self.offset + MSCAP_SIZE
+	local mscap = self.buf[self.pos]
+	self.pos = self.pos + 1
 	return mscap
 end
 
+--- Read a latency series written by the native matchers, see src/latency-series.hpp
+--- @return window length in nanoseconds, number of windows, array of struct ms_series_window
+---         or nil if the file is invalid
+function mod:readSeries(filename)
+	local f = io.open(filename, "rb")
+	if not f then
+		return nil
+	end
+	local data = f:read("*a")
+	f:close()
+	local hdrSize = ffi.sizeof("struct ms_series_header")
+	if #data < hdrSize then
+		return nil
+	end
+	local hdr = cast("struct ms_series_header*", data)
+	-- "MSSERIES"
+	if hdr.magic ~= 0x5345495245535344ULL or hdr.version ~= 1 then
+		return nil
+	end
+	local n = tonumber(hdr.num_windows)
+	local recSize = ffi.sizeof("struct ms_series_window")
+	if #data < hdrSize + n * recSize then
+		return nil
+	end
+	local windows = ffi.new("struct ms_series_window[?]", n)
+	ffi.copy(windows, cast("const uint8_t*", data) + hdrSize, n * recSize)
+	return tonumber(hdr.window), n, windows
+end
+
 function reader:close()
-	S.munmap(self.ptr, self.size)
-	S.close(self.fd)
-	self.fd = nil
-	self.ptr = nil
+	C.mscap_reader_close(self.r)
+	self.r = nil
 end
 
 return mod
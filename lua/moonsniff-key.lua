@@ -0,0 +1,179 @@
+--- Native extraction of the keys used to match pre-DUT and post-DUT packets in MoonSniff.
+--- Keys are described by a comma-separated list of fields:
+---   <name>[&<mask>] or <base>+<offset>:<length>[&<mask>]
+--- with base one of packet, l3, l4, payload and a length of up to 8 bytes. Masks are applied to the big-endian value.
+--- Prefix the spec with "hash:" to always hash the fields, e.g. "hash:ip.src,ip.dst,l4.sport,l4.dport,ip.id".
+--- The default "payload+0:4" matches the identifiers written by traffic-gen.lua.
+
+local ffi = require "ffi"
+local log = require "log"
+
+local C = ffi.C
+
+ffi.cdef[[
+	struct ms_key_field {
+		uint8_t base;
+		uint8_t length;
+		uint16_t offset;
+		uint32_t reserved;
+		uint64_t mask;
+	};
+
+	struct ms_key_spec {
+		uint32_t num_fields;
+		uint32_t hash;
+		struct ms_key_field fields[8];
+	};
+
+	struct ms_key_plan;
+	struct ms_key_plan* ms_key_compile(const struct ms_key_spec* spec);
+	void ms_key_free(struct ms_key_plan* plan);
+	bool ms_key_extract(const struct ms_key_plan* plan, const struct rte_mbuf* pkt, uint8_t* key);
+	bool ms_key_extract64(const struct ms_key_plan* plan, const struct rte_mbuf* pkt, uint64_t* identification);
+	void ms_add_pkts(const struct ms_key_plan* plan, struct rte_mbuf** pkts, uint16_t n);
+	void ms_test_pkts(const struct ms_key_plan* plan, struct rte_mbuf** pkts, uint16_t n);
+	void ms_log_pkts_key(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** rx_pkts, uint16_t nb_pkts, const struct ms_key_plan* plan, const char* filename);
+]]
+
+local mod = {}
+
+--- Size of the keys written by plan:extract() in bytes.
+mod.keySize = 16
+
+--- The key used by traffic-gen.lua.
+mod.default = "payload+0:4"
+
+local bases = {
+	packet = 0,
+	l3 = 1,
+	l4 = 2,
+	payload = 3,
+}
+
+-- base, offset, length
+local fields = {
+	["eth.dst"]    = { "packet", 0, 6 },
+	["eth.src"]    = { "packet", 6, 6 },
+	["ip.tos"]     = { "l3", 1, 1 },
+	["ip.len"]     = { "l3", 2, 2 },
+	["ip.id"]      = { "l3", 4, 2 },
+	["ip.proto"]   = { "l3", 9, 1 },
+	["ip.src"]     = { "l3", 12, 4 },
+	["ip.dst"]     = { "l3", 16, 4 },
+	["ip6.flow"]   = { "l3", 0, 4 },
+	["ip6.src.hi"] = { "l3", 8, 8 },
+	["ip6.src.lo"] = { "l3", 16, 8 },
+	["ip6.dst.hi"] = { "l3", 24, 8 },
+	["ip6.dst.lo"] = { "l3", 32, 8 },
+	["l4.sport"]   = { "l4", 0, 2 },
+	["l4.dport"]   = { "l4", 2, 2 },
+	["tcp.seq"]    = { "l4", 4, 4 },
+	["tcp.ack"]    = { "l4", 8, 4 },
+}
+
+local function parseField(str)
+	local field, mask = str:match("^([^&]+)&(.+)$")
+	field = field or str
+	local base, offset, length
+	if fields[field] then
+		base, offset, length = unpack(fields[field])
+	else
+		base, offset, length = field:match("^(%a+)%+(%d+):(%d+)$")
+		offset, length = tonumber(offset), tonumber(length)
+	end
+	if not base or not bases[base] then
+		return nil, ("unknown field \"%s\""):format(field)
+	end
+	if length < 1 or length > 8 then
+		return nil, ("length of field \"%s\" must be between 1 and 8 bytes"):format(field)
+	end
+	if mask then
+		-- masks can have up to 64 bits, tonumber() would lose precision
+		local value = 0ULL
+		local hex = mask:match("^0x(%x+)$")
+		if not hex or #hex > 16 then
+			return nil, ("invalid mask \"%s\", use a hex number"):format(mask)
+		end
+		for digit in hex:gmatch(".") do
+			value = value * 16 + tonumber(digit, 16)
+		end
+		mask = value
+	end
+	return { base = bases[base], offset = offset, length = length, mask = mask or 0 }
+end
+
+--- Parse a key spec.
+-- @return struct ms_key_spec, or nil and an error message
+function mod.parse(str)
+	local spec = ffi.new("struct ms_key_spec")
+	local hash = str:match("^hash:(.*)$")
+	if hash then
+		spec.hash = 1
+		str = hash
+	end
+	local n = 0
+	for item in str:gmatch("[^,%s]+") do
+		if n == ffi.sizeof(spec.fields) / ffi.sizeof(spec.fields[0]) then
+			return nil, "too many fields"
+		end
+		local field, err = parseField(item)
+		if not field then
+			return nil, err
+		end
+		spec.fields[n].base = field.base
+		spec.fields[n].offset = field.offset
+		spec.fields[n].length = field.length
+		spec.fields[n].mask = field.mask
+		n = n + 1
+	end
+	if n == 0 then
+		return nil, "no fields"
+	end
+	spec.num_fields = n
+	return spec
+end
+
+--- Compile a key spec, fails on invalid specs.
+function mod.compile(str)
+	local spec, err = mod.parse(str)
+	if not spec then
+		log:fatal("Invalid key spec \"%s\": %s", str, err)
+	end
+	local plan = C.ms_key_compile(spec)
+	if plan == nil then
+		log:fatal("Invalid key spec \"%s\"", str)
+	end
+	return ffi.gc(plan, C.ms_key_free)
+end
+
+local plan = {}
+plan.__index = plan
+
+--- Write the key of a packet to a buffer of mod.keySize bytes.
+-- @return false if the packet does not contain the fields
+function plan:extract(buf, key)
+	return C.ms_key_extract(self, buf, key)
+end
+
+local id = ffi.new("uint64_t[1]")
+
+--- Get the 64 bit identification of a packet, nil if the packet does not contain the fields.
+function plan:extract64(buf)
+	if C.ms_key_extract64(self, buf, id) then
+		return id[0]
+	end
+end
+
+--- Add the pre-DUT packets of a burst to the live matching table.
+function plan:addPkts(bufs, n)
+	C.ms_add_pkts(self, bufs.array, n)
+end
+
+--- Match the post-DUT packets of a burst in live mode.
+function plan:testPkts(bufs, n)
+	C.ms_test_pkts(self, bufs.array, n)
+end
+
+ffi.metatype("struct ms_key_plan", plan)
+
+return mod
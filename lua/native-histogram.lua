@@ -0,0 +1,151 @@
+--- Native histograms (src/histogram.cpp) with O(1) updates, 64 bit counts, percentiles, and a binary format.
+--- Each thread should record into its own histogram, histograms with the same bucket size can be merged.
+--- Values are rounded to multiples of the bucket size, values above 2^20 buckets are recorded with a relative
+--- error below 0.1%.
+
+local ffi = require "ffi"
+local log = require "log"
+
+local C = ffi.C
+
+ffi.cdef[[
+	struct hs_histogram;
+	struct hs_histogram* hs_create(uint32_t bucket_size);
+	void hs_free(struct hs_histogram* h);
+	struct hs_histogram* hs_global();
+	bool hs_record(struct hs_histogram* h, int64_t value);
+	void hs_record_batch(struct hs_histogram* h, const int64_t* values, uint32_t n);
+	bool hs_merge(struct hs_histogram* dst, const struct hs_histogram* src);
+	void hs_reset(struct hs_histogram* h);
+	uint64_t hs_count(const struct hs_histogram* h);
+	double hs_mean(const struct hs_histogram* h);
+	double hs_variance(const struct hs_histogram* h);
+	int64_t hs_min(const struct hs_histogram* h);
+	int64_t hs_max(const struct hs_histogram* h);
+	int64_t hs_percentile(const struct hs_histogram* h, double q);
+	bool hs_write_csv(const struct hs_histogram* h, const char* filename);
+	size_t hs_serialized_size(const struct hs_histogram* h);
+	void hs_serialize(const struct hs_histogram* h, uint8_t* buf);
+	struct hs_histogram* hs_deserialize(const uint8_t* buf, size_t len);
+	bool hs_save(const struct hs_histogram* h, const char* filename);
+	struct hs_histogram* hs_load(const char* filename);
+]]
+
+local mod = {}
+
+local histogram = {}
+histogram.__index = histogram
+
+--- Create a histogram.
+-- @param bucketSize optional, default 1
+function mod.new(bucketSize)
+	return ffi.gc(C.hs_create(bucketSize or 1), C.hs_free)
+end
+
+--- The global histogram of the legacy hs_* API used by the MoonSniff matchers, nil if it is not initialized.
+--- Not garbage collected.
+function mod.global()
+	local h = C.hs_global()
+	if h ~= nil then
+		return h
+	end
+end
+
+--- Restore a histogram from a string created by histogram:serialize().
+function mod.deserialize(str)
+	local h = C.hs_deserialize(str, #str)
+	if h == nil then
+		return nil
+	end
+	return ffi.gc(h, C.hs_free)
+end
+
+--- Load a histogram saved with histogram:saveBinary().
+function mod.load(filename)
+	local h = C.hs_load(filename)
+	if h == nil then
+		return nil
+	end
+	return ffi.gc(h, C.hs_free)
+end
+
+--- Record a value, nil is ignored (e.g. lost timestamped packets).
+function histogram:update(value)
+	if value then
+		C.hs_record(self, value >= 0 and value + 0.5 or value - 0.5)
+	end
+end
+
+--- Record n values from an int64_t array.
+function histogram:updateBatch(values, n)
+	C.hs_record_batch(self, values, n)
+end
+
+--- Add the values of another histogram with the same bucket size.
+function histogram:merge(other)
+	if not C.hs_merge(self, other) then
+		log:error("Cannot merge histograms with different bucket sizes")
+	end
+end
+
+function histogram:reset()
+	C.hs_reset(self)
+end
+
+function histogram:count()
+	return tonumber(C.hs_count(self))
+end
+
+function histogram:mean()
+	return C.hs_mean(self)
+end
+
+function histogram:variance()
+	return C.hs_variance(self)
+end
+
+function histogram:min()
+	return tonumber(C.hs_min(self))
+end
+
+function histogram:max()
+	return tonumber(C.hs_max(self))
+end
+
+--- Value at the given quantile (0..1).
+function histogram:percentile(q)
+	return tonumber(C.hs_percentile(self, q))
+end
+
+--- Write all non-empty buckets as CSV (value,count).
+function histogram:save(filename)
+	if not C.hs_write_csv(self, filename) then
+		log:error("Could not write histogram to %s", filename)
+	end
+end
+
+--- Serialize to a Lua string, see mod.deserialize().
+function histogram:serialize()
+	local size = C.hs_serialized_size(self)
+	local buf = ffi.new("uint8_t[?]", size)
+	C.hs_serialize(self, buf)
+	return ffi.string(buf, size)
+end
+
+--- Write the binary format to a file, see mod.load().
+function histogram:saveBinary(filename)
+	if not C.hs_save(self, filename) then
+		log:error("Could not write histogram to %s", filename)
+	end
+end
+
+function histogram:print(prefix)
+	prefix = prefix and prefix .. " " or ""
+	log:info("%sSamples: %d, Average: %.1f, StdDev: %.1f, Min: %d, p50: %d, p99: %d, p99.9: %d, Max: %d",
+		prefix, self:count(), self:mean(), math.sqrt(self:variance()), self:min(), self:percentile(0.5),
+		self:percentile(0.99), self:percentile(0.999), self:max())
+end
+
+ffi.metatype("struct hs_histogram", histogram)
+
+return mod
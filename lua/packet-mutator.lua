@@ -0,0 +1,143 @@
+--- Native updates of packet fields, see src/packet-mutator.hpp.
+--- Fields are integers of up to 8 bytes at fixed offsets with counters, random values, or lists as generators.
+
+local ffi = require "ffi"
+local log = require "log"
+
+local C = ffi.C
+
+ffi.cdef[[
+	struct packet_mutator;
+	struct packet_mutator* mg_mutator_create(uint32_t mode, uint32_t skip, uint64_t seed);
+	void mg_mutator_delete(struct packet_mutator* m);
+	uint32_t mg_mutator_add_field(struct packet_mutator* m, uint32_t offset, uint32_t width, bool big_endian);
+	void mg_mutator_set_counter(struct packet_mutator* m, uint32_t field, int64_t start, int64_t step, uint64_t count, uint64_t index, int64_t value);
+	void mg_mutator_set_random(struct packet_mutator* m, uint32_t field, int64_t min, int64_t max, int64_t value);
+	void mg_mutator_set_list(struct packet_mutator* m, uint32_t field, const int64_t* values, uint32_t n, bool random, uint64_t index, int64_t value);
+	bool mg_mutator_add_checksum(struct packet_mutator* m, uint32_t field, uint32_t offset, bool udp);
+	void mg_mutator_apply(struct packet_mutator* m, struct rte_mbuf** bufs, uint32_t n);
+	uint64_t mg_mutator_period(struct packet_mutator* m, uint64_t max);
+	void mg_mutator_generate(struct packet_mutator* m, struct rte_mbuf** bufs, uint32_t n);
+
+	struct packet_cycle;
+	struct packet_cycle* mg_cycle_create(struct rte_mbuf** bufs, uint32_t n);
+	void mg_cycle_delete(struct packet_cycle* cycle);
+	void mg_cycle_next(struct packet_cycle* cycle, struct rte_mbuf** bufs, uint32_t n);
+	uint64_t mg_cycle_memory(struct packet_cycle* cycle);
+]]
+
+local mod = {}
+
+--- Update modes, same semantics as the modes of the flow interface (interface/options/mode.lua).
+mod.modes = {
+	all = 0,
+	single = 1,
+	alternating = 2,
+	random = 3,
+	random_alt = 4,
+}
+
+local mutator = {}
+mutator.__index = mutator
+
+--- Create a new mutator, it must only be used by a single thread.
+-- @param mode name of the update mode
+-- @param skip optional, number of packets to leave unchanged at the start
+-- @param seed optional, seed for the random number generator
+function mod.new(mode, skip, seed)
+	local m = mod.modes[mode]
+	if not m then
+		log:fatal("Unsupported update mode %s", tostring(mode))
+	end
+	return C.mg_mutator_create(m, skip or 0, seed or math.random(0, 2^31))
+end
+
+--- Add a field, returns its index for the set* functions.
+-- @param offset offset in the packet
+-- @param width size in bytes (1 to 8)
+-- @param bigEndian byte order of the field
+function mutator:addField(offset, width, bigEndian)
+	return C.mg_mutator_add_field(self, offset, width, bigEndian)
+end
+
+--- Values start, start + step, ... wrapping after count values (0: never).
+-- @param index position of the next value
+-- @param value value currently in the packets
+function mutator:setCounter(field, start, step, count, index, value)
+	C.mg_mutator_set_counter(self, field, start, step, count, index, value)
+end
+
+--- Uniformly distributed values in [min, max].
+function mutator:setRandom(field, min, max, value)
+	C.mg_mutator_set_random(self, field, min, max, value)
+end
+
+--- Values of a list, in order or picked randomly.
+-- @param values Lua table of numbers
+-- @param index position of the next value
+function mutator:setList(field, values, random, index, value)
+	local array = ffi.new("int64_t[?]", #values)
+	for i, v in ipairs(values) do
+		array[i - 1] = v
+	end
+	C.mg_mutator_set_list(self, field, array, #values, random, index, value)
+end
+
+--- Update a 16 bit internet checksum at offset incrementally when the field is written.
+-- A field can be covered by up to two checksums, returns false if it already has two.
+-- @param udp a checksum of 0 is not updated and the result is never 0
+function mutator:addChecksum(field, offset, udp)
+	return C.mg_mutator_add_checksum(self, field, offset, udp or false)
+end
+
+--- Update the fields of the packets in a bufArray.
+-- @param n optional, number of packets, defaults to the size of the array
+function mutator:apply(bufs, n)
+	C.mg_mutator_apply(self, bufs.array, n or bufs.size)
+end
+
+--- Number of packets after which the packets repeat, 0 if they do not or only after more than max packets.
+function mutator:period(max)
+	return tonumber(C.mg_mutator_period(self, max))
+end
+
+--- Write consecutive packets of a bufArray, each one starts as a copy of its predecessor.
+-- The first packet must be filled already.
+function mutator:generate(bufs, n)
+	C.mg_mutator_generate(self, bufs.array, n or bufs.size)
+end
+
+function mutator:delete()
+	C.mg_mutator_delete(self)
+end
+
+ffi.metatype("struct packet_mutator", mutator)
+
+local cycle = {}
+cycle.__index = cycle
+
+--- Packets which are sent over and over again, e.g. one period generated by a mutator.
+-- The cycle takes over the packets of the bufArray. Sending them only takes another reference to the mbufs,
+-- they must not be modified afterwards.
+-- @param n optional, number of packets, defaults to the size of the array
+function mod.newCycle(bufs, n)
+	return C.mg_cycle_create(bufs.array, n or bufs.size)
+end
+
+--- Fill a bufArray with the next packets of the cycle instead of allocating them.
+function cycle:next(bufs)
+	C.mg_cycle_next(self, bufs.array, bufs.size)
+end
+
+--- Bytes of the mempool holding the packets.
+function cycle:memory()
+	return tonumber(C.mg_cycle_memory(self))
+end
+
+function cycle:delete()
+	C.mg_cycle_delete(self)
+end
+
+ffi.metatype("struct packet_cycle", cycle)
+
+return mod
@@ -4,6 +4,7 @@ local mg      = require "moongen"
 local serpent = require "Serpent"
 local memory  = require "memory"
 local log     = require "log"
+local arrival = require "arrival-process"
 
 local C = ffi.C
 
@@ -16,11 +17,39 @@ ffi.cdef[[
 	struct limiter_control {
 		uint64_t count;
 		uint64_t stop;
+		uint64_t bursts;
+		uint64_t early_cycles;
+		uint64_t max_early_cycles;
+		uint64_t resets;
+		uint64_t tx_zero;
+		uint64_t max_lag_cycles;
+		uint64_t lateness[32];
+	};
+
+	struct limiter_burst_config {
+		uint32_t threshold_ns;
+		uint32_t min_filler_size;
+		struct mempool* filler_pool;
+	};
+
+	struct limiter_feedback_config {
+		uint32_t interval_ms;
+		float gain;
+		char trace_file[256];
 	};
 
 	void mg_rate_limiter_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t link_speed, struct limiter_control* ctl);
-	void mg_rate_limiter_cbr_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, struct limiter_control* ctl);
-	void mg_rate_limiter_poisson_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, struct limiter_control* ctl);
+	void mg_rate_limiter_cbr_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, struct limiter_feedback_config* fb, struct limiter_control* ctl);
+	void mg_rate_limiter_poisson_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, struct limiter_feedback_config* fb, struct limiter_control* ctl);
+	void mg_rate_limiter_pattern_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, struct arrival_process* proc, struct limiter_feedback_config* fb, struct limiter_control* ctl);
+	void mg_rate_limiter_cbr_burst_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, struct limiter_burst_config* cfg, struct limiter_feedback_config* fb, struct limiter_control* ctl);
+	void mg_rate_limiter_poisson_burst_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, struct limiter_burst_config* cfg, struct limiter_feedback_config* fb, struct limiter_control* ctl);
+	void mg_rate_limiter_pattern_burst_main_loop(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, struct arrival_process* proc, struct limiter_burst_config* cfg, struct limiter_feedback_config* fb, struct limiter_control* ctl);
+
+	struct limiter_mux;
+	struct limiter_mux* mg_rate_limiter_mux_create();
+	void mg_rate_limiter_mux_add(struct limiter_mux* mux, struct rte_ring* ring, uint8_t device, uint16_t queue, uint8_t mode, uint32_t target, uint32_t link_speed, struct arrival_process* proc, struct limiter_control* ctl);
+	void mg_rate_limiter_mux_main_loop(struct limiter_mux* mux);
 ]]
 
 local mod = {}
@@ -29,6 +58,10 @@ mod.rateLimiter = rateLimiter
 
 rateLimiter.__index = rateLimiter
 
+local limiterGroup = {}
+limiterGroup.__index = limiterGroup
+
+
 function rateLimiter:send(bufs)
 	repeat
 		if pipe:sendToPacketRing(self.ring, bufs) then
@@ -52,6 +85,40 @@ function rateLimiter:stop()
 	memory.fence()
 end
 
+--- Get the precision given up by burst mode.
+-- @return number of tx bursts, average and maximum time in nanoseconds packets departed ahead of their schedule
+function rateLimiter:getPrecisionLoss()
+	local cyclesPerNs = mg.getCyclesFrequency() / 10^9
+	local count = tonumber(self.ctl.count)
+	local avg = count > 0 and tonumber(self.ctl.early_cycles) / count / cyclesPerNs or 0
+	return tonumber(self.ctl.bursts), avg, tonumber(self.ctl.max_early_cycles) / cyclesPerNs
+end
+
+--- Get the scheduling errors of the rate limiter thread, can be polled while the limiter is running.
+-- @return table with the fields
+--   packets: number of packets sent,
+--   resets: number of times the rate control was restarted after 10 ms without packets,
+--   txZero: number of tx_burst calls that did not accept a packet,
+--   maxLag: maximum time in nanoseconds a packet was passed to the NIC after its scheduled departure,
+--   lateness: histogram of the lateness, array of {upper bound in nanoseconds, number of packets},
+--   the first bucket holds packets sent on time, the last bucket has no upper bound (math.huge)
+function rateLimiter:getStats()
+	local cyclesPerNs = mg.getCyclesFrequency() / 10^9
+	local stats = {
+		packets = tonumber(self.ctl.count),
+		resets = tonumber(self.ctl.resets),
+		txZero = tonumber(self.ctl.tx_zero),
+		maxLag = tonumber(self.ctl.max_lag_cycles) / cyclesPerNs,
+		lateness = {},
+	}
+	local buckets = ffi.sizeof(self.ctl.lateness) / ffi.sizeof("uint64_t")
+	for i = 0, buckets - 1 do
+		local upper = i == 0 and 0 or i == buckets - 1 and math.huge or 2^i / cyclesPerNs
+		stats.lateness[#stats.lateness + 1] = { upper, tonumber(self.ctl.lateness[i]) }
+	end
+	return stats
+end
+
 function rateLimiter:__serialize()
 	return "require 'software-ratecontrol'; return " .. serpent.addMt(serpent.dumpRaw(self), "require('software-ratecontrol').rateLimiter"), true
 end
@@ -60,13 +127,96 @@ end
 -- By default it uses packet delay information from buf:setDelay().
 -- Can only be created from the master task because it spawns a separate thread.
 -- @param queue the wrapped tx queue
--- @param mode optional, either "cbr", "poisson", or "custom". Defaults to custom.
--- @param delay optional, inter-departure time in nanoseconds for cbr, 1/lambda (average) for poisson
-function mod:new(queue, mode, delay)
+-- @param mode optional, either "custom" or an arrival pattern, i.e., "cbr", "poisson", or a pattern table
+--   for the other patterns of the arrival-process module (e.g. {"pareto", shape = 1.2}). Defaults to custom.
+-- @param delay optional, inter-departure time in nanoseconds for cbr, average for the other patterns
+-- @param burst optional, table to enable the burst mode for arrival patterns.
+--   The departure times of a whole batch are computed at once and the batch is sent in sub-bursts.
+--   Fields: threshold: packets scheduled up to this many nanoseconds after the first packet of a sub-burst
+--   are sent with it (default 1000), fillers: fill gaps inside sub-bursts with CRC-invalid packets,
+--   requires a patched driver (default false), minFillerSize: smallest filler in bytes on the wire.
+--   Use rateLimiter:getPrecisionLoss() to check how far packets departed ahead of their schedule.
+-- @param feedback optional, table to enable the closed-loop rate correction for arrival patterns.
+--   The limiter periodically compares the TX counters of the NIC with the requested rate and corrects the
+--   inter-departure times, CRC-invalid fillers are not counted. Ports with multiple tx queues require per-queue
+--   counters of the NIC for queues 0 to 15, the rate is not corrected if the NIC does not maintain them.
+--   Fields: interval: correction interval in milliseconds (default 100), gain: fraction of the relative rate error
+--   corrected per interval (default 0.5), trace: optional file to log all corrections to (CSV).
+function mod:new(queue, mode, delay, burst, feedback)
 	mode = mode or "custom"
-	if mode ~= "poisson" and mode ~= "cbr" and mode ~= "custom" then
-		log:fatal("Unsupported mode " .. mode)
+	if mode ~= "custom" and not arrival.isValid(mode) then
+		log:fatal("Unsupported mode " .. tostring(arrival.getPattern(mode)))
+	end
+	if burst and mode == "custom" then
+		log:fatal("Burst mode is only supported for arrival patterns")
+	end
+	if feedback and mode == "custom" then
+		log:fatal("Rate feedback is only supported for arrival patterns")
+	end
+	local ring = pipe:newPacketRing()
+	local obj = setmetatable({
+		ring = ring.ring,
+		mode = mode,
+		delay = delay,
+		queue = queue,
+		ctl = memory.alloc("struct limiter_control*", ffi.sizeof("struct limiter_control"))
+	}, rateLimiter)
+	ffi.fill(obj.ctl, ffi.sizeof("struct limiter_control"))
+	local cfg
+	if burst then
+		cfg = memory.alloc("struct limiter_burst_config*", ffi.sizeof("struct limiter_burst_config"))
+		cfg.threshold_ns = burst.threshold or 1000
+		cfg.min_filler_size = burst.minFillerSize or (queue.dev.minPacketSize or 64) + 20
+		cfg.filler_pool = burst.fillers and queue:getFillerMempool() or nil
+	end
+	local fb
+	if feedback then
+		fb = memory.alloc("struct limiter_feedback_config*", ffi.sizeof("struct limiter_feedback_config"))
+		ffi.fill(fb, ffi.sizeof("struct limiter_feedback_config"))
+		fb.interval_ms = feedback.interval or 100
+		fb.gain = feedback.gain or 0.5
+		if feedback.trace then
+			if #feedback.trace >= ffi.sizeof(fb.trace_file) then
+				log:fatal("Trace file name too long: %s", feedback.trace)
+			end
+			ffi.copy(fb.trace_file, feedback.trace)
+		end
+	end
+	-- cbr and poisson have dedicated loops, other patterns use a precomputed arrival process
+	local name = arrival.getPattern(mode)
+	local proc
+	if name ~= "custom" and name ~= "cbr" and name ~= "poisson" then
+		proc = arrival.new(mode)
+	end
+	mg.startTask("__MG_RATE_LIMITER_MAIN", obj.ring, queue.id, queue.qid, name, delay, queue.dev:getLinkStatus().speed, obj.ctl, cfg, proc, fb)
+	return obj
+end
+
+--- Create a group of rate limiters that share a single limiter task.
+-- Add limiters with group:new(), they behave like limiters created with mod:new().
+-- Call group:start() once all limiters have been added.
+-- Can only be created from the master task because it spawns a separate thread.
+function mod:newGroup()
+	return setmetatable({
+		mux = C.mg_rate_limiter_mux_create(),
+		size = 0
+	}, limiterGroup)
+end
+
+--- Add a rate limiter to the group.
+-- @param queue the wrapped tx queue
+-- @param mode an arrival pattern, see mod:new()
+-- @param delay inter-departure time in nanoseconds for cbr, average for the other patterns
+function limiterGroup:new(queue, mode, delay)
+	if self.started then
+		log:fatal("Cannot add rate limiters to a group that has already been started")
 	end
+	if not arrival.isValid(mode) then
+		log:fatal("Unsupported mode " .. tostring(arrival.getPattern(mode)) .. " for rate limiter groups")
+	end
+	local name = arrival.getPattern(mode)
+	-- the limiter task creates a poisson process if none is passed and frees the processes when it ends
+	local proc = (name ~= "cbr" and name ~= "poisson") and arrival.new(mode) or nil
 	local ring = pipe:newPacketRing()
 	local obj = setmetatable({
 		ring = ring.ring,
@@ -76,19 +226,41 @@ function mod:new(queue, mode, delay)
 		ctl = memory.alloc("struct limiter_control*", ffi.sizeof("struct limiter_control"))
 	}, rateLimiter)
 	ffi.fill(obj.ctl, ffi.sizeof("struct limiter_control"))
-	mg.startTask("__MG_RATE_LIMITER_MAIN", obj.ring, queue.id, queue.qid, mode, delay, queue.dev:getLinkStatus().speed, obj.ctl)
+	C.mg_rate_limiter_mux_add(self.mux, obj.ring, queue.id, queue.qid, name == "cbr" and 0 or 1, delay, queue.dev:getLinkStatus().speed, proc, obj.ctl)
+	self.size = self.size + 1
 	return obj
 end
 
+--- Start the limiter task serving all rate limiters of this group.
+function limiterGroup:start()
+	self.started = true
+	mg.startTask("__MG_RATE_LIMITER_MUX_MAIN", self.mux)
+end
 
-function __MG_RATE_LIMITER_MAIN(ring, devId, qid, mode, delay, speed, ctl)
-	if mode == "cbr" then
-		C.mg_rate_limiter_cbr_main_loop(ring, devId, qid, delay, ctl)
+function __MG_RATE_LIMITER_MUX_MAIN(mux)
+	C.mg_rate_limiter_mux_main_loop(mux)
+end
+
+function __MG_RATE_LIMITER_MAIN(ring, devId, qid, mode, delay, speed, ctl, cfg, proc, fb)
+	if mode == "cbr" and cfg then
+		C.mg_rate_limiter_cbr_burst_main_loop(ring, devId, qid, delay, speed, cfg, fb, ctl)
+	elseif mode == "cbr" then
+		C.mg_rate_limiter_cbr_main_loop(ring, devId, qid, delay, fb, ctl)
+	elseif mode == "poisson" and cfg then
+		C.mg_rate_limiter_poisson_burst_main_loop(ring, devId, qid, delay, speed, cfg, fb, ctl)
 	elseif mode == "poisson" then
-		C.mg_rate_limiter_poisson_main_loop(ring, devId, qid, delay, speed, ctl)
+		C.mg_rate_limiter_poisson_main_loop(ring, devId, qid, delay, speed, fb, ctl)
+	elseif proc and cfg then
+		C.mg_rate_limiter_pattern_burst_main_loop(ring, devId, qid, delay, speed, proc, cfg, fb, ctl)
+	elseif proc then
+		C.mg_rate_limiter_pattern_main_loop(ring, devId, qid, delay, speed, proc, fb, ctl)
 	else
 		C.mg_rate_limiter_main_loop(ring, devId, qid, speed, ctl)
 	end
+	-- the process was created for this limiter by mod:new()
+	if proc then
+		C.mg_arrival_delete(proc)
+	end
 end
 
 return mod
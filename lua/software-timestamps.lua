@@ -4,13 +4,28 @@ local pkt    = require "packet"
 require "dpdkc" -- struct definitions
 
 local txQueue = device.__txQueuePrototype
+local rxQueue = device.__rxQueuePrototype
 local C = ffi.C
 local uint64Ptr = ffi.typeof("uint64_t*")
 
 ffi.cdef[[
 	void moongen_send_packet_with_timestamp(uint8_t port_id, uint16_t queue_id, struct rte_mbuf* pkt, uint16_t offs);
+	uint16_t moongen_send_packets_with_timestamp(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** pkts, uint16_t num_pkts, uint16_t offs);
+	uint16_t moongen_recv_packets_with_timestamp(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** pkts, uint16_t num_pkts);
+
+	struct tsc_calibration {
+		uint64_t tsc_base;
+		uint64_t ns_base;
+		double ns_per_cycle;
+		uint64_t tsc_start;
+		uint64_t ns_start;
+	};
+	void moongen_tsc_calibration_init(struct tsc_calibration* cal);
+	void moongen_tsc_calibration_update(struct tsc_calibration* cal);
 ]]
 
+local mod = {}
+
 --- Send a single timestamped packet
 -- @param bufs bufArray, only the first packet in it will be sent
 -- @param offs offset in the packet at which the timestamp will be written. will be aligned to a uint64_t
@@ -20,7 +35,59 @@ function txQueue:sendWithTimestamp(bufs, offs)
 	C.moongen_send_packet_with_timestamp(self.id, self.qid, bufs.array[0], offs)
 end
 
+--- Send a batch of timestamped packets, all packets are stamped right before they are passed to the NIC.
+-- @param bufs bufArray
+-- @param offs offset in the packets at which the timestamps will be written. will be aligned to a uint64_t
+-- @param n optional, number of packets to send (defaults to full bufs)
+-- @return number of packets sent, only less than n if the task was stopped
+function txQueue:sendWithTimestamps(bufs, offs, n)
+	self.used = true
+	offs = offs and offs / 8 or 6
+	return C.moongen_send_packets_with_timestamp(self.id, self.qid, bufs.array, n or bufs.size, offs)
+end
+
+--- Receive packets and stamp them in software, get the timestamp with buf:getSoftwareRxTimestamp()
+-- @param bufs bufArray to receive into
+-- @return number of packets received
+function rxQueue:recvWithSoftwareTimestamps(bufs)
+	return C.moongen_recv_packets_with_timestamp(self.id, self.qid, bufs.array, bufs.size)
+end
+
 function pkt:getSoftwareTxTimestamp(offs)
 	local offs = offs and offs / 8 or 6 -- default from sendWithTimestamp
 	return uint64Ptr(self:getData())[offs]
 end
+
+function pkt:getSoftwareRxTimestamp()
+	return self.udata64
+end
+
+local calibration = {}
+calibration.__index = calibration
+
+--- Create a TSC calibration to convert software timestamps to nanoseconds.
+-- Call calibration:update() periodically (e.g. once per second) to correct for the drift of the TSC.
+-- A calibration must only be used by a single task.
+function mod.newCalibration()
+	local cal = ffi.new("struct tsc_calibration")
+	C.moongen_tsc_calibration_init(cal)
+	return cal
+end
+
+function calibration:update()
+	C.moongen_tsc_calibration_update(self)
+end
+
+--- Convert a TSC value to nanoseconds of CLOCK_MONOTONIC_RAW.
+function calibration:toNs(tsc)
+	return tonumber(self.ns_base) + tonumber(ffi.cast("int64_t", tsc - self.tsc_base)) * self.ns_per_cycle
+end
+
+--- Convert a difference of two TSC values (e.g. rx - tx timestamp) to nanoseconds.
+function calibration:cyclesToNs(cycles)
+	return tonumber(ffi.cast("int64_t", cycles)) * self.ns_per_cycle
+end
+
+ffi.metatype("struct tsc_calibration", calibration)
+
+return mod
@@ -0,0 +1,49 @@
+#include <cstdint>
+#include <rte_config.h>
+#include <rte_mbuf.h>
+#include "arrival-process.hpp"
+
+extern "C" {
+	arrival::process* mg_arrival_create(uint32_t dist, double p1, double p2, uint64_t seed) {
+		return new arrival::process(static_cast<arrival::distribution>(dist), p1, p2, seed);
+	}
+
+	void mg_arrival_set_cdf(arrival::process* proc, const double* values, const double* probabilities, uint32_t n) {
+		proc->set_cdf(values, probabilities, n);
+	}
+
+	void mg_arrival_delete(arrival::process* proc) {
+		delete proc;
+	}
+
+	// fill out with n samples (mean 1)
+	void mg_arrival_next_n(arrival::process* proc, double* out, uint32_t n) {
+		while (n) {
+			uint32_t batch = n < arrival::process::chunk_size ? n : arrival::process::chunk_size;
+			proc->prepare(batch);
+			for (uint32_t i = 0; i < batch; i++) {
+				*out++ = proc->next();
+			}
+			n -= batch;
+		}
+	}
+
+	/*
+	 * Set the gaps (bytes on the wire before each packet, see pkt:setDelay()) for CRC-based rate control.
+	 * target_bytes: average inter-departure time in bytes on the wire including the packet itself
+	 * carry: fractional bytes carried over between calls, initialize with 0
+	 */
+	void mg_arrival_set_gaps(arrival::process* proc, struct rte_mbuf** bufs, uint32_t n, double target_bytes, double* carry) {
+		proc->prepare(n);
+		double frac = *carry;
+		for (uint32_t i = 0; i < n; i++) {
+			// 24 bytes CRC, preamble, SFD, and IFG
+			double avg = target_bytes - (bufs[i]->pkt_len + 24);
+			double gap = (avg <= 0 ? 0 : avg * proc->next()) + frac;
+			uint64_t bytes = (uint64_t) gap;
+			frac = gap - bytes;
+			bufs[i]->udata64 = bytes;
+		}
+		*carry = frac;
+	}
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+/*
+ * Arrival processes for the software rate limiters.
+ * Inter-departure times are precomputed in chunks into a ring buffer outside of the timing-critical loops,
+ * the limiter only reads the next sample and scales it to the desired rate.
+ * All distributions are normalized to a mean of 1.
+ */
+namespace arrival {
+	enum class distribution : uint32_t {
+		constant = 0,
+		exponential = 1,
+		// on/off Markov-modulated: bursts with geometrically distributed length, exponential gaps inside and between bursts
+		onoff = 2,
+		pareto = 3,
+		// uniformly distributed jitter around the mean
+		uniform = 4,
+		// piecewise-linear interpolation of a user-supplied CDF
+		empirical = 5,
+	};
+
+	/*
+	 * xoshiro256+ with four independent lanes, the lane loops are auto-vectorized
+	 * http://xoshiro.di.unimi.it/xoshiro256plus.c
+	 */
+	struct xoshiro256p_x4 {
+		static constexpr int lanes = 4;
+		uint64_t s0[lanes], s1[lanes], s2[lanes], s3[lanes];
+
+		explicit xoshiro256p_x4(uint64_t seed) {
+			// splitmix64 to initialize the state
+			uint64_t* words[] = {s0, s1, s2, s3};
+			for (auto word : words) {
+				for (int l = 0; l < lanes; l++) {
+					uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+					z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+					z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+					word[l] = z ^ (z >> 31);
+				}
+			}
+		}
+
+		// raw outputs, the lowest bits are weak, use the upper ones
+		inline void next_u64(uint64_t* out) {
+			for (int l = 0; l < lanes; l++) {
+				out[l] = s0[l] + s3[l];
+				uint64_t t = s1[l] << 17;
+				s2[l] ^= s0[l];
+				s3[l] ^= s1[l];
+				s1[l] ^= s2[l];
+				s0[l] ^= s3[l];
+				s2[l] ^= t;
+				s3[l] = (s3[l] << 45) | (s3[l] >> 19);
+			}
+		}
+
+		// uniform doubles in (0, 1]
+		inline void next(double* out) {
+			uint64_t raw[lanes];
+			next_u64(raw);
+			for (int l = 0; l < lanes; l++) {
+				out[l] = ((raw[l] >> 11) + 1) * (1.0 / 9007199254740992.0);
+			}
+		}
+	};
+
+	class process {
+	public:
+		static constexpr uint32_t ring_size = 4096;
+		static constexpr uint32_t chunk_size = 256;
+
+		/*
+		 * p1, p2: parameters of the distribution
+		 * onoff: mean number of packets per burst, gap inside bursts relative to the mean gap (0..1)
+		 * pareto: shape (> 1)
+		 * uniform: jitter relative to the mean (0..1)
+		 */
+		process(distribution dist, double p1, double p2, uint64_t seed = 0x4D6F6F6E47656EULL)
+			: dist(dist), rng(seed), head(0), tail(0) {
+			switch (dist) {
+			case distribution::onoff:
+				// a burst ends after a packet with probability 1 / p1, the off time restores the mean of 1
+				end_prob = 1.0 / std::max(p1, 1.0);
+				on_gap = std::min(std::max(p2, 0.0), 1.0);
+				off_gap = (1.0 - on_gap) * std::max(p1, 1.0);
+				break;
+			case distribution::pareto:
+				shape = std::max(p1, 1.0001);
+				scale = (shape - 1) / shape;
+				break;
+			case distribution::uniform:
+				jitter = std::min(std::max(p1, 0.0), 1.0);
+				break;
+			default:
+				break;
+			}
+		}
+
+		/*
+		 * Set the points of an empirical CDF, values must be sorted in ascending order and the last probability must be 1.
+		 * Values are rescaled to a mean of 1, i.e. the CDF defines the shape and the limiter the rate.
+		 */
+		void set_cdf(const double* values, const double* probabilities, uint32_t n) {
+			cdf_values.assign(values, values + n);
+			cdf_probs.assign(probabilities, probabilities + n);
+			// the first point has a point mass, the other segments are uniform between two points
+			double mean = n ? cdf_values[0] * cdf_probs[0] : 0;
+			for (uint32_t i = 1; i < n; i++) {
+				mean += (cdf_probs[i] - cdf_probs[i - 1]) * (cdf_values[i] + cdf_values[i - 1]) / 2;
+			}
+			if (mean > 0) {
+				for (auto& v : cdf_values) {
+					v /= mean;
+				}
+			}
+			head = tail = 0;
+		}
+
+		/*
+		 * Make sure at least n samples are available.
+		 * Call this before a timing-critical section that reads up to n samples.
+		 */
+		inline void prepare(uint32_t n) {
+			while (tail - head < n) {
+				refill();
+			}
+			// top up the buffer while we are at it so that the next batch is cheap
+			if (ring_size - (tail - head) >= chunk_size) {
+				refill();
+			}
+		}
+
+		// next sample, prepare() must have been called for it
+		inline double next() {
+			return samples[head++ & (ring_size - 1)];
+		}
+
+	private:
+		distribution dist;
+		xoshiro256p_x4 rng;
+		uint32_t head;
+		uint32_t tail;
+		double end_prob = 0, on_gap = 0, off_gap = 0;
+		double shape = 0, scale = 0;
+		double jitter = 0;
+		std::vector<double> cdf_values;
+		std::vector<double> cdf_probs;
+		double uniform[chunk_size];
+		double samples[ring_size];
+
+		inline double inverse_cdf(double u) {
+			if (cdf_values.empty()) {
+				return 1;
+			}
+			auto it = std::lower_bound(cdf_probs.begin(), cdf_probs.end(), u);
+			if (it == cdf_probs.begin()) {
+				return cdf_values.front();
+			}
+			if (it == cdf_probs.end()) {
+				return cdf_values.back();
+			}
+			size_t i = it - cdf_probs.begin();
+			double frac = (u - cdf_probs[i - 1]) / (cdf_probs[i] - cdf_probs[i - 1]);
+			return cdf_values[i - 1] + frac * (cdf_values[i] - cdf_values[i - 1]);
+		}
+
+		// generate chunk_size samples, chunk_size divides ring_size, so a chunk never wraps
+		void refill() {
+			for (uint32_t i = 0; i < chunk_size; i += xoshiro256p_x4::lanes) {
+				rng.next(uniform + i);
+			}
+			double* out = samples + (tail & (ring_size - 1));
+			switch (dist) {
+			case distribution::constant:
+				std::fill(out, out + chunk_size, 1.0);
+				break;
+			case distribution::exponential:
+				for (uint32_t i = 0; i < chunk_size; i++) {
+					out[i] = -std::log(uniform[i]);
+				}
+				break;
+			case distribution::onoff:
+				for (uint32_t i = 0; i < chunk_size; i++) {
+					out[i] = -std::log(uniform[i]) * on_gap;
+				}
+				for (uint32_t i = 0; i < chunk_size; i += xoshiro256p_x4::lanes) {
+					double u[xoshiro256p_x4::lanes];
+					rng.next(u);
+					for (int l = 0; l < xoshiro256p_x4::lanes; l++) {
+						// reuse the fraction of u below end_prob for the off time
+						if (u[l] <= end_prob) {
+							out[i + l] -= std::log(u[l] / end_prob) * off_gap;
+						}
+					}
+				}
+				break;
+			case distribution::pareto:
+				for (uint32_t i = 0; i < chunk_size; i++) {
+					out[i] = scale * std::pow(uniform[i], -1.0 / shape);
+				}
+				break;
+			case distribution::uniform:
+				for (uint32_t i = 0; i < chunk_size; i++) {
+					out[i] = 1.0 + jitter * (2.0 * uniform[i] - 1.0);
+				}
+				break;
+			case distribution::empirical:
+				for (uint32_t i = 0; i < chunk_size; i++) {
+					out[i] = inverse_cdf(uniform[i]);
+				}
+				break;
+			}
+			tail += chunk_size;
+		}
+	};
+}
@@ -3,18 +3,56 @@
 #include <rte_ethdev.h>
 #include <rte_mbuf.h>
 #include <rte_mempool.h>
+#include <rte_malloc.h>
 
 #include "device.h"
 
-static uint64_t bad_pkts_sent[RTE_MAX_ETHPORTS];
-static uint64_t bad_bytes_sent[RTE_MAX_ETHPORTS];
+// queues above this share a single, atomically updated slot per port
+#define BAD_PKT_STATS_QUEUES 64
+
+// one cache line per tx queue, a queue is only used by a single thread, so there is only a single writer
+struct bad_pkt_stats {
+	uint64_t pkts;
+	uint64_t bytes;
+} __rte_cache_aligned;
+
+static struct bad_pkt_stats bad_pkts_sent[RTE_MAX_ETHPORTS][BAD_PKT_STATS_QUEUES + 1];
 
 uint64_t moongen_get_bad_pkts_sent(uint8_t port_id) {
-	return __sync_fetch_and_add(&bad_pkts_sent[port_id], 0);
+	uint64_t sum = 0;
+	for (int i = 0; i <= BAD_PKT_STATS_QUEUES; i++) {
+		sum += __atomic_load_n(&bad_pkts_sent[port_id][i].pkts, __ATOMIC_RELAXED);
+	}
+	return sum;
 }
 
 uint64_t moongen_get_bad_bytes_sent(uint8_t port_id) {
-	return __sync_fetch_and_add(&bad_bytes_sent[port_id], 0);
+	uint64_t sum = 0;
+	for (int i = 0; i <= BAD_PKT_STATS_QUEUES; i++) {
+		sum += __atomic_load_n(&bad_pkts_sent[port_id][i].bytes, __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+// queues >= BAD_PKT_STATS_QUEUES share a slot, their counters include all of these queues
+uint64_t moongen_get_bad_pkts_sent_queue(uint8_t port_id, uint16_t queue_id) {
+	return __atomic_load_n(&bad_pkts_sent[port_id][RTE_MIN(queue_id, BAD_PKT_STATS_QUEUES)].pkts, __ATOMIC_RELAXED);
+}
+
+uint64_t moongen_get_bad_bytes_sent_queue(uint8_t port_id, uint16_t queue_id) {
+	return __atomic_load_n(&bad_pkts_sent[port_id][RTE_MIN(queue_id, BAD_PKT_STATS_QUEUES)].bytes, __ATOMIC_RELAXED);
+}
+
+void moongen_add_bad_pkts_sent(uint8_t port_id, uint16_t queue_id, uint32_t num_pkts, uint32_t num_bytes) {
+	if (queue_id < BAD_PKT_STATS_QUEUES) {
+		struct bad_pkt_stats* stats = &bad_pkts_sent[port_id][queue_id];
+		__atomic_store_n(&stats->pkts, stats->pkts + num_pkts, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->bytes, stats->bytes + num_bytes, __ATOMIC_RELAXED);
+	} else {
+		struct bad_pkt_stats* stats = &bad_pkts_sent[port_id][BAD_PKT_STATS_QUEUES];
+		__atomic_fetch_add(&stats->pkts, num_pkts, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->bytes, num_bytes, __ATOMIC_RELAXED);
+	}
 }
 
 static struct rte_mbuf* get_delay_pkt_bad_crc(struct rte_mempool* pool, uint32_t* rem_delay, uint32_t min_pkt_size) {
@@ -89,9 +127,153 @@ void moongen_send_all_packets_with_delay_bad_crc(uint8_t port_id, uint16_t queue
 			send_buf_idx = 0;
 		}
 	}
-	// atomic as multiple threads may use the same stats register from multiple queues
-	__sync_fetch_and_add(&bad_pkts_sent[port_id], num_bad_pkts);
-	__sync_fetch_and_add(&bad_bytes_sent[port_id], num_bad_bytes);
+	moongen_add_bad_pkts_sent(port_id, queue_id, num_bad_pkts, num_bad_bytes);
 	return;
 }
 
+// largest filler in bytes on the wire
+#define MAX_FILLER_SIZE 1538
+
+/*
+ * Prebuilt filler packets for a single tx queue.
+ * Fillers exist in size classes from min_size to MAX_FILLER_SIZE in steps of step bytes, they are never freed while
+ * the cache exists as it holds a reference to each of them. Sending a filler only increments its reference count.
+ * Gaps are rounded down to the next size class, the difference is carried forward to the next gap.
+ */
+struct filler_cache {
+	uint32_t min_size;
+	uint32_t step;
+	uint32_t num_classes;
+	// bytes of the previous gaps that could not be filled
+	uint32_t carry;
+	struct rte_mbuf* fillers[];
+};
+
+// fillers still queued for transmission are returned to the pool once they have been sent
+void moongen_filler_cache_free(struct filler_cache* cache) {
+	for (uint32_t i = 0; i < cache->num_classes; i++) {
+		rte_pktmbuf_free(cache->fillers[i]);
+	}
+	rte_free(cache);
+}
+
+struct filler_cache* moongen_filler_cache_create(struct rte_mempool* pool, uint32_t min_pkt_size, uint32_t step) {
+	if (min_pkt_size > MAX_FILLER_SIZE || min_pkt_size <= 20 || !step) {
+		return NULL;
+	}
+	uint32_t num_classes = (MAX_FILLER_SIZE - min_pkt_size) / step + 1;
+	// the largest class is always MAX_FILLER_SIZE
+	if ((MAX_FILLER_SIZE - min_pkt_size) % step) {
+		num_classes++;
+	}
+	struct filler_cache* cache = rte_zmalloc("filler_cache", sizeof(struct filler_cache) + num_classes * sizeof(struct rte_mbuf*), RTE_CACHE_LINE_SIZE);
+	if (!cache) {
+		return NULL;
+	}
+	cache->min_size = min_pkt_size;
+	cache->step = step;
+	cache->num_classes = num_classes;
+	for (uint32_t i = 0; i < num_classes; i++) {
+		uint32_t size = RTE_MIN(min_pkt_size + i * step, MAX_FILLER_SIZE);
+		struct rte_mbuf* pkt = rte_pktmbuf_alloc(pool);
+		if (!pkt) {
+			cache->num_classes = i;
+			moongen_filler_cache_free(cache);
+			return NULL;
+		}
+		// account for preamble, sfd, and ifg (CRC is disabled)
+		pkt->data_len = size - 20;
+		pkt->pkt_len = size - 20;
+		pkt->ol_flags |= PKT_TX_NO_CRC_CSUM;
+		cache->fillers[i] = pkt;
+	}
+	return cache;
+}
+
+// largest filler that fits into size, size must be >= min_size
+static inline struct rte_mbuf* get_cached_filler(struct filler_cache* cache, uint32_t size) {
+	uint32_t idx = size >= MAX_FILLER_SIZE ? cache->num_classes - 1 : (size - cache->min_size) / cache->step;
+	struct rte_mbuf* pkt = cache->fillers[idx];
+	rte_mbuf_refcnt_update(pkt, 1);
+	return pkt;
+}
+
+/*
+ * Same as moongen_send_all_packets_with_delay_bad_crc() but with fillers from a filler_cache,
+ * i.e., without any allocation or writes to mbuf headers besides the reference count.
+ * The cache must only be used by a single queue.
+ */
+void moongen_send_all_packets_with_delay_bad_crc_cached(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** load_pkts, uint16_t num_pkts, struct filler_cache* cache) {
+	const int BUF_SIZE = 128;
+	struct rte_mbuf* pkts[BUF_SIZE];
+	int send_buf_idx = 0;
+	uint32_t num_bad_pkts = 0;
+	uint32_t num_bad_bytes = 0;
+	uint32_t min_size = cache->min_size;
+	uint32_t gap = cache->carry;
+	for (uint16_t i = 0; i < num_pkts; i++) {
+		struct rte_mbuf* pkt = load_pkts[i];
+		// desired inter-frame spacing is encoded in the udata field (bytes on the wire)
+		gap += (uint32_t) pkt->udata64;
+		while (gap >= min_size) {
+			uint32_t size;
+			if (gap <= MAX_FILLER_SIZE) {
+				size = gap;
+			} else if (gap >= MAX_FILLER_SIZE + min_size) {
+				size = MAX_FILLER_SIZE;
+			} else {
+				// avoid leaving a remainder that is too small for another filler
+				size = gap / 2;
+			}
+			struct rte_mbuf* filler = get_cached_filler(cache, size);
+			// packet size: [MAC, CRC] to be consistent with HW counters
+			num_bad_bytes += filler->pkt_len;
+			num_bad_pkts++;
+			gap -= filler->pkt_len + 20;
+			pkts[send_buf_idx++] = filler;
+			if (send_buf_idx >= BUF_SIZE) {
+				dpdk_send_all_packets(port_id, queue_id, pkts, send_buf_idx);
+				send_buf_idx = 0;
+			}
+		}
+		pkts[send_buf_idx++] = pkt;
+		if (send_buf_idx >= BUF_SIZE || i + 1 == num_pkts) {
+			dpdk_send_all_packets(port_id, queue_id, pkts, send_buf_idx);
+			send_buf_idx = 0;
+		}
+	}
+	cache->carry = gap;
+	moongen_add_bad_pkts_sent(port_id, queue_id, num_bad_pkts, num_bad_bytes);
+}
+
+/*
+ * Fill a gap of the given size (bytes on the wire) with CRC-invalid packets.
+ * Returns the number of packets stored in pkts, a remainder smaller than min_pkt_size stays unfilled.
+ * The caller is responsible for accounting the packets via moongen_add_bad_pkts_sent().
+ */
+uint16_t moongen_get_gap_fillers(struct rte_mempool* pool, uint32_t gap, uint32_t min_pkt_size, struct rte_mbuf** pkts, uint16_t max_pkts) {
+	uint16_t num = 0;
+	while (gap >= min_pkt_size && num < max_pkts) {
+		uint32_t size;
+		if (gap <= 1538) {
+			size = gap;
+		} else if (gap >= 1538 + min_pkt_size) {
+			size = 1538;
+		} else {
+			// avoid leaving a remainder that is too small for another filler
+			size = gap / 2;
+		}
+		struct rte_mbuf* pkt = rte_pktmbuf_alloc(pool);
+		if (!pkt) {
+			break;
+		}
+		// account for preamble, sfd, and ifg (CRC is disabled)
+		pkt->data_len = size - 20;
+		pkt->pkt_len = size - 20;
+		pkt->ol_flags |= PKT_TX_NO_CRC_CSUM;
+		pkts[num++] = pkt;
+		gap -= size;
+	}
+	return num;
+}
+
@@ -0,0 +1,556 @@
+/*
+ * Single-writer open-addressing hash map in the style of a Swiss table (see abseil's flat_hash_map).
+ * Slots are organized in groups of 16 with one control byte per slot: empty, deleted, or the lower 7 bits of the hash
+ * of the key in the slot. A lookup compares the control bytes of a whole group with the hash bits at once and only
+ * compares the keys of the matching slots. Entries are stored inline, there is no allocation per entry.
+ *
+ * The maps are not thread-safe: one thread may modify a map, or several threads may only read it.
+ * Accessors point directly to the slot and are invalidated by the next insert.
+ * The C API has the same shape as the one of hashmap.cpp with the prefix fmap instead of hmap.
+ */
+
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hashmap.hpp"
+
+#define FLAT_GROUP_SIZE 16
+// keys hashed and prefetched ahead in batches
+#define FLAT_BATCH_PREFETCH 16
+
+namespace hash_map {
+	enum flat_hash : uint8_t {
+		// SipHash-2-4 as in the TBB maps
+		FLAT_HASH_SIP = 0,
+		FLAT_HASH_SIP13 = 1,
+		FLAT_HASH_HIGHWAY = 2,
+		// multiply-xorshift, fastest but not resistant to chosen keys
+		FLAT_HASH_FAST = 3,
+	};
+
+	constexpr uint64_t highway_secret[4] = {1, 2, 3, 4};
+
+	template<size_t key_size>
+	inline uint64_t fast_hash(const K<key_size>& k) {
+		static_assert(key_size % 8 == 0, "keys are hashed in words of 8 bytes");
+		uint64_t h = secret;
+		for (size_t i = 0; i < key_size; i += 8) {
+			uint64_t w;
+			memcpy(&w, k.data + i, sizeof(w));
+			h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+			h ^= h >> 32;
+		}
+		// MurmurHash3 finalizer
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		return h ^ (h >> 33);
+	}
+
+	template<size_t key_size>
+	inline uint64_t hash_key(const K<key_size>& k, uint8_t hash) {
+		const char* data = reinterpret_cast<const char*>(k.data + 0);
+		switch (hash) {
+			case FLAT_HASH_SIP13:
+				return SipHash13C(sip_secret, data, key_size);
+			case FLAT_HASH_HIGHWAY:
+				return HighwayHash64(highway_secret, data, key_size);
+			case FLAT_HASH_FAST:
+				return fast_hash(k);
+			default:
+				return SipHashC(sip_secret, data, key_size);
+		}
+	}
+
+	/*
+	 * Control bytes of a group, bit i of the masks is set for slot i
+	 */
+	class ctrl_group {
+	public:
+		static constexpr uint8_t empty = 0x80;
+		static constexpr uint8_t deleted = 0xFE;
+
+#ifdef __SSE2__
+		explicit ctrl_group(const uint8_t* ctrl) : ctrl(_mm_load_si128(reinterpret_cast<const __m128i*>(ctrl))) {
+		}
+
+		inline uint32_t match(uint8_t h2) const {
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+		}
+
+		// empty and deleted slots have the highest bit set
+		inline uint32_t match_free() const {
+			return _mm_movemask_epi8(ctrl);
+		}
+
+	private:
+		__m128i ctrl;
+#else
+		explicit ctrl_group(const uint8_t* ctrl) : ctrl(ctrl) {
+		}
+
+		inline uint32_t match(uint8_t h2) const {
+			uint32_t mask = 0;
+			for (uint32_t i = 0; i < FLAT_GROUP_SIZE; i++) {
+				mask |= (uint32_t) (ctrl[i] == h2) << i;
+			}
+			return mask;
+		}
+
+		inline uint32_t match_free() const {
+			uint32_t mask = 0;
+			for (uint32_t i = 0; i < FLAT_GROUP_SIZE; i++) {
+				mask |= (uint32_t) (ctrl[i] >> 7) << i;
+			}
+			return mask;
+		}
+
+	private:
+		const uint8_t* ctrl;
+#endif
+
+	public:
+		inline uint32_t match_empty() const {
+			return match(empty);
+		}
+	};
+
+	template<size_t key_size, size_t value_size>
+	class flat_map {
+	public:
+		struct slot {
+			K<key_size> key;
+			V<value_size> value;
+		};
+
+		struct accessor {
+			slot* s = nullptr;
+		};
+
+		expiry_index<key_size> expiry;
+
+		explicit flat_map(uint8_t hash) : hash(hash) {
+		}
+
+		~flat_map() {
+			free(ctrl);
+			free(slots);
+		}
+
+		size_t size() const {
+			return count;
+		}
+
+		size_t capacity() const {
+			return cap;
+		}
+
+		void memory(hmap_memory* out) const {
+			out->bytes = cap * (sizeof(slot) + 1);
+			out->entries = count;
+			out->buckets = cap;
+			out->load_factor = cap ? (double) count / cap : 0;
+		}
+
+		inline uint64_t hash_of(const K<key_size>& key) const {
+			return hash_key(key, hash);
+		}
+
+		/*
+		 * Make room for n entries without rehashing, throws std::bad_alloc
+		 */
+		void reserve(size_t n) {
+			size_t needed = FLAT_GROUP_SIZE;
+			while (needed / 8 * 7 < n) {
+				needed *= 2;
+			}
+			if (needed > cap) {
+				rehash(needed);
+			}
+		}
+
+		inline void prefetch(uint64_t h) const {
+			if (cap) {
+				size_t g = (h >> 7) & (groups() - 1);
+				__builtin_prefetch(ctrl + g * FLAT_GROUP_SIZE);
+				__builtin_prefetch(slots + g * FLAT_GROUP_SIZE);
+			}
+		}
+
+		inline slot* find(const K<key_size>& key) const {
+			return find(key, hash_of(key));
+		}
+
+		slot* find(const K<key_size>& key, uint64_t h) const {
+			if (!cap) {
+				return nullptr;
+			}
+			uint8_t h2 = h & 0x7F;
+			size_t mask = groups() - 1;
+			size_t g = (h >> 7) & mask;
+			// triangular probing visits every group once
+			for (size_t i = 1; i <= groups(); i++) {
+				ctrl_group group(ctrl + g * FLAT_GROUP_SIZE);
+				for (uint32_t bits = group.match(h2); bits; bits &= bits - 1) {
+					slot* s = slots + g * FLAT_GROUP_SIZE + __builtin_ctz(bits);
+					if (s->key == key) {
+						return s;
+					}
+				}
+				if (group.match_empty()) {
+					return nullptr;
+				}
+				g = (g + i) & mask;
+			}
+			return nullptr;
+		}
+
+		/*
+		 * Find or insert the key, new values are zeroed. Throws std::bad_alloc
+		 * Returns the slot and whether it was inserted.
+		 */
+		inline std::pair<slot*, bool> insert(const K<key_size>& key) {
+			return insert(key, hash_of(key));
+		}
+
+		std::pair<slot*, bool> insert(const K<key_size>& key, uint64_t h) {
+			slot* s = find(key, h);
+			if (s) {
+				return {s, false};
+			}
+			if (used + 1 > cap / 8 * 7) {
+				// rehash in place if the table is full of deleted slots
+				rehash(count * 2 < cap / 8 * 7 ? std::max<size_t>(cap, FLAT_GROUP_SIZE) : std::max<size_t>(cap * 2, FLAT_GROUP_SIZE));
+			}
+			size_t idx = find_free(ctrl, groups(), h);
+			if (ctrl[idx] == ctrl_group::empty) {
+				used++;
+			}
+			ctrl[idx] = h & 0x7F;
+			s = slots + idx;
+			s->key = key;
+			s->value.fill(0);
+			count++;
+			return {s, true};
+		}
+
+		void erase(slot* s) {
+			size_t idx = s - slots;
+			// a group which still has an empty slot never made a lookup continue to the next group
+			if (ctrl_group(ctrl + idx / FLAT_GROUP_SIZE * FLAT_GROUP_SIZE).match_empty()) {
+				ctrl[idx] = ctrl_group::empty;
+				used--;
+			} else {
+				ctrl[idx] = ctrl_group::deleted;
+			}
+			count--;
+		}
+
+		void clear() {
+			if (cap) {
+				memset(ctrl, ctrl_group::empty, cap);
+			}
+			count = 0;
+			used = 0;
+			expiry.clear();
+		}
+
+		/*
+		 * Call fn(slot*) for all entries, fn may erase the entry
+		 */
+		template<typename Fn>
+		void for_each(Fn fn) {
+			for (size_t i = 0; i < cap; i++) {
+				if (!(ctrl[i] & 0x80)) {
+					fn(slots + i);
+				}
+			}
+		}
+
+	private:
+		uint8_t hash;
+		uint8_t* ctrl = nullptr;
+		slot* slots = nullptr;
+		size_t cap = 0;
+		// entries
+		size_t count = 0;
+		// entries and deleted slots
+		size_t used = 0;
+
+		size_t groups() const {
+			return cap / FLAT_GROUP_SIZE;
+		}
+
+		static size_t find_free(const uint8_t* ctrl, size_t groups, uint64_t h) {
+			size_t mask = groups - 1;
+			size_t g = (h >> 7) & mask;
+			for (size_t i = 1;; i++) {
+				uint32_t bits = ctrl_group(ctrl + g * FLAT_GROUP_SIZE).match_free();
+				if (bits) {
+					return g * FLAT_GROUP_SIZE + __builtin_ctz(bits);
+				}
+				g = (g + i) & mask;
+			}
+		}
+
+		void rehash(size_t new_cap) {
+			uint8_t* new_ctrl;
+			slot* new_slots;
+			if (posix_memalign(reinterpret_cast<void**>(&new_ctrl), 64, new_cap)) {
+				throw std::bad_alloc();
+			}
+			if (posix_memalign(reinterpret_cast<void**>(&new_slots), 64, new_cap * sizeof(slot))) {
+				free(new_ctrl);
+				throw std::bad_alloc();
+			}
+			memset(new_ctrl, ctrl_group::empty, new_cap);
+			for (size_t i = 0; i < cap; i++) {
+				if (!(ctrl[i] & 0x80)) {
+					uint64_t h = hash_of(slots[i].key);
+					size_t idx = find_free(new_ctrl, new_cap / FLAT_GROUP_SIZE, h);
+					new_ctrl[idx] = h & 0x7F;
+					memcpy(new_slots + idx, slots + i, sizeof(slot));
+				}
+			}
+			free(ctrl);
+			free(slots);
+			ctrl = new_ctrl;
+			slots = new_slots;
+			cap = new_cap;
+			used = count;
+		}
+	};
+
+	/*
+	 * Same semantics as the functions for the TBB maps in hashmap.cpp
+	 */
+	template<size_t key_size, size_t value_size>
+	uint32_t expire(flat_map<key_size, value_size>& m, uint64_t thresh, size_t max) {
+		std::vector<K<key_size>> keys;
+		m.expiry.pop(thresh, max, keys);
+		uint32_t erased = 0;
+		for (auto& key : keys) {
+			auto s = m.find(key);
+			if (s) {
+				uint64_t ts;
+				memcpy(&ts, s->value.data(), sizeof(ts));
+				if (ts < thresh) {
+					m.erase(s);
+					erased++;
+				}
+			}
+		}
+		return erased;
+	}
+
+	template<size_t key_size, size_t value_size>
+	inline void expire_amortized(flat_map<key_size, value_size>& m, uint64_t timestamp) {
+		uint64_t ttl = m.expiry.ttl;
+		uint64_t newest = std::max(m.expiry.get_newest(), timestamp);
+		if (newest > ttl) {
+			expire(m, newest - ttl, AMORTIZED_EXPIRY);
+		}
+	}
+
+	template<size_t key_size, size_t value_size>
+	bool access_ts(flat_map<key_size, value_size>& m, typename flat_map<key_size, value_size>::accessor& a, const K<key_size>& key, uint64_t timestamp) {
+		uint64_t ttl = m.expiry.ttl;
+		if (ttl) {
+			expire_amortized(m, timestamp);
+		}
+		auto res = m.insert(key);
+		if (ttl) {
+			uint64_t previous;
+			memcpy(&previous, res.first->value.data(), sizeof(previous));
+			m.expiry.add(key, timestamp, !res.second, previous);
+		}
+		memcpy(res.first->value.data(), &timestamp, sizeof(timestamp));
+		a.s = res.first;
+		return res.second;
+	}
+
+	/*
+	 * The hashes of a batch are computed and their groups prefetched FLAT_BATCH_PREFETCH keys ahead.
+	 */
+	template<size_t key_size, size_t value_size>
+	uint32_t insert_batch(flat_map<key_size, value_size>& m, const uint8_t* keys, const uint8_t* values, uint32_t n) {
+		uint64_t hashes[FLAT_BATCH_PREFETCH];
+		uint64_t ttl = m.expiry.ttl;
+		uint32_t inserted = 0;
+		auto process = [&](uint32_t j) {
+			const K<key_size>& key = *reinterpret_cast<const K<key_size>*>(keys + j * key_size);
+			const uint8_t* value = values + j * value_size;
+			uint64_t ts = 0;
+			if (ttl) {
+				memcpy(&ts, value, sizeof(ts));
+				expire_amortized(m, ts);
+			}
+			auto res = m.insert(key, hashes[j % FLAT_BATCH_PREFETCH]);
+			if (ttl) {
+				uint64_t previous;
+				memcpy(&previous, res.first->value.data(), sizeof(previous));
+				m.expiry.add(key, ts, !res.second, previous);
+			}
+			memcpy(res.first->value.data(), value, value_size);
+			inserted += res.second;
+		};
+		for (uint32_t i = 0; i < n + FLAT_BATCH_PREFETCH; i++) {
+			// the slot of the hash of key j is reused for key i afterwards
+			if (i >= FLAT_BATCH_PREFETCH) {
+				process(i - FLAT_BATCH_PREFETCH);
+			}
+			if (i < n) {
+				const K<key_size>& key = *reinterpret_cast<const K<key_size>*>(keys + i * key_size);
+				hashes[i % FLAT_BATCH_PREFETCH] = m.hash_of(key);
+				m.prefetch(hashes[i % FLAT_BATCH_PREFETCH]);
+			}
+		}
+		return inserted;
+	}
+
+	template<size_t key_size, size_t value_size>
+	uint32_t find_batch(flat_map<key_size, value_size>& m, const uint8_t* keys, uint8_t* values, uint8_t* found, uint32_t n, bool erase) {
+		uint64_t hashes[FLAT_BATCH_PREFETCH];
+		uint32_t hits = 0;
+		auto process = [&](uint32_t j) {
+			const K<key_size>& key = *reinterpret_cast<const K<key_size>*>(keys + j * key_size);
+			auto s = m.find(key, hashes[j % FLAT_BATCH_PREFETCH]);
+			if (!s) {
+				found[j] = 0;
+				return;
+			}
+			memcpy(values + j * value_size, s->value.data(), value_size);
+			if (erase) {
+				m.erase(s);
+			}
+			found[j] = 1;
+			hits++;
+		};
+		for (uint32_t i = 0; i < n + FLAT_BATCH_PREFETCH; i++) {
+			// the slot of the hash of key j is reused for key i afterwards
+			if (i >= FLAT_BATCH_PREFETCH) {
+				process(i - FLAT_BATCH_PREFETCH);
+			}
+			if (i < n) {
+				const K<key_size>& key = *reinterpret_cast<const K<key_size>*>(keys + i * key_size);
+				hashes[i % FLAT_BATCH_PREFETCH] = m.hash_of(key);
+				m.prefetch(hashes[i % FLAT_BATCH_PREFETCH]);
+			}
+		}
+		return hits;
+	}
+
+	template<size_t key_size, size_t value_size>
+	uint32_t clean(flat_map<key_size, value_size>& m, uint64_t thresh) {
+		uint32_t erased = 0;
+		m.for_each([&](typename flat_map<key_size, value_size>::slot* s) {
+			uint64_t ts;
+			memcpy(&ts, s->value.data(), sizeof(ts));
+			if (ts < thresh) {
+				m.erase(s);
+				erased++;
+			}
+		});
+		return erased;
+	}
+}
+
+extern "C" {
+using namespace hash_map;
+
+#define FLAT_MAP_IMPL(key_size, value_size) \
+    using fmapk##key_size##v##value_size = hash_map::flat_map<key_size, value_size>; \
+    fmapk##key_size##v##value_size* fmapk##key_size##v##value_size##_create(uint8_t hash) { \
+        return new fmapk##key_size##v##value_size(hash); \
+    } \
+    void fmapk##key_size##v##value_size##_delete(fmapk##key_size##v##value_size* map) { \
+        delete map; \
+    } \
+    void fmapk##key_size##v##value_size##_clear(fmapk##key_size##v##value_size* map) { \
+        map->clear(); \
+    } \
+    size_t fmapk##key_size##v##value_size##_size(fmapk##key_size##v##value_size* map) { \
+        return map->size(); \
+    } \
+    size_t fmapk##key_size##v##value_size##_capacity(fmapk##key_size##v##value_size* map) { \
+        return map->capacity(); \
+    } \
+    void fmapk##key_size##v##value_size##_memory(fmapk##key_size##v##value_size* map, hmap_memory* out) { \
+        map->memory(out); \
+    } \
+    bool fmapk##key_size##v##value_size##_reserve(fmapk##key_size##v##value_size* map, size_t n) { \
+        try { \
+            map->reserve(n); \
+            return true; \
+        } catch (std::bad_alloc&) { \
+            std::cerr << "[hashmap] could not reserve " << n << " entries\n"; \
+            return false; \
+        } \
+    } \
+    fmapk##key_size##v##value_size::accessor* fmapk##key_size##v##value_size##_new_accessor() { \
+        return new fmapk##key_size##v##value_size::accessor; \
+    } \
+    void fmapk##key_size##v##value_size##_accessor_free(fmapk##key_size##v##value_size::accessor* a) { \
+        delete a; \
+    } \
+    void fmapk##key_size##v##value_size##_accessor_release(fmapk##key_size##v##value_size::accessor* a) { \
+        a->s = nullptr; \
+    } \
+    bool fmapk##key_size##v##value_size##_access(fmapk##key_size##v##value_size* map, fmapk##key_size##v##value_size::accessor* a, const void* key) { \
+        auto res = map->insert(*static_cast<const K<key_size>*>(key)); \
+        a->s = res.first; \
+        return res.second; \
+    } \
+    std::uint8_t* fmapk##key_size##v##value_size##_accessor_get_value(fmapk##key_size##v##value_size::accessor* a) { \
+        return a->s->value.data(); \
+    } \
+    bool fmapk##key_size##v##value_size##_erase(fmapk##key_size##v##value_size* map, fmapk##key_size##v##value_size::accessor* a) { \
+        if (!a->s) std::terminate(); \
+        map->erase(a->s); \
+        a->s = nullptr; \
+        return true; \
+    } \
+    bool fmapk##key_size##v##value_size##_find(fmapk##key_size##v##value_size* map, fmapk##key_size##v##value_size::accessor* a, const void* key) { \
+        a->s = map->find(*static_cast<const K<key_size>*>(key)); \
+        return a->s != nullptr; \
+    } \
+    uint32_t fmapk##key_size##v##value_size##_clean(fmapk##key_size##v##value_size* map, uint64_t thresh) { \
+        return clean(*map, thresh); \
+    } \
+    void fmapk##key_size##v##value_size##_set_ttl(fmapk##key_size##v##value_size* map, uint64_t ttl) { \
+        map->expiry.set_ttl(ttl); \
+    } \
+    bool fmapk##key_size##v##value_size##_access_ts(fmapk##key_size##v##value_size* map, fmapk##key_size##v##value_size::accessor* a, const void* key, uint64_t ts) { \
+        return access_ts(*map, *a, *static_cast<const K<key_size>*>(key), ts); \
+    } \
+    uint32_t fmapk##key_size##v##value_size##_expire(fmapk##key_size##v##value_size* map, uint64_t thresh) { \
+        return expire(*map, thresh, std::numeric_limits<size_t>::max()); \
+    } \
+    uint32_t fmapk##key_size##v##value_size##_insert_batch(fmapk##key_size##v##value_size* map, const void* keys, const void* values, uint32_t n) { \
+        return insert_batch(*map, static_cast<const uint8_t*>(keys), static_cast<const uint8_t*>(values), n); \
+    } \
+    uint32_t fmapk##key_size##v##value_size##_find_batch(fmapk##key_size##v##value_size* map, const void* keys, void* values, uint8_t* found, uint32_t n) { \
+        return find_batch(*map, static_cast<const uint8_t*>(keys), static_cast<uint8_t*>(values), found, n, false); \
+    } \
+    uint32_t fmapk##key_size##v##value_size##_find_erase_batch(fmapk##key_size##v##value_size* map, const void* keys, void* values, uint8_t* found, uint32_t n) { \
+        return find_batch(*map, static_cast<const uint8_t*>(keys), static_cast<uint8_t*>(values), found, n, true); \
+    }
+
+#define FLAT_MAP_VALUES(value_size) \
+    FLAT_MAP_IMPL(8, value_size) \
+    FLAT_MAP_IMPL(16, value_size) \
+    FLAT_MAP_IMPL(32, value_size) \
+    FLAT_MAP_IMPL(64, value_size)
+
+FLAT_MAP_VALUES(8)
+FLAT_MAP_VALUES(16)
+FLAT_MAP_VALUES(32)
+FLAT_MAP_VALUES(64)
+FLAT_MAP_VALUES(128)
+}
@@ -6,68 +6,213 @@
  * different digest sizes.
  */
 
-#include <array>
-#include <cstring>
+#include <limits>
+#include <memory>
 #include <tbb/concurrent_hash_map.h>
-#include <cstdint>
 #include <iostream>
-#include <c_bindings.h>
-#include <deque>
+
+#include "hashmap.hpp"
+#include "node-pool.hpp"
+
+// flags of hmapk*_create_sized()
+#define HMAP_NODE_POOL 1
+#define HMAP_HUGETLB 2
 
 namespace hash_map {
-	/* Secret hash cookie */
-	constexpr uint32_t secret = 0xF00BA;
-	constexpr uint64_t sip_secret[2] = {1, 2}; // 128 bit secret
+	template<size_t key_size, size_t value_size>
+	using tbb_map = tbb::concurrent_hash_map<K<key_size>, V<value_size>, var_sip_hash<K<key_size>>, pool_allocator<std::pair<const K<key_size>, V<value_size>>>>;
 
-	template<typename K, typename std::enable_if<std::is_pod<K>::value>::type * = nullptr>
-	struct var_sip_hash {
-		var_sip_hash() = default;
+	// the pool is a base to be created before and destroyed after the map
+	struct pool_holder {
+		std::unique_ptr<node_pool> pool;
+	};
 
-		var_sip_hash(const var_sip_hash &h) = default;
+	template<size_t key_size, size_t value_size>
+	struct map : pool_holder, tbb_map<key_size, value_size> {
+		// TBB nodes have a next pointer and a mutex before the entry
+		static constexpr size_t node_size = (2 * sizeof(void*) + key_size + value_size + 15) / 16 * 16;
 
-		inline bool equal(const K &j, const K &k) const noexcept {
-			return j == k;
-		}
+		expiry_index<key_size> expiry;
 
-		// Safety check
-		static_assert(sizeof(K) == K::size, "sizeof(K) != K::size");
+		map() = default;
 
-		/* Hash function to be used by TBB */
-		inline size_t hash(const K &k) const noexcept {
-			return SipHashC(sip_secret, reinterpret_cast<const char *>(k.data + 0), k.size);
+		/*
+		 * Map with buckets for expected entries and optionally a node pool holding them
+		 */
+		map(size_t expected, bool pooled, bool hugetlb)
+			: pool_holder{pooled ? std::unique_ptr<node_pool>(new node_pool(node_size, expected, hugetlb)) : nullptr},
+			  tbb_map<key_size, value_size>(expected, pool_allocator<std::pair<const K<key_size>, V<value_size>>>(pool.get())) {
 		}
 
+		/*
+		 * Without a pool the nodes are estimated to take node_size bytes each
+		 */
+		void memory(hmap_memory* out) const {
+			out->entries = this->size();
+			out->buckets = this->bucket_count();
+			out->load_factor = out->buckets ? (double) out->entries / out->buckets : 0;
+			// a bucket is a mutex and a pointer
+			out->bytes = out->buckets * 2 * sizeof(void*) + (pool ? pool->bytes() : out->entries * (size_t) node_size);
+		}
 	};
 
-	template<size_t key_size>
-	struct key_buf {
-		static constexpr size_t size = key_size;
-		uint8_t data[key_size];
-	} __attribute__((__packed__));
+	/*
+	 * Erase up to max entries whose timestamp in the value is before thresh, found through the expiry index.
+	 * The calling thread must not hold an accessor.
+	 */
+	template<size_t key_size, size_t value_size>
+	uint32_t expire(map<key_size, value_size>& m, uint64_t thresh, size_t max) {
+		std::vector<K<key_size>> keys;
+		m.expiry.pop(thresh, max, keys);
+		uint32_t erased = 0;
+		typename map<key_size, value_size>::accessor a;
+		for (auto& key : keys) {
+			if (m.find(a, key)) {
+				uint64_t ts;
+				memcpy(&ts, a->second.data(), sizeof(ts));
+				if (ts < thresh) {
+					m.erase(a);
+					erased++;
+				} else {
+					a.release();
+				}
+			}
+		}
+		return erased;
+	}
 
-	template<size_t key_size>
-	inline bool operator==(const key_buf<key_size> &lhs, const key_buf<key_size> &rhs) noexcept {
-		return std::memcmp(lhs.data, rhs.data, key_size) == 0;
+	/*
+	 * Insert or find the key and set the first 8 bytes of its value to the timestamp.
+	 * With a TTL, a few of the oldest entries are expired first.
+	 */
+	template<size_t key_size, size_t value_size>
+	bool access_ts(map<key_size, value_size>& m, typename map<key_size, value_size>::accessor& a, const K<key_size>& key, uint64_t timestamp) {
+		a.release();
+		uint64_t ttl = m.expiry.ttl;
+		if (ttl) {
+			uint64_t newest = std::max(m.expiry.get_newest(), timestamp);
+			if (newest > ttl) {
+				expire(m, newest - ttl, AMORTIZED_EXPIRY);
+			}
+		}
+		bool inserted = m.insert(a, key);
+		if (ttl) {
+			uint64_t previous;
+			memcpy(&previous, a->second.data(), sizeof(previous));
+			m.expiry.add(key, timestamp, !inserted, previous);
+		}
+		memcpy(a->second.data(), &timestamp, sizeof(timestamp));
+		return inserted;
+	}
+
+	/*
+	 * Insert or assign n keys and values from arrays of key_size and value_size bytes, returns the number of new keys.
+	 * With a TTL the first 8 bytes of the values are the timestamps for expiry, see access_ts().
+	 */
+	template<size_t key_size, size_t value_size>
+	uint32_t insert_batch(map<key_size, value_size>& m, const uint8_t* keys, const uint8_t* values, uint32_t n) {
+		typename map<key_size, value_size>::accessor a;
+		uint64_t ttl = m.expiry.ttl;
+		uint32_t inserted = 0;
+		for (uint32_t i = 0; i < n; i++) {
+			const K<key_size>& key = *reinterpret_cast<const K<key_size>*>(keys + i * key_size);
+			const uint8_t* value = values + i * value_size;
+			uint64_t ts = 0;
+			if (ttl) {
+				memcpy(&ts, value, sizeof(ts));
+				uint64_t newest = std::max(m.expiry.get_newest(), ts);
+				if (newest > ttl) {
+					expire(m, newest - ttl, AMORTIZED_EXPIRY);
+				}
+			}
+			bool found = !m.insert(a, key);
+			if (ttl) {
+				uint64_t previous;
+				memcpy(&previous, a->second.data(), sizeof(previous));
+				m.expiry.add(key, ts, found, previous);
+			}
+			memcpy(a->second.data(), value, value_size);
+			a.release();
+			inserted += !found;
+		}
+		return inserted;
+	}
+
+	/*
+	 * Look up n keys, copy the values of the found ones to values and set found[i] to 1, otherwise to 0.
+	 * Found entries are erased if erase is set. Returns the number of found keys.
+	 */
+	template<size_t key_size, size_t value_size>
+	uint32_t find_batch(map<key_size, value_size>& m, const uint8_t* keys, uint8_t* values, uint8_t* found, uint32_t n, bool erase) {
+		typename map<key_size, value_size>::accessor a;
+		uint32_t hits = 0;
+		for (uint32_t i = 0; i < n; i++) {
+			const K<key_size>& key = *reinterpret_cast<const K<key_size>*>(keys + i * key_size);
+			if (!m.find(a, key)) {
+				found[i] = 0;
+				continue;
+			}
+			memcpy(values + i * value_size, a->second.data(), value_size);
+			if (erase) {
+				m.erase(a);
+			} else {
+				a.release();
+			}
+			found[i] = 1;
+			hits++;
+		}
+		return hits;
 	}
 
-	template<size_t key_size> using K = key_buf<key_size>;
-	template<size_t value_size> using V = std::array<std::uint8_t, value_size>;
+	/*
+	 * Erase all entries with a timestamp (first 8 bytes of the value) before thresh by walking the whole map.
+	 */
+	template<size_t key_size, size_t value_size>
+	uint32_t clean(map<key_size, value_size>& m, uint64_t thresh) {
+		std::vector<K<key_size>> old;
+		for (auto it = m.begin(); it != m.end(); ++it) {
+			uint64_t ts;
+			memcpy(&ts, it->second.data(), sizeof(ts));
+			if (ts < thresh) {
+				old.push_back(it->first);
+			}
+		}
+		uint32_t erased = 0;
+		for (auto& key : old) {
+			erased += m.erase(key);
+		}
+		return erased;
+	}
 }
 
 extern "C" {
 using namespace hash_map;
 
 #define MAP_IMPL(key_size, value_size) \
-    template class tbb::concurrent_hash_map<K<key_size>, V<value_size>, var_sip_hash<K<key_size>>>; \
-    using hmapk##key_size##v##value_size = tbb::concurrent_hash_map<K<key_size>, V<value_size>, var_sip_hash<K<key_size>>>; \
+    template class tbb::concurrent_hash_map<K<key_size>, V<value_size>, var_sip_hash<K<key_size>>, pool_allocator<std::pair<const K<key_size>, V<value_size>>>>; \
+    using hmapk##key_size##v##value_size = hash_map::map<key_size, value_size>; \
     hmapk##key_size##v##value_size* hmapk##key_size##v##value_size##_create() { \
         return new hmapk##key_size##v##value_size; \
     } \
+    hmapk##key_size##v##value_size* hmapk##key_size##v##value_size##_create_sized(size_t expected, uint32_t flags) { \
+        try { \
+            return new hmapk##key_size##v##value_size(expected, flags & HMAP_NODE_POOL, flags & HMAP_HUGETLB); \
+        } catch (std::bad_alloc&) { \
+            return nullptr; \
+        } \
+    } \
+    void hmapk##key_size##v##value_size##_memory(hmapk##key_size##v##value_size* map, hmap_memory* out) { \
+        map->memory(out); \
+    } \
     void hmapk##key_size##v##value_size##_delete(hmapk##key_size##v##value_size* map) { \
         delete map; \
     } \
     void hmapk##key_size##v##value_size##_clear(hmapk##key_size##v##value_size* map) { \
         map->clear(); \
+        map->expiry.clear(); \
+    } \
+    size_t hmapk##key_size##v##value_size##_size(hmapk##key_size##v##value_size* map) { \
+        return map->size(); \
     } \
     hmapk##key_size##v##value_size::accessor* hmapk##key_size##v##value_size##_new_accessor() { \
         return new hmapk##key_size##v##value_size::accessor; \
@@ -93,21 +238,25 @@ using namespace hash_map;
         return map->find(*a, *static_cast<const K<key_size>*>(key)); \
     } \
     uint32_t hmapk##key_size##v##value_size##_clean(hmapk##key_size##v##value_size* map, uint64_t thresh) { \
-    int ctr = 0; \
-        std::deque<hash_map::key_buf<key_size>> deque; \
-        for (hmapk##key_size##v##value_size::iterator it = map->begin(); it != map->end();) { \
-            uint64_t ts = *reinterpret_cast<uint64_t *>( &(*it).second); \
-            if(ts  < thresh) { \
-                deque.push_front(it->first); \
-            } \
-            it++; \
-            for(auto it = deque.begin(); it != deque.end(); it++) { \
-                map->erase(*it); \
-        ++ctr; \
-            } \
-        } \
-        deque.clear(); \
-    return ctr; \
+        return clean(*map, thresh); \
+    } \
+    void hmapk##key_size##v##value_size##_set_ttl(hmapk##key_size##v##value_size* map, uint64_t ttl) { \
+        map->expiry.set_ttl(ttl); \
+    } \
+    bool hmapk##key_size##v##value_size##_access_ts(hmapk##key_size##v##value_size* map, hmapk##key_size##v##value_size::accessor* a, const void* key, uint64_t ts) { \
+        return access_ts(*map, *a, *static_cast<const K<key_size>*>(key), ts); \
+    } \
+    uint32_t hmapk##key_size##v##value_size##_expire(hmapk##key_size##v##value_size* map, uint64_t thresh) { \
+        return expire(*map, thresh, std::numeric_limits<size_t>::max()); \
+    } \
+    uint32_t hmapk##key_size##v##value_size##_insert_batch(hmapk##key_size##v##value_size* map, const void* keys, const void* values, uint32_t n) { \
+        return insert_batch(*map, static_cast<const uint8_t*>(keys), static_cast<const uint8_t*>(values), n); \
+    } \
+    uint32_t hmapk##key_size##v##value_size##_find_batch(hmapk##key_size##v##value_size* map, const void* keys, void* values, uint8_t* found, uint32_t n) { \
+        return find_batch(*map, static_cast<const uint8_t*>(keys), static_cast<uint8_t*>(values), found, n, false); \
+    } \
+    uint32_t hmapk##key_size##v##value_size##_find_erase_batch(hmapk##key_size##v##value_size* map, const void* keys, void* values, uint8_t* found, uint32_t n) { \
+        return find_batch(*map, static_cast<const uint8_t*>(keys), static_cast<uint8_t*>(values), found, n, true); \
     }
 
 #define MAP_VALUES(value_size) \
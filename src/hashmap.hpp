@@ -0,0 +1,166 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <tbb/spin_mutex.h>
+#include <c_bindings.h>
+
+/*
+ * Keys, values, hashing, and expiry shared by the hashmap backends (hashmap.cpp and flat-hashmap.cpp)
+ */
+
+// entries checked for expiry per insert with a TTL, more than one to catch up with bursts
+#define AMORTIZED_EXPIRY 4
+// generations per TTL
+#define EXPIRY_GENERATIONS 8
+
+/*
+ * Memory usage of a map, buckets are the slots of the flat maps
+ */
+struct hmap_memory {
+	uint64_t bytes;
+	uint64_t entries;
+	uint64_t buckets;
+	double load_factor;
+};
+
+namespace hash_map {
+	/* Secret hash cookie */
+	constexpr uint32_t secret = 0xF00BA;
+	constexpr uint64_t sip_secret[2] = {1, 2}; // 128 bit secret
+
+	template<typename K, typename std::enable_if<std::is_pod<K>::value>::type * = nullptr>
+	struct var_sip_hash {
+		var_sip_hash() = default;
+
+		var_sip_hash(const var_sip_hash &h) = default;
+
+		inline bool equal(const K &j, const K &k) const noexcept {
+			return j == k;
+		}
+
+		// Safety check
+		static_assert(sizeof(K) == K::size, "sizeof(K) != K::size");
+
+		/* Hash function to be used by TBB */
+		inline size_t hash(const K &k) const noexcept {
+			return SipHashC(sip_secret, reinterpret_cast<const char *>(k.data + 0), k.size);
+		}
+
+	};
+
+	template<size_t key_size>
+	struct key_buf {
+		static constexpr size_t size = key_size;
+		uint8_t data[key_size];
+	} __attribute__((__packed__));
+
+	template<size_t key_size>
+	inline bool operator==(const key_buf<key_size> &lhs, const key_buf<key_size> &rhs) noexcept {
+		return std::memcmp(lhs.data, rhs.data, key_size) == 0;
+	}
+
+	template<size_t key_size> using K = key_buf<key_size>;
+	template<size_t value_size> using V = std::array<std::uint8_t, value_size>;
+
+	/*
+	 * Keys of a map with a TTL in generations of ttl / EXPIRY_GENERATIONS by their insertion timestamps.
+	 * Expiring entries older than a threshold only visits the keys of the generations before it instead of the whole
+	 * map. Keys stay in their generation when they are erased or inserted again, the timestamp in the map tells
+	 * whether the entry is still old enough to be erased.
+	 * A key is only added again when it was not accessed during the newest generation before, so the index holds at
+	 * most one entry per key and generation.
+	 */
+	template<size_t key_size>
+	class expiry_index {
+	public:
+		// entries older than the newest timestamp minus ttl are expired on inserts, 0 disables it
+		uint64_t ttl = 0;
+
+		void set_ttl(uint64_t ttl) {
+			tbb::spin_mutex::scoped_lock lock(mutex);
+			this->ttl = ttl;
+			if (ttl) {
+				length = std::max<uint64_t>(ttl / EXPIRY_GENERATIONS, 1);
+			}
+		}
+
+		/*
+		 * Track a key accessed at timestamp, nothing is tracked without a TTL.
+		 * found: the key was already in the map with the timestamp previous
+		 */
+		void add(const K<key_size>& key, uint64_t timestamp, bool found, uint64_t previous) {
+			tbb::spin_mutex::scoped_lock lock(mutex);
+			if (!ttl) {
+				return;
+			}
+			newest = std::max(newest, timestamp);
+			if (!generations.empty()) {
+				generation& g = generations.back();
+				// the key is still in the newest generation from its previous access
+				if (found && previous >= g.start && previous < g.end && timestamp < g.end) {
+					return;
+				}
+				// late timestamps go to the newest generation and expire a bit later
+				if (timestamp < g.end) {
+					g.entries.push_back(key);
+					return;
+				}
+			}
+			// generations do not overlap if the TTL was changed in between
+			uint64_t start = timestamp - timestamp % length;
+			if (!generations.empty()) {
+				start = std::max(start, generations.back().end);
+			}
+			generations.push_back({start, start + length, 0, {key}});
+		}
+
+		/*
+		 * Move up to max keys of the generations which ended before thresh to out.
+		 */
+		void pop(uint64_t thresh, size_t max, std::vector<K<key_size>>& out) {
+			tbb::spin_mutex::scoped_lock lock(mutex);
+			while (max && !generations.empty() && generations.front().end <= thresh) {
+				generation& g = generations.front();
+				size_t n = std::min(max, g.entries.size() - g.pos);
+				out.insert(out.end(), g.entries.begin() + g.pos, g.entries.begin() + g.pos + n);
+				g.pos += n;
+				max -= n;
+				if (g.pos == g.entries.size()) {
+					generations.pop_front();
+				}
+			}
+		}
+
+		uint64_t get_newest() const {
+			return newest;
+		}
+
+		void clear() {
+			tbb::spin_mutex::scoped_lock lock(mutex);
+			generations.clear();
+			newest = 0;
+		}
+
+	private:
+		struct generation {
+			// timestamps in [start, end)
+			uint64_t start;
+			uint64_t end;
+			// entries before were already expired
+			size_t pos;
+			std::vector<K<key_size>> entries;
+		};
+
+		tbb::spin_mutex mutex;
+		// set from the TTL, keys are only tracked with a TTL
+		uint64_t length = 1;
+		uint64_t newest = 0;
+		std::deque<generation> generations;
+	};
+}
@@ -1,109 +1,19 @@
-#include <cstdint>
-#include <map>
-#include <iostream>
-#include <fstream>
-
-// Algorithm based on: https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Online_algorithm
-
-class Histogram {
-private:
-	uint64_t count = 0;
-	double m2 = 0;
-	double mean = 0;
-	double variance = 0;
-	int64_t bucket_size;
-	int64_t bucket_half;
-	std::map<int64_t, uint32_t> storage;
-
-public:
-	uint64_t getCount() const {
-		return count;
-	}
-
-	double getMean() const {
-		return mean;
-	}
-
-	double getVariance() const {
-		return variance;
-	}
-
-	bool update(int64_t new_val) {
-		bool ret = true;
-		if (new_val < 0){
-			ret = false;
-		}
-		++count;
-		double delta = new_val - mean;
-		mean = mean + delta / count;
-		double delta2 = new_val - mean;
-		m2 = m2 + delta * delta2;
-
-		// compute the bucket to put this value in
-		if(new_val > 0){
-			new_val += bucket_half;
-		}
-		else if(new_val < 0){
-			new_val -= bucket_half;
-		}
-
-		new_val = (new_val / bucket_size) * bucket_size;
-		// if not already in map, it should be inserted and zero initialized
-		++storage[new_val];
-
-		return ret;
-	}
-
-	void finalize() {
-		if (count < 2) {
-			std::cerr << "Not enough members to calculate mean and variance\n";
-		} else {
-			variance = m2 / (count - 1);
-		}
-	}
-
-	void write_to_file(const char *filename) {
-		std::ofstream file;
-		file.open(filename);
-		if (file.fail()) {
-			std::cerr << "Failed to open file < " << filename << " >\n";
-			exit(EXIT_FAILURE);
-		}
+#include <cstdio>
+#include <memory>
 
-		auto it = storage.begin();
-		while (it != storage.end()) {
-			file << it->first << "," << it->second << "\n";
-			++it;
-		}
-		file.close();
-	}
-
-	// If bucket_size is even the bucket for 0 will be slightly smaller then the rest,
-	// also the bucket value will not represent exactly the median of the bucket
-	Histogram(uint32_t bucket_size){
-		if (bucket_size <= 0){
-			std::cerr << "Invalid bucket size\n";
-			exit(EXIT_FAILURE);
-		}
-
-		// to avoid casting all the time during the bucket computation
-		// we directly store values as signed
-		this->bucket_size = (int64_t) bucket_size;
-		bucket_half = this->bucket_size/2;
-	}
-
-	virtual ~Histogram() = default;
-};
+#include "histogram.hpp"
 
 Histogram *hist;
 
 extern "C" {
+//-------------- Legacy API, a single global histogram --------------
 void hs_initialize(uint32_t bucket_size) {
 	hist = new Histogram(bucket_size);
 }
 
 void hs_destroy() {
 	delete (hist);
+	hist = nullptr;
 }
 
 bool hs_update(int64_t new_val) {
@@ -115,7 +25,9 @@ void hs_finalize(){
 }
 
 void hs_write(const char* filename){
-	hist->write_to_file(filename);
+	if (!hist->write_to_file(filename)) {
+		exit(EXIT_FAILURE);
+	}
 }
 
 uint64_t hs_getCount() {
@@ -130,5 +42,123 @@ double hs_getVariance() {
 	return hist->getVariance();
 }
 
+//-------------- Handle API, one histogram per thread, merged at the end --------------
+Histogram* hs_create(uint32_t bucket_size) {
+	return new Histogram(bucket_size);
+}
+
+void hs_free(Histogram* h) {
+	delete h;
+}
+
+/**
+ * The global histogram of the legacy API, e.g. to merge into it. NULL if it is not initialized.
+ */
+Histogram* hs_global() {
+	return hist;
+}
+
+bool hs_record(Histogram* h, int64_t value) {
+	return h->update(value);
+}
+
+/**
+ * Record several values at once, saves FFI calls
+ */
+void hs_record_batch(Histogram* h, const int64_t* values, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		h->update(values[i]);
+	}
+}
+
+bool hs_merge(Histogram* dst, const Histogram* src) {
+	return dst->merge(*src);
+}
+
+void hs_reset(Histogram* h) {
+	h->reset();
+}
+
+uint64_t hs_count(const Histogram* h) {
+	return h->getCount();
+}
+
+double hs_mean(const Histogram* h) {
+	return h->getMean();
+}
+
+double hs_variance(const Histogram* h) {
+	return h->getVariance();
+}
+
+int64_t hs_min(const Histogram* h) {
+	return h->getMin();
+}
+
+int64_t hs_max(const Histogram* h) {
+	return h->getMax();
+}
+
+int64_t hs_percentile(const Histogram* h, double q) {
+	return h->percentile(q);
+}
+
+bool hs_write_csv(const Histogram* h, const char* filename) {
+	return h->write_to_file(filename);
+}
+
+size_t hs_serialized_size(const Histogram* h) {
+	return h->serialized_size();
+}
+
+void hs_serialize(const Histogram* h, uint8_t* buf) {
+	h->serialize(buf);
 }
 
+/**
+ * Returns NULL if the data is not a serialized histogram.
+ */
+Histogram* hs_deserialize(const uint8_t* buf, size_t len) {
+	return Histogram::deserialize(buf, len);
+}
+
+bool hs_save(const Histogram* h, const char* filename) {
+	std::unique_ptr<uint8_t[]> buf(new uint8_t[h->serialized_size()]);
+	h->serialize(buf.get());
+	FILE* file = fopen(filename, "wb");
+	if (!file) {
+		std::cerr << "Failed to open file < " << filename << " >\n";
+		return false;
+	}
+	bool ok = fwrite(buf.get(), h->serialized_size(), 1, file) == 1;
+	ok = fclose(file) == 0 && ok;
+	return ok;
+}
+
+/**
+ * Returns NULL if the file cannot be read or has an invalid format.
+ */
+Histogram* hs_load(const char* filename) {
+	FILE* file = fopen(filename, "rb");
+	if (!file) {
+		std::cerr << "Failed to open file < " << filename << " >\n";
+		return nullptr;
+	}
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	Histogram* h = nullptr;
+	if (len > 0) {
+		std::unique_ptr<uint8_t[]> buf(new uint8_t[len]);
+		if (fread(buf.get(), len, 1, file) == 1) {
+			h = Histogram::deserialize(buf.get(), len);
+		}
+	}
+	fclose(file);
+	if (!h) {
+		std::cerr << "Invalid histogram file < " << filename << " >\n";
+	}
+	return h;
+}
+
+}
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <iostream>
+#include <fstream>
+
+// Algorithm based on: https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Online_algorithm
+
+/*
+ * Histogram of values rounded to multiples of bucket_size.
+ * Buckets up to 2^20 * bucket_size are stored exactly in flat arrays which grow with the largest value seen,
+ * larger values fall into log-linear buckets with 1024 buckets per power of two (relative error < 0.1%).
+ * Updates are O(1) and counts are 64 bit. Instances are not thread-safe, use one per thread and merge them.
+ */
+class Histogram {
+public:
+	static constexpr uint32_t linear_bits = 20;
+	static constexpr uint64_t linear_max = 1ULL << linear_bits;
+	static constexpr uint32_t log_sub_bits = 10;
+	static constexpr uint32_t log_sub_count = 1 << log_sub_bits;
+	static constexpr uint32_t log_buckets = (64 - linear_bits) * log_sub_count;
+
+	/*
+	 * Binary format written by serialize(), followed by num_buckets entries.
+	 * Keys are bucket indices in units of bucket_size (negative for negative values), log-linear buckets are
+	 * represented by their lower bound.
+	 */
+	struct file_header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t bucket_size;
+		uint64_t count;
+		double mean;
+		double m2;
+		int64_t min;
+		int64_t max;
+		uint64_t num_buckets;
+	};
+
+	struct file_entry {
+		int64_t key;
+		uint64_t count;
+	};
+
+	// "MSHIST" followed by two zero bytes
+	static constexpr uint64_t file_magic = 0x000054534948534DULL;
+	static constexpr uint32_t file_version = 1;
+
+	// If bucket_size is even the bucket for 0 will be slightly smaller then the rest,
+	// also the bucket value will not represent exactly the median of the bucket
+	Histogram(uint32_t bucket_size) {
+		if (bucket_size <= 0) {
+			std::cerr << "Invalid bucket size\n";
+			exit(EXIT_FAILURE);
+		}
+
+		// to avoid casting all the time during the bucket computation
+		// we directly store values as signed
+		this->bucket_size = (int64_t) bucket_size;
+		bucket_half = this->bucket_size / 2;
+	}
+
+	virtual ~Histogram() = default;
+
+	uint64_t getCount() const {
+		return count;
+	}
+
+	double getMean() const {
+		return mean;
+	}
+
+	double getVariance() const {
+		return count < 2 ? 0 : m2 / (count - 1);
+	}
+
+	int64_t getMin() const {
+		return count ? min : 0;
+	}
+
+	int64_t getMax() const {
+		return count ? max : 0;
+	}
+
+	uint32_t get_bucket_size() const {
+		return bucket_size;
+	}
+
+	/*
+	 * Returns false for negative values, they are recorded nevertheless.
+	 */
+	inline bool update(int64_t new_val) {
+		++count;
+		double delta = new_val - mean;
+		mean = mean + delta / count;
+		double delta2 = new_val - mean;
+		m2 = m2 + delta * delta2;
+		if (new_val < min) {
+			min = new_val;
+		}
+		if (new_val > max) {
+			max = new_val;
+		}
+		add_key(key_of(new_val), 1);
+		return new_val >= 0;
+	}
+
+	/*
+	 * Add the values of another histogram with the same bucket size, e.g. of another thread.
+	 * Means and variances are combined with the parallel algorithm of Chan et al.
+	 */
+	bool merge(const Histogram& other) {
+		if (other.bucket_size != bucket_size) {
+			std::cerr << "Cannot merge histograms with different bucket sizes\n";
+			return false;
+		}
+		if (other.count == 0) {
+			return true;
+		}
+		uint64_t total = count + other.count;
+		double delta = other.mean - mean;
+		mean += delta * other.count / total;
+		m2 += other.m2 + delta * delta * ((double) count * other.count / total);
+		count = total;
+		min = std::min(min, other.min);
+		max = std::max(max, other.max);
+		pos.merge(other.pos);
+		neg.merge(other.neg);
+		return true;
+	}
+
+	void reset() {
+		count = 0;
+		mean = 0;
+		m2 = 0;
+		min = std::numeric_limits<int64_t>::max();
+		max = std::numeric_limits<int64_t>::min();
+		pos = side();
+		neg = side();
+	}
+
+	/*
+	 * Value at quantile q (0..1): the value of the bucket, limited to the exact minimum and maximum.
+	 * Returns 0 for an empty histogram.
+	 */
+	int64_t percentile(double q) const {
+		if (count == 0) {
+			return 0;
+		}
+		uint64_t rank = q * count;
+		if (rank >= count) {
+			rank = count - 1;
+		}
+		uint64_t seen = 0;
+		int64_t result = max;
+		for_each([&](int64_t value, uint64_t n) {
+			seen += n;
+			if (seen > rank) {
+				result = value;
+				return false;
+			}
+			return true;
+		});
+		return std::min(std::max(result, min), max);
+	}
+
+	void finalize() {
+		if (count < 2) {
+			std::cerr << "Not enough members to calculate mean and variance\n";
+		}
+	}
+
+	/*
+	 * Write the non-empty buckets as CSV (value,count).
+	 */
+	bool write_to_file(const char* filename) const {
+		std::ofstream file;
+		file.open(filename);
+		if (file.fail()) {
+			std::cerr << "Failed to open file < " << filename << " >\n";
+			return false;
+		}
+		for_each([&](int64_t value, uint64_t n) {
+			file << value << "," << n << "\n";
+			return true;
+		});
+		file.close();
+		return true;
+	}
+
+	size_t serialized_size() const {
+		return sizeof(file_header) + num_buckets() * sizeof(file_entry);
+	}
+
+	/*
+	 * Write the binary format to buf which must hold serialized_size() bytes.
+	 */
+	void serialize(uint8_t* buf) const {
+		file_header hdr;
+		hdr.magic = file_magic;
+		hdr.version = file_version;
+		hdr.bucket_size = bucket_size;
+		hdr.count = count;
+		hdr.mean = mean;
+		hdr.m2 = m2;
+		hdr.min = min;
+		hdr.max = max;
+		hdr.num_buckets = num_buckets();
+		memcpy(buf, &hdr, sizeof(hdr));
+		file_entry* entries = reinterpret_cast<file_entry*>(buf + sizeof(hdr));
+		for_each_key([&](int64_t key, uint64_t n) {
+			file_entry e = {key, n};
+			memcpy(entries++, &e, sizeof(e));
+		});
+	}
+
+	/*
+	 * Read the binary format, returns nullptr if the data is invalid.
+	 */
+	static Histogram* deserialize(const uint8_t* buf, size_t len) {
+		file_header hdr;
+		if (len < sizeof(hdr)) {
+			return nullptr;
+		}
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.magic != file_magic || hdr.version != file_version || hdr.bucket_size == 0
+		|| (len - sizeof(hdr)) / sizeof(file_entry) < hdr.num_buckets) {
+			return nullptr;
+		}
+		Histogram* h = new Histogram(hdr.bucket_size);
+		h->count = hdr.count;
+		h->mean = hdr.mean;
+		h->m2 = hdr.m2;
+		h->min = hdr.min;
+		h->max = hdr.max;
+		const uint8_t* p = buf + sizeof(hdr);
+		for (uint64_t i = 0; i < hdr.num_buckets; i++) {
+			file_entry e;
+			memcpy(&e, p, sizeof(e));
+			p += sizeof(e);
+			h->add_key(e.key, e.count);
+		}
+		return h;
+	}
+
+private:
+	/*
+	 * Buckets of the positive or negative values by magnitude of the key
+	 */
+	struct side {
+		std::vector<uint64_t> linear;
+		std::vector<uint64_t> log;
+
+		inline void add(uint64_t key, uint64_t n) {
+			if (key < linear_max) {
+				if (key >= linear.size()) {
+					grow(key);
+				}
+				linear[key] += n;
+			} else {
+				if (log.empty()) {
+					log.resize(log_buckets);
+				}
+				log[log_index(key)] += n;
+			}
+		}
+
+		void grow(uint64_t key) {
+			size_t size = std::max<size_t>(linear.size() * 2, 1024);
+			while (size <= key) {
+				size *= 2;
+			}
+			linear.resize(std::min(size, (size_t) linear_max));
+		}
+
+		void merge(const side& other) {
+			if (other.linear.size() > linear.size()) {
+				linear.resize(other.linear.size());
+			}
+			for (size_t i = 0; i < other.linear.size(); i++) {
+				linear[i] += other.linear[i];
+			}
+			if (!other.log.empty()) {
+				if (log.empty()) {
+					log.resize(log_buckets);
+				}
+				for (size_t i = 0; i < log_buckets; i++) {
+					log[i] += other.log[i];
+				}
+			}
+		}
+	};
+
+	uint64_t count = 0;
+	double m2 = 0;
+	double mean = 0;
+	int64_t min = std::numeric_limits<int64_t>::max();
+	int64_t max = std::numeric_limits<int64_t>::min();
+	int64_t bucket_size;
+	int64_t bucket_half;
+	// keys >= 0
+	side pos;
+	// magnitudes of keys < 0
+	side neg;
+
+	static inline uint32_t log_index(uint64_t key) {
+		uint32_t msb = 63 - __builtin_clzll(key);
+		return (msb - linear_bits) * log_sub_count + (uint32_t) (key >> (msb - log_sub_bits)) - log_sub_count;
+	}
+
+	static inline uint64_t log_lower(uint32_t idx) {
+		uint32_t shift = idx / log_sub_count + linear_bits - log_sub_bits;
+		return (uint64_t) (idx % log_sub_count + log_sub_count) << shift;
+	}
+
+	static inline uint64_t log_width(uint32_t idx) {
+		return 1ULL << (idx / log_sub_count + linear_bits - log_sub_bits);
+	}
+
+	// bucket index in units of bucket_size, rounded to the nearest bucket
+	inline int64_t key_of(int64_t val) const {
+		if (val > 0) {
+			val += bucket_half;
+		} else if (val < 0) {
+			val -= bucket_half;
+		}
+		return val / bucket_size;
+	}
+
+	inline void add_key(int64_t key, uint64_t n) {
+		if (key >= 0) {
+			pos.add(key, n);
+		} else {
+			neg.add(-(uint64_t) key, n);
+		}
+	}
+
+	size_t num_buckets() const {
+		size_t n = 0;
+		for_each_key([&](int64_t, uint64_t) {
+			n++;
+		});
+		return n;
+	}
+
+	/*
+	 * Call fn(key, count) for all non-empty buckets in ascending order.
+	 */
+	template<typename Fn>
+	void for_each_key(Fn fn) const {
+		for (size_t i = neg.log.size(); i-- > 0;) {
+			if (neg.log[i]) {
+				fn(-(int64_t) log_lower(i), neg.log[i]);
+			}
+		}
+		for (size_t i = neg.linear.size(); i-- > 1;) {
+			if (neg.linear[i]) {
+				fn(-(int64_t) i, neg.linear[i]);
+			}
+		}
+		for (size_t i = 0; i < pos.linear.size(); i++) {
+			if (pos.linear[i]) {
+				fn((int64_t) i, pos.linear[i]);
+			}
+		}
+		for (size_t i = 0; i < pos.log.size(); i++) {
+			if (pos.log[i]) {
+				fn((int64_t) log_lower(i), pos.log[i]);
+			}
+		}
+	}
+
+	/*
+	 * Call fn(value, count) for all non-empty buckets in ascending order until it returns false.
+	 * The value of a log-linear bucket is its midpoint.
+	 */
+	template<typename Fn>
+	void for_each(Fn fn) const {
+		bool go = true;
+		for_each_key([&](int64_t key, uint64_t n) {
+			if (!go) {
+				return;
+			}
+			uint64_t magnitude = key < 0 ? -(uint64_t) key : key;
+			int64_t value = key;
+			if (magnitude >= linear_max) {
+				uint64_t mid = magnitude + log_width(log_index(magnitude)) / 2;
+				value = key < 0 ? -(int64_t) mid : (int64_t) mid;
+			}
+			go = fn(value * bucket_size, n);
+		});
+	}
+};
+
+// the histogram of the legacy hs_* API
+extern Histogram *hist;
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <rte_mbuf.h>
+
+/*
+ * Extracts the keys used to match pre-DUT and post-DUT packets in MoonSniff.
+ * A key is described declaratively by up to MS_KEY_MAX_FIELDS fields, each a big-endian value of up to 8 bytes at an
+ * offset relative to a protocol header and an optional mask. See lua/moonsniff-key.lua for the textual syntax.
+ * Specs are compiled once into a plan which only parses as many headers as the fields need.
+ *
+ * Keys are the concatenation of the field bytes in packet order (at most 16 bytes) or a 64 bit hash of all fields.
+ * For the 64 bit and 32 bit identifications used by the live mode and mscap files the concatenation must fit into 8
+ * bytes, otherwise the hash is used. A single 4 byte field without mask yields the same identification as reading a
+ * uint32_t at that offset.
+ */
+
+#define MS_KEY_MAX_FIELDS 8
+#define MS_KEY_SIZE 16
+
+extern "C" {
+	enum ms_key_base {
+		// start of the packet
+		MS_KEY_BASE_PACKET = 0,
+		// IPv4/IPv6 header, VLAN tags are skipped
+		MS_KEY_BASE_L3 = 1,
+		// TCP/UDP header, IPv6 extension headers are not supported
+		MS_KEY_BASE_L4 = 2,
+		// TCP/UDP payload
+		MS_KEY_BASE_PAYLOAD = 3,
+	};
+
+	struct ms_key_field {
+		uint8_t base;
+		// 1 to 8 bytes
+		uint8_t length;
+		uint16_t offset;
+		uint32_t reserved;
+		// applied to the big-endian value of the field, 0 means no mask
+		uint64_t mask;
+	};
+
+	struct ms_key_spec {
+		uint32_t num_fields;
+		// always hash the fields, even if they fit into the key
+		uint32_t hash;
+		struct ms_key_field fields[MS_KEY_MAX_FIELDS];
+	};
+}
+
+namespace moonsniff {
+	class key_plan {
+	public:
+		/*
+		 * Returns nullptr if the spec is invalid.
+		 */
+		static key_plan* compile(const ms_key_spec* spec) {
+			if (spec->num_fields == 0 || spec->num_fields > MS_KEY_MAX_FIELDS) {
+				return nullptr;
+			}
+			key_plan* plan = new key_plan();
+			uint32_t bytes = 0;
+			for (uint32_t i = 0; i < spec->num_fields; i++) {
+				const ms_key_field& f = spec->fields[i];
+				if (f.length == 0 || f.length > 8 || f.base > MS_KEY_BASE_PAYLOAD) {
+					delete plan;
+					return nullptr;
+				}
+				plan->fields[i] = f;
+				plan->level = std::max<uint32_t>(plan->level, f.base);
+				bytes += f.length;
+			}
+			plan->num_fields = spec->num_fields;
+			plan->bytes = bytes;
+			plan->hashed = spec->hash || bytes > MS_KEY_SIZE;
+			// the 64 bit identification is the concatenation if it fits, the hash otherwise
+			plan->hashed64 = plan->hashed || bytes > 8;
+			plan->extract_fn = select(plan->level, plan->hashed);
+			plan->extract64_fn = select(plan->level, plan->hashed64);
+			return plan;
+		}
+
+		/*
+		 * Write the MS_KEY_SIZE byte key, unused bytes are zeroed.
+		 * Returns false and an all-zero key if the packet is too short or does not contain the required headers.
+		 */
+		inline bool extract(const rte_mbuf* pkt, uint8_t* key) const {
+			return extract(rte_pktmbuf_mtod(pkt, const uint8_t*), rte_pktmbuf_data_len(pkt), key);
+		}
+
+		inline bool extract64(const rte_mbuf* pkt, uint64_t* id) const {
+			return extract64(rte_pktmbuf_mtod(pkt, const uint8_t*), rte_pktmbuf_data_len(pkt), id);
+		}
+
+		/*
+		 * Same as above for packets which are not in an mbuf, e.g. read from a pcap file
+		 */
+		inline bool extract(const uint8_t* data, uint32_t len, uint8_t* key) const {
+			return extract_fn(this, data, len, key);
+		}
+
+		inline bool extract64(const uint8_t* data, uint32_t len, uint64_t* id) const {
+			uint8_t key[MS_KEY_SIZE];
+			if (!extract64_fn(this, data, len, key)) {
+				return false;
+			}
+			memcpy(id, key, sizeof(*id));
+			return true;
+		}
+
+		/*
+		 * Number of significant bits of the 64 bit identification
+		 */
+		uint32_t id_bits() const {
+			return hashed64 ? 64 : bytes * 8;
+		}
+
+	private:
+		typedef bool (*extract_t)(const key_plan*, const uint8_t*, uint32_t, uint8_t*);
+
+		ms_key_field fields[MS_KEY_MAX_FIELDS] = {};
+		uint32_t num_fields = 0;
+		uint32_t bytes = 0;
+		uint32_t level = MS_KEY_BASE_PACKET;
+		bool hashed = false;
+		bool hashed64 = false;
+		extract_t extract_fn = nullptr;
+		extract_t extract64_fn = nullptr;
+
+		static inline uint16_t read16(const uint8_t* p) {
+			return (uint16_t) (p[0] << 8 | p[1]);
+		}
+
+		/*
+		 * Offsets of the headers relative to the packet start, only the headers up to the given level are parsed.
+		 */
+		template<uint32_t Level>
+		static inline bool parse(const uint8_t* data, uint32_t len, uint32_t* bases) {
+			bases[MS_KEY_BASE_PACKET] = 0;
+			if (Level < MS_KEY_BASE_L3) {
+				return true;
+			}
+			uint32_t off = 12;
+			if (len < off + 2) {
+				return false;
+			}
+			uint16_t ether_type = read16(data + off);
+			// up to two VLAN tags (QinQ)
+			for (int i = 0; i < 2 && (ether_type == 0x8100 || ether_type == 0x88A8); i++) {
+				off += 4;
+				if (len < off + 2) {
+					return false;
+				}
+				ether_type = read16(data + off);
+			}
+			off += 2;
+			bases[MS_KEY_BASE_L3] = off;
+			if (Level < MS_KEY_BASE_L4) {
+				return true;
+			}
+			uint8_t proto;
+			if (ether_type == 0x0800) {
+				if (len < off + 20) {
+					return false;
+				}
+				proto = data[off + 9];
+				off += (data[off] & 0x0F) * 4;
+			} else if (ether_type == 0x86DD) {
+				if (len < off + 40) {
+					return false;
+				}
+				proto = data[off + 6];
+				off += 40;
+			} else {
+				return false;
+			}
+			bases[MS_KEY_BASE_L4] = off;
+			if (Level < MS_KEY_BASE_PAYLOAD) {
+				return true;
+			}
+			if (proto == 17) {
+				off += 8;
+			} else if (proto == 6) {
+				if (len < off + 13) {
+					return false;
+				}
+				off += (data[off + 12] >> 4) * 4;
+			} else {
+				return false;
+			}
+			bases[MS_KEY_BASE_PAYLOAD] = off;
+			return true;
+		}
+
+		static inline uint64_t mix(uint64_t h, uint64_t v) {
+			h = (h ^ v) * 0x9E3779B97F4A7C15ULL;
+			return h ^ (h >> 29);
+		}
+
+		// MurmurHash3 finalizer
+		static inline uint64_t fmix(uint64_t h) {
+			h ^= h >> 33;
+			h *= 0xFF51AFD7ED558CCDULL;
+			h ^= h >> 33;
+			h *= 0xC4CEB9FE1A85EC53ULL;
+			return h ^ (h >> 33);
+		}
+
+		template<uint32_t Level, bool Hash>
+		static bool extract_impl(const key_plan* plan, const uint8_t* data, uint32_t len, uint8_t* key) {
+			uint32_t bases[MS_KEY_BASE_PAYLOAD + 1];
+			memset(key, 0, MS_KEY_SIZE);
+			if (!parse<Level>(data, len, bases)) {
+				return false;
+			}
+			uint64_t h = 0;
+			uint32_t pos = 0;
+			for (uint32_t i = 0; i < plan->num_fields; i++) {
+				const ms_key_field& f = plan->fields[i];
+				uint32_t off = bases[f.base] + f.offset;
+				if (off + f.length > len) {
+					memset(key, 0, MS_KEY_SIZE);
+					return false;
+				}
+				if (Hash || f.mask) {
+					// big-endian value of the field
+					uint64_t v = 0;
+					for (uint32_t b = 0; b < f.length; b++) {
+						v = v << 8 | data[off + b];
+					}
+					if (f.mask) {
+						v &= f.mask;
+					}
+					if (Hash) {
+						h = mix(h, v);
+						continue;
+					}
+					for (uint32_t b = 0; b < f.length; b++) {
+						key[pos++] = (uint8_t) (v >> (8 * (f.length - 1 - b)));
+					}
+				} else {
+					memcpy(key + pos, data + off, f.length);
+					pos += f.length;
+				}
+			}
+			if (Hash) {
+				h = fmix(h);
+				memcpy(key, &h, sizeof(h));
+			}
+			return true;
+		}
+
+		template<bool Hash>
+		static extract_t select_level(uint32_t level) {
+			switch (level) {
+			case MS_KEY_BASE_PACKET:
+				return &extract_impl<MS_KEY_BASE_PACKET, Hash>;
+			case MS_KEY_BASE_L3:
+				return &extract_impl<MS_KEY_BASE_L3, Hash>;
+			case MS_KEY_BASE_L4:
+				return &extract_impl<MS_KEY_BASE_L4, Hash>;
+			default:
+				return &extract_impl<MS_KEY_BASE_PAYLOAD, Hash>;
+			}
+		}
+
+		static extract_t select(uint32_t level, bool hash) {
+			return hash ? select_level<true>(level) : select_level<false>(level);
+		}
+	};
+}
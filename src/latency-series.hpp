@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+
+/*
+ * Latency statistics per time window, keyed by the pre-DUT timestamp.
+ *
+ * Each matching thread collects into its own local part and submits a watermark: a pre-DUT timestamp below which it
+ * will not add anything anymore. Windows below the watermarks of all threads are complete, their statistics are
+ * written and their samples are freed, so the memory only depends on the windows in flight.
+ *
+ * File layout: one file_header followed by num_windows window_records in ascending order of start.
+ * Windows without pre-DUT and matched packets are omitted.
+ */
+namespace moonsniff {
+	class latency_series {
+	public:
+		struct file_header {
+			uint64_t magic;
+			uint32_t version;
+			uint32_t reserved;
+			// window length in nanoseconds
+			uint64_t window;
+			uint64_t num_windows;
+		};
+
+		struct window_record {
+			// pre-DUT timestamp of the beginning of the window
+			uint64_t start;
+			// number of valid latencies
+			uint32_t count;
+			// pre-DUT packets without a post-DUT packet
+			uint32_t misses;
+			int64_t min;
+			int64_t p50;
+			int64_t p99;
+			int64_t max;
+		};
+
+		// "MSSERIES"
+		static constexpr uint64_t file_magic = 0x5345495245535344ULL;
+		static constexpr uint32_t file_version = 1;
+
+		struct fragment {
+			uint64_t pre = 0;
+			uint64_t hits = 0;
+			std::vector<int64_t> values;
+		};
+
+		/*
+		 * Per-thread part, only used by its thread
+		 */
+		class local {
+		public:
+			local(uint64_t window) : window(window) {
+			}
+
+			inline void add_pre(uint64_t pre_ts) {
+				fragment* f = get(pre_ts);
+				if (f) {
+					f->pre++;
+				}
+			}
+
+			/*
+			 * A matched packet, invalid latencies count as hits but are not part of the statistics
+			 */
+			inline void add_hit(uint64_t pre_ts, int64_t latency, bool valid) {
+				fragment* f = get(pre_ts);
+				if (f) {
+					f->hits++;
+					if (valid) {
+						f->values.push_back(latency);
+					}
+				}
+			}
+
+			// packets of windows that were already submitted
+			uint64_t late = 0;
+
+		private:
+			friend class latency_series;
+
+			uint64_t window;
+			std::map<uint64_t, fragment> windows;
+			// windows below were submitted
+			uint64_t done_index = 0;
+			uint64_t last_index = std::numeric_limits<uint64_t>::max();
+			fragment* last = nullptr;
+
+			inline fragment* get(uint64_t ts) {
+				uint64_t index = ts / window;
+				if (index == last_index) {
+					return last;
+				}
+				if (index < done_index) {
+					late++;
+					return nullptr;
+				}
+				last_index = index;
+				last = &windows[index];
+				return last;
+			}
+		};
+
+		~latency_series() {
+			if (file.is_open()) {
+				close();
+			}
+		}
+
+		bool open(const char* filename, uint64_t window, size_t threads) {
+			if (window == 0) {
+				std::cerr << "[MoonSniff] invalid window length for the latency series\n";
+				return false;
+			}
+			file.open(filename, std::ios::binary | std::ios::trunc);
+			if (file.fail()) {
+				std::cerr << "[MoonSniff] could not open " << filename << "\n";
+				return false;
+			}
+			this->window = window;
+			write_header();
+			for (size_t i = 0; i < threads; i++) {
+				locals.emplace_back(new local(window));
+			}
+			watermarks.assign(threads, 0);
+			return true;
+		}
+
+		local& get_local(size_t thread) {
+			return *locals[thread];
+		}
+
+		/*
+		 * Hand the windows of a thread below the watermark over and write all windows that are complete.
+		 * May be called concurrently by the threads for their own part.
+		 */
+		void submit(size_t thread, uint64_t watermark) {
+			local& l = *locals[thread];
+			uint64_t done = watermark / window;
+			if (done <= l.done_index) {
+				return;
+			}
+			l.done_index = done;
+			if (l.last_index < done) {
+				l.last_index = std::numeric_limits<uint64_t>::max();
+				l.last = nullptr;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			auto end = l.windows.lower_bound(done);
+			for (auto it = l.windows.begin(); it != end; ++it) {
+				add(it->first, it->second);
+			}
+			l.windows.erase(l.windows.begin(), end);
+			watermarks[thread] = done;
+			write(*std::min_element(watermarks.begin(), watermarks.end()));
+		}
+
+		/*
+		 * Write all remaining windows, the threads must have finished.
+		 * Returns false if writing failed.
+		 */
+		bool close() {
+			for (auto& l : locals) {
+				for (auto& w : l->windows) {
+					add(w.first, w.second);
+				}
+				l->windows.clear();
+			}
+			write(std::numeric_limits<uint64_t>::max());
+			write_header();
+			file.close();
+			return !file.fail();
+		}
+
+		uint64_t get_late() const {
+			uint64_t late = 0;
+			for (auto& l : locals) {
+				late += l->late;
+			}
+			return late;
+		}
+
+	private:
+		std::ofstream file;
+		std::mutex mutex;
+		uint64_t window = 0;
+		uint64_t num_windows = 0;
+		std::vector<std::unique_ptr<local>> locals;
+		// done_index of each thread
+		std::vector<uint64_t> watermarks;
+		// windows of all threads that are not complete yet
+		std::map<uint64_t, fragment> pending;
+
+		void add(uint64_t index, fragment& f) {
+			fragment& p = pending[index];
+			p.pre += f.pre;
+			p.hits += f.hits;
+			if (p.values.empty()) {
+				p.values.swap(f.values);
+			} else {
+				p.values.insert(p.values.end(), f.values.begin(), f.values.end());
+			}
+		}
+
+		void write(uint64_t done) {
+			auto end = pending.lower_bound(done);
+			for (auto it = pending.begin(); it != end; ++it) {
+				fragment& f = it->second;
+				window_record r = {};
+				r.start = it->first * window;
+				r.count = f.values.size();
+				r.misses = f.pre > f.hits ? f.pre - f.hits : 0;
+				if (!f.values.empty()) {
+					// same ranks as Histogram::percentile()
+					auto& v = f.values;
+					std::nth_element(v.begin(), v.begin() + (size_t) (0.5 * v.size()), v.end());
+					r.p50 = v[(size_t) (0.5 * v.size())];
+					std::nth_element(v.begin(), v.begin() + (size_t) (0.99 * v.size()), v.end());
+					r.p99 = v[(size_t) (0.99 * v.size())];
+					auto mm = std::minmax_element(v.begin(), v.end());
+					r.min = *mm.first;
+					r.max = *mm.second;
+				}
+				file.write(reinterpret_cast<const char*>(&r), sizeof(r));
+				num_windows++;
+			}
+			pending.erase(pending.begin(), end);
+		}
+
+		void write_header() {
+			file_header hdr = {};
+			hdr.magic = file_magic;
+			hdr.version = file_version;
+			hdr.window = window;
+			hdr.num_windows = num_windows;
+			file.seekp(0);
+			file.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+			file.seekp(0, std::ios::end);
+		}
+	};
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+
+/*
+ * Fixed-memory log-linear histogram (HDR histogram style) for latency percentiles.
+ * Values below 2^sub_bits are counted exactly, larger values are split into power-of-two ranges which are each
+ * divided into 2^(sub_bits - 1) linear buckets, i.e. the relative error is below 2^-(sub_bits - 1) (< 1.6%).
+ * Histograms are merged by adding up the bucket counts, so each thread can record into its own histogram.
+ */
+namespace loghist {
+	constexpr uint32_t sub_bits = 7;
+	// largest value that is recorded accurately, 2^40 ns are more than 18 minutes
+	constexpr uint32_t max_bits = 40;
+	constexpr uint32_t sub_count = 1 << sub_bits;
+	constexpr uint32_t half_count = sub_count / 2;
+	constexpr uint32_t num_buckets = sub_count + (max_bits - sub_bits) * half_count;
+
+	inline uint32_t index(uint64_t value) {
+		if (value < sub_count) {
+			return value;
+		}
+		if (value >> max_bits) {
+			return num_buckets - 1;
+		}
+		uint32_t msb = 63 - __builtin_clzll(value);
+		uint32_t shift = msb - (sub_bits - 1);
+		return sub_count + (shift - 1) * half_count + (uint32_t) (value >> shift) - half_count;
+	}
+
+	// smallest value counted in a bucket
+	inline uint64_t lower(uint32_t idx) {
+		if (idx < sub_count) {
+			return idx;
+		}
+		uint32_t k = idx - sub_count;
+		uint32_t shift = k / half_count + 1;
+		return (uint64_t) (k % half_count + half_count) << shift;
+	}
+
+	// largest value counted in a bucket
+	inline uint64_t upper(uint32_t idx) {
+		if (idx < sub_count) {
+			return idx;
+		}
+		uint32_t shift = (idx - sub_count) / half_count + 1;
+		return lower(idx) + (1ULL << shift) - 1;
+	}
+
+	/*
+	 * Plain bucket counts, used for merged results and snapshots
+	 */
+	struct counts {
+		uint64_t buckets[num_buckets];
+		uint64_t total;
+
+		void clear() {
+			memset(buckets, 0, sizeof(buckets));
+			total = 0;
+		}
+
+		void add(const counts& other) {
+			for (uint32_t i = 0; i < num_buckets; i++) {
+				buckets[i] += other.buckets[i];
+			}
+			total += other.total;
+		}
+
+		// counts of other must not be larger, e.g. an earlier snapshot of the same histogram
+		void subtract(const counts& other) {
+			for (uint32_t i = 0; i < num_buckets; i++) {
+				buckets[i] -= other.buckets[i];
+			}
+			total -= other.total;
+		}
+
+		/*
+		 * Value at quantile q (0..1), reports the midpoint of the bucket
+		 * Returns 0 for an empty histogram.
+		 */
+		uint64_t quantile(double q) const {
+			if (total == 0) {
+				return 0;
+			}
+			uint64_t rank = q * total;
+			if (rank >= total) {
+				rank = total - 1;
+			}
+			uint64_t seen = 0;
+			for (uint32_t i = 0; i < num_buckets; i++) {
+				seen += buckets[i];
+				if (seen > rank) {
+					return lower(i) + (upper(i) - lower(i)) / 2;
+				}
+			}
+			return 0;
+		}
+
+		// upper bound of the largest non-empty bucket
+		uint64_t max() const {
+			for (uint32_t i = num_buckets; i-- > 0;) {
+				if (buckets[i]) {
+					return upper(i);
+				}
+			}
+			return 0;
+		}
+	};
+
+	/*
+	 * Histogram with a single writer that can be read by other threads at any time.
+	 */
+	class concurrent {
+	public:
+		inline void record(uint64_t value) {
+			std::atomic<uint64_t>& bucket = buckets[index(value)];
+			bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		// the copy is not atomic as a whole, total is read first so that it never exceeds the sum of the buckets
+		void read(counts& out) const {
+			out.total = total.load(std::memory_order_acquire);
+			for (uint32_t i = 0; i < num_buckets; i++) {
+				out.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+			}
+		}
+
+	private:
+		std::atomic<uint64_t> buckets[num_buckets] = {};
+		std::atomic<uint64_t> total{0};
+	};
+}
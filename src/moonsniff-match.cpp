@@ -0,0 +1,827 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <iostream>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mscap.hpp"
+#include "histogram.hpp"
+#include "key-extractor.hpp"
+#include "latency-series.hpp"
+
+// default number of identifier bits used to index the matching table, as in examples/moonsniff/arrmatch.lua
+#define DEFAULT_MATCH_ID_BITS 28
+#define MAX_MATCH_ID_BITS 32
+// records prefetched ahead in the matching table
+#define PREFETCH_DISTANCE 16
+
+/*
+ * Offline matching of pre-DUT and post-DUT mscap and pcap files.
+ *
+ * mscap:
+ * The pre-DUT records are inserted into a table indexed by the lower id_bits of the identification, the post-DUT
+ * records are looked up in it. Both files are processed in rounds of a quarter of the table size: while the post-DUT
+ * blocks starting in round r are matched, the table holds the pre-DUT records of rounds r - 1 to r + 1, so packets with
+ * sequential identifications never overwrite each other before their post-DUT packet was seen.
+ * Inserting and matching are split by block across threads. During matching the table is only written on hits.
+ */
+namespace moonsniff {
+	struct ms_match_config {
+		// 0: DEFAULT_MATCH_ID_BITS
+		uint32_t id_bits;
+		// 0: all cores
+		uint32_t threads;
+		// latencies below are counted as invalid
+		int64_t thresh;
+		// optional clock offsets of the post-DUT clock, see lua/moonsniff-drift.lua
+		uint32_t num_offsets;
+		const double* offset_times;
+		const double* offsets;
+		// optional per-window statistics, see latency-series.hpp
+		const char* series_file;
+		uint64_t series_window;
+	};
+
+	struct ms_match_stats {
+		uint64_t pre_pkts;
+		uint64_t post_pkts;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t overwrites;
+		uint64_t inval_ts;
+		// pcap only: unmatched pre-DUT packets
+		uint64_t expired;
+		// pcap only: packets without key or timestamp
+		uint64_t skipped;
+		// pre-DUT packets not in the latency series as their window was already written
+		uint64_t late;
+	};
+
+	/**
+	 * Pre-DUT record in the matching table, a timestamp of 0 marks an empty entry.
+	 * Inserts write entries as a whole with 128 bit compare-and-swap.
+	 */
+	union alignas(16) match_entry {
+		struct {
+			uint64_t timestamp;
+			uint64_t identification;
+		};
+		unsigned __int128 raw;
+	};
+	static_assert(sizeof(match_entry) == 16, "struct size mismatch");
+
+	/**
+	 * Piecewise-linear correction of post-DUT timestamps, same model as lua/moonsniff-drift.lua.
+	 * Each thread keeps its own segment hint, timestamps are mostly increasing.
+	 */
+	class drift_model {
+	public:
+		drift_model(uint32_t num_offsets, const double* offset_times, const double* offsets) {
+			if (num_offsets && offset_times && offsets) {
+				times.assign(offset_times, offset_times + num_offsets);
+				this->offsets.assign(offsets, offsets + num_offsets);
+			}
+		}
+
+		inline uint64_t apply(uint64_t timestamp, size_t& segment) const {
+			if (times.empty()) {
+				return timestamp;
+			}
+			return timestamp + (int64_t) (offset((double) timestamp, segment) + 0.5);
+		}
+
+	private:
+		std::vector<double> times;
+		std::vector<double> offsets;
+
+		double offset(double time, size_t& i) const {
+			size_t n = times.size();
+			if (n == 1) {
+				return offsets[0];
+			}
+			if (i + 1 >= n || time < times[i] || (i + 2 < n && time >= times[i + 1])) {
+				auto it = std::upper_bound(times.begin(), times.end() - 1, time);
+				i = it == times.begin() ? 0 : it - times.begin() - 1;
+			}
+			if (times[i + 1] == times[i]) {
+				return offsets[i];
+			}
+			return offsets[i] + (time - times[i]) * (offsets[i + 1] - offsets[i]) / (times[i + 1] - times[i]);
+		}
+	};
+
+	/**
+	 * Per-thread results, merged at the end
+	 */
+	struct match_worker {
+		Histogram hist;
+		ms_match_stats stats = {};
+		std::vector<mscap::record> buf;
+		size_t segment = 0;
+		latency_series::local* series = nullptr;
+
+		match_worker(uint32_t bucket_size) : hist(bucket_size) {
+		}
+	};
+
+	/**
+	 * Open the latency series if configured, returns false on errors.
+	 */
+	static bool open_series(std::unique_ptr<latency_series>& series, const char* filename, uint64_t window, size_t threads) {
+		if (!filename) {
+			return true;
+		}
+		series.reset(new latency_series());
+		return series->open(filename, window, threads);
+	}
+
+	static bool close_series(std::unique_ptr<latency_series>& series, ms_match_stats* out) {
+		if (!series) {
+			return true;
+		}
+		out->late = series->get_late();
+		if (!series->close()) {
+			std::cerr << "[MoonSniff] could not write the latency series\n";
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Run fn(worker, item) for items [begin, end) on all workers, items are handed out dynamically.
+	 */
+	template<typename Fn>
+	static void parallel_for(std::vector<std::unique_ptr<match_worker>>& workers, uint64_t begin, uint64_t end, Fn fn) {
+		std::atomic<uint64_t> next{begin};
+		std::vector<std::thread> threads;
+		for (auto& w : workers) {
+			match_worker* worker = w.get();
+			threads.emplace_back([&next, end, worker, &fn]() {
+				uint64_t i;
+				while ((i = next.fetch_add(1, std::memory_order_relaxed)) < end) {
+					fn(*worker, i);
+				}
+			});
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+	}
+
+	class mscap_matcher {
+	public:
+		mscap_matcher(const ms_match_config* cfg, uint32_t bucket_size) : cfg(*cfg), drift(cfg->num_offsets, cfg->offset_times, cfg->offsets) {
+			uint32_t id_bits = cfg->id_bits ? cfg->id_bits : DEFAULT_MATCH_ID_BITS;
+			id_bits = std::min(std::max(id_bits, 8u), (uint32_t) MAX_MATCH_ID_BITS);
+			index_mask = (1ULL << id_bits) - 1;
+			uint32_t threads = cfg->threads ? cfg->threads : std::max(1u, std::thread::hardware_concurrency());
+			for (uint32_t i = 0; i < threads; i++) {
+				workers.emplace_back(new match_worker(bucket_size));
+			}
+		}
+
+		~mscap_matcher() {
+			if (table) {
+				munmap(table, table_size);
+			}
+		}
+
+		bool run(const char* pre_file, const char* post_file, ms_match_stats* out) {
+			if (!pre.open(pre_file) || !post.open(post_file)) {
+				return false;
+			}
+			// pages are zeroed by the kernel and only touched when used
+			table_size = (index_mask + 1) * sizeof(match_entry);
+			void* mem = mmap(nullptr, table_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (mem == MAP_FAILED) {
+				std::cerr << "[MoonSniff] could not allocate matching table of " << table_size << " bytes\n";
+				return false;
+			}
+			madvise(mem, table_size, MADV_HUGEPAGE);
+			table = static_cast<match_entry*>(mem);
+			for (auto& w : workers) {
+				w->buf.resize(std::max(pre.max_records(), post.max_records()));
+			}
+			if (!open_series(series, cfg.series_file, cfg.series_window, workers.size())) {
+				return false;
+			}
+			for (size_t i = 0; series && i < workers.size(); i++) {
+				workers[i]->series = &series->get_local(i);
+			}
+
+			split_rounds();
+			insert_round(0);
+			for (size_t r = 0; r < rounds.size(); r++) {
+				if (r + 1 < rounds.size()) {
+					insert_round(r + 1);
+				}
+				parallel_for(workers, post_rounds[r], post_rounds[r + 1], [this](match_worker& w, uint64_t block) {
+					match_block(w, block);
+				});
+				// records of round r - 2 are overwritten before the next round is matched
+				if (series && r >= 1) {
+					for (size_t i = 0; i < workers.size(); i++) {
+						series->submit(i, rounds[r - 1].start_time);
+					}
+				}
+			}
+			if (rounds.empty()) {
+				// no pre-DUT records, everything is a miss
+				parallel_for(workers, 0, post.blocks(), [this](match_worker& w, uint64_t block) {
+					match_block(w, block);
+				});
+			}
+
+			memset(out, 0, sizeof(*out));
+			for (auto& w : workers) {
+				out->pre_pkts += w->stats.pre_pkts;
+				out->post_pkts += w->stats.post_pkts;
+				out->hits += w->stats.hits;
+				out->misses += w->stats.misses;
+				out->overwrites += w->stats.overwrites;
+				out->inval_ts += w->stats.inval_ts;
+				hist->merge(w->hist);
+			}
+			return close_series(series, out);
+		}
+
+	private:
+		struct round {
+			uint64_t first_block;
+			uint64_t end_block;
+			uint64_t start_time;
+		};
+
+		ms_match_config cfg;
+		drift_model drift;
+		mscap::reader pre;
+		mscap::reader post;
+		match_entry* table = nullptr;
+		size_t table_size = 0;
+		uint64_t index_mask;
+		std::vector<std::unique_ptr<match_worker>> workers;
+		std::unique_ptr<latency_series> series;
+		std::vector<round> rounds;
+		// post-DUT blocks [post_rounds[r], post_rounds[r + 1]) are matched in round r
+		std::vector<uint64_t> post_rounds;
+
+		/**
+		 * Split the pre-DUT blocks into rounds of up to a quarter of the table and assign the post-DUT blocks
+		 * to the round in which they start.
+		 */
+		void split_rounds() {
+			uint64_t round_records = (index_mask + 1) / 4;
+			for (uint64_t b = 0; b < pre.blocks(); b++) {
+				const mscap::index_entry& e = pre.block_info(b);
+				if (rounds.empty() || e.first_record - pre.block_info(rounds.back().first_block).first_record >= round_records) {
+					rounds.push_back({b, b + 1, e.first_timestamp});
+				} else {
+					rounds.back().end_block = b + 1;
+				}
+			}
+			post_rounds.assign(rounds.size() + 1, post.blocks());
+			if (rounds.empty()) {
+				return;
+			}
+			post_rounds[0] = 0;
+			size_t segment = 0;
+			size_t r = 1;
+			for (uint64_t b = 0; b < post.blocks() && r < rounds.size(); b++) {
+				uint64_t ts = drift.apply(post.block_info(b).first_timestamp, segment);
+				while (r < rounds.size() && ts >= rounds[r].start_time) {
+					post_rounds[r++] = b;
+				}
+			}
+		}
+
+		void insert_round(size_t r) {
+			uint64_t start_time = rounds[r].start_time;
+			parallel_for(workers, rounds[r].first_block, rounds[r].end_block, [this, start_time](match_worker& w, uint64_t block) {
+				insert_block(w, block, start_time);
+			});
+		}
+
+		// start_time: first timestamp of the round, older entries are from previous rounds
+		void insert_block(match_worker& w, uint64_t block, uint64_t start_time) {
+			mscap::record* recs = w.buf.data();
+			uint32_t n = pre.decode(block, recs);
+			for (uint32_t i = 0; i < n; i++) {
+				if (i + PREFETCH_DISTANCE < n) {
+					__builtin_prefetch(&table[recs[i + PREFETCH_DISTANCE].identification & index_mask], 1);
+				}
+				match_entry* e = &table[recs[i].identification & index_mask];
+				match_entry rec;
+				rec.timestamp = recs[i].timestamp;
+				rec.identification = recs[i].identification;
+				// a torn guess only costs another iteration
+				match_entry old;
+				old.timestamp = __atomic_load_n(&e->timestamp, __ATOMIC_RELAXED);
+				old.identification = __atomic_load_n(&e->identification, __ATOMIC_RELAXED);
+				// identifications collide only if they wrap within three rounds, entries of previous rounds are
+				// replaced, of two records of this round the later one is kept independent of the insert order
+				while (old.timestamp < start_time || old.timestamp < rec.timestamp
+				|| (old.timestamp == rec.timestamp && old.identification < rec.identification)) {
+					unsigned __int128 prev = __sync_val_compare_and_swap(&e->raw, old.raw, rec.raw);
+					if (prev == old.raw) {
+						break;
+					}
+					old.raw = prev;
+				}
+				if (old.timestamp != 0) {
+					w.stats.overwrites++;
+				}
+				if (w.series) {
+					w.series->add_pre(recs[i].timestamp);
+				}
+			}
+			w.stats.pre_pkts += n;
+		}
+
+		void match_block(match_worker& w, uint64_t block) {
+			mscap::record* recs = w.buf.data();
+			uint32_t n = post.decode(block, recs);
+			for (uint32_t i = 0; i < n; i++) {
+				if (i + PREFETCH_DISTANCE < n) {
+					__builtin_prefetch(&table[recs[i + PREFETCH_DISTANCE].identification & index_mask]);
+				}
+				match_entry* e = &table[recs[i].identification & index_mask];
+				uint64_t pre_ts = __atomic_load_n(&e->timestamp, __ATOMIC_ACQUIRE);
+				if (pre_ts == 0 || __atomic_load_n(&e->identification, __ATOMIC_RELAXED) != recs[i].identification
+				|| !__atomic_compare_exchange_n(&e->timestamp, &pre_ts, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+					// each pre-DUT record is matched at most once
+					w.stats.misses++;
+					continue;
+				}
+				int64_t diff = drift.apply(recs[i].timestamp, w.segment) - pre_ts;
+				// work-around for captures of older versions which overflowed the seconds of timestamps
+				if (diff < -(1LL << 31) && diff > -(1LL << 32)) {
+					diff += 1LL << 32;
+				}
+				w.stats.hits++;
+				if (diff < cfg.thresh) {
+					w.stats.inval_ts++;
+				} else {
+					w.hist.update(diff);
+				}
+				if (w.series) {
+					w.series->add_hit(pre_ts, diff, diff >= cfg.thresh);
+				}
+			}
+			w.stats.post_pkts += n;
+		}
+	};
+
+	struct ms_pcap_match_config {
+		// number of worker threads, 0: all cores except the two readers
+		uint32_t threads;
+		// latencies below are counted as invalid
+		int64_t thresh;
+		// unmatched pre-DUT packets are dropped when the post-DUT capture is this many nanoseconds ahead
+		uint64_t expiry;
+		uint32_t num_offsets;
+		const double* offset_times;
+		const double* offsets;
+		const char* series_file;
+		uint64_t series_window;
+	};
+
+	/**
+	 * Packets of a pcap file, mmap'ed and parsed in place.
+	 * The timestamp is not the pcap timestamp but the hardware timestamp at the end of the packet (X552 layout).
+	 */
+	class pcap_file {
+	public:
+		~pcap_file() {
+			if (data) {
+				munmap(const_cast<uint8_t*>(data), size);
+			}
+		}
+
+		bool open(const char* filename) {
+			int fd = ::open(filename, O_RDONLY);
+			if (fd < 0) {
+				std::cerr << "[MoonSniff] could not open " << filename << ": " << strerror(errno) << "\n";
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st) || st.st_size < 24) {
+				std::cerr << "[MoonSniff] " << filename << " is not a pcap file\n";
+				::close(fd);
+				return false;
+			}
+			size = st.st_size;
+			void* mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (mem == MAP_FAILED) {
+				std::cerr << "[MoonSniff] mmap failed: " << strerror(errno) << "\n";
+				return false;
+			}
+			data = static_cast<const uint8_t*>(mem);
+			madvise(mem, size, MADV_SEQUENTIAL);
+			uint32_t magic;
+			memcpy(&magic, data, 4);
+			// microsecond or nanosecond resolution, only the byte order matters here
+			if (magic == 0xA1B2C3D4 || magic == 0xA1B23C4D) {
+				swapped = false;
+			} else if (magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1) {
+				swapped = true;
+			} else {
+				std::cerr << "[MoonSniff] " << filename << " is not a pcap file\n";
+				return false;
+			}
+			offset = 24;
+			return true;
+		}
+
+		/**
+		 * Next packet, returns false at the end of the file.
+		 */
+		inline bool next(const uint8_t*& pkt, uint32_t& len) {
+			if (offset + 16 > size) {
+				return false;
+			}
+			uint32_t caplen;
+			memcpy(&caplen, data + offset + 8, 4);
+			if (swapped) {
+				caplen = __builtin_bswap32(caplen);
+			}
+			if (offset + 16 + caplen > size) {
+				// truncated capture
+				return false;
+			}
+			pkt = data + offset + 16;
+			len = caplen;
+			offset += 16 + caplen;
+			return true;
+		}
+
+		static inline uint64_t tail_timestamp(const uint8_t* pkt, uint32_t len) {
+			uint32_t ts[2];
+			memcpy(ts, pkt + len - 8, 8);
+			return (uint64_t) ts[1] * 1000000000 + ts[0];
+		}
+
+	private:
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		size_t offset = 0;
+		bool swapped = false;
+	};
+
+	struct pcap_key {
+		uint8_t data[MS_KEY_SIZE];
+
+		bool operator==(const pcap_key& other) const {
+			return memcmp(data, other.data, MS_KEY_SIZE) == 0;
+		}
+	};
+
+	struct pcap_key_hash {
+		inline size_t operator()(const pcap_key& k) const {
+			uint64_t a, b;
+			memcpy(&a, k.data, 8);
+			memcpy(&b, k.data + 8, 8);
+			// MurmurHash3 finalizer
+			uint64_t h = a ^ (b * 0x9E3779B97F4A7C15ULL);
+			h ^= h >> 33;
+			h *= 0xFF51AFD7ED558CCDULL;
+			h ^= h >> 33;
+			h *= 0xC4CEB9FE1A85EC53ULL;
+			return h ^ (h >> 33);
+		}
+	};
+
+	struct pcap_record {
+		pcap_key key;
+		uint64_t timestamp;
+	};
+
+	/**
+	 * Bounded single-producer/single-consumer ring, the producer publishes in batches.
+	 */
+	class pcap_ring {
+	public:
+		static constexpr uint32_t capacity = 16 * 1024;
+		static constexpr uint32_t publish_batch = 64;
+
+		inline bool push(const pcap_record& r) {
+			if (local_tail - cached_head == capacity) {
+				cached_head = head.load(std::memory_order_acquire);
+				if (local_tail - cached_head == capacity) {
+					publish();
+					return false;
+				}
+			}
+			slots[local_tail % capacity] = r;
+			if (++local_tail - published >= publish_batch) {
+				publish();
+			}
+			return true;
+		}
+
+		inline void publish() {
+			published = local_tail;
+			tail.store(local_tail, std::memory_order_release);
+		}
+
+		void finish() {
+			publish();
+			done.store(true, std::memory_order_release);
+		}
+
+		/**
+		 * Next record or nullptr, valid until pop()
+		 */
+		inline const pcap_record* peek() {
+			if (local_head == cached_tail) {
+				cached_tail = tail.load(std::memory_order_acquire);
+				if (local_head == cached_tail) {
+					return nullptr;
+				}
+			}
+			return &slots[local_head % capacity];
+		}
+
+		inline void pop() {
+			head.store(++local_head, std::memory_order_release);
+		}
+
+		// no more records after the currently visible ones, check before peek()
+		bool finished() const {
+			return done.load(std::memory_order_acquire);
+		}
+
+	private:
+		// consumer side, padded to keep the sides on different cache lines (workers are heap-allocated)
+		std::atomic<uint32_t> head{0};
+		uint32_t local_head = 0;
+		uint32_t cached_tail = 0;
+		uint8_t pad0[64];
+		// producer side
+		std::atomic<uint32_t> tail{0};
+		uint32_t local_tail = 0;
+		uint32_t cached_head = 0;
+		uint32_t published = 0;
+		std::atomic<bool> done{false};
+		uint8_t pad1[64];
+		pcap_record slots[capacity];
+	};
+
+	/**
+	 * Matches pre-DUT and post-DUT pcap files.
+	 * One reader thread per file parses the packets directly from the mmap'ed file, extracts key and timestamp and
+	 * hands the records to the worker owning the hash of the key. Each worker has a private map of the pre-DUT records
+	 * of its keys and merges its two input streams by timestamp, so a pre-DUT packet is always inserted before the
+	 * post-DUT packets that follow it. Unmatched pre-DUT packets expire in insertion order.
+	 */
+	class pcap_matcher {
+	public:
+		pcap_matcher(const ms_pcap_match_config* cfg, const key_plan* plan, uint32_t bucket_size)
+			: cfg(*cfg), drift(cfg->num_offsets, cfg->offset_times, cfg->offsets), plan(plan) {
+			uint32_t threads = cfg->threads;
+			if (!threads) {
+				uint32_t cores = std::thread::hardware_concurrency();
+				threads = cores > 3 ? cores - 2 : 1;
+			}
+			for (uint32_t i = 0; i < threads; i++) {
+				workers.emplace_back(new pcap_worker(i, bucket_size));
+			}
+			slack = cfg->thresh < 0 ? -cfg->thresh : 0;
+		}
+
+		bool run(const char* pre_file, const char* post_file, ms_match_stats* out) {
+			if (!pre.open(pre_file) || !post.open(post_file)) {
+				return false;
+			}
+			if (!open_series(series, cfg.series_file, cfg.series_window, workers.size())) {
+				return false;
+			}
+			for (auto& w : workers) {
+				w->series = series ? &series->get_local(w->id) : nullptr;
+			}
+			std::vector<std::thread> threads;
+			threads.emplace_back(&pcap_matcher::read, this, std::ref(pre), true);
+			threads.emplace_back(&pcap_matcher::read, this, std::ref(post), false);
+			for (auto& w : workers) {
+				threads.emplace_back(&pcap_matcher::work, this, w.get());
+			}
+			for (auto& t : threads) {
+				t.join();
+			}
+			memset(out, 0, sizeof(*out));
+			out->skipped = skipped.load();
+			for (auto& w : workers) {
+				out->pre_pkts += w->stats.pre_pkts;
+				out->post_pkts += w->stats.post_pkts;
+				out->hits += w->stats.hits;
+				out->misses += w->stats.misses;
+				out->overwrites += w->stats.overwrites;
+				out->inval_ts += w->stats.inval_ts;
+				out->expired += w->stats.expired;
+				hist->merge(w->hist);
+			}
+			return close_series(series, out);
+		}
+
+	private:
+		struct pcap_worker {
+			pcap_ring pre;
+			pcap_ring post;
+			size_t id;
+			Histogram hist;
+			ms_match_stats stats = {};
+			size_t segment = 0;
+			std::unordered_map<pcap_key, uint64_t, pcap_key_hash> map;
+			// pre-DUT records in insertion order for expiry
+			std::deque<pcap_record> fifo;
+			latency_series::local* series = nullptr;
+			// window of the last submitted watermark
+			uint64_t series_done = 0;
+
+			pcap_worker(size_t id, uint32_t bucket_size) : id(id), hist(bucket_size) {
+			}
+		};
+
+		ms_pcap_match_config cfg;
+		drift_model drift;
+		const key_plan* plan;
+		int64_t slack;
+		pcap_file pre;
+		pcap_file post;
+		std::vector<std::unique_ptr<pcap_worker>> workers;
+		std::unique_ptr<latency_series> series;
+		std::atomic<uint64_t> skipped{0};
+
+		void read(pcap_file& file, bool is_pre) {
+			size_t segment = 0;
+			uint64_t skip = 0;
+			const uint8_t* pkt;
+			uint32_t len;
+			pcap_record r;
+			while (file.next(pkt, len)) {
+				// the hardware timestamp is not part of the packet
+				if (len < 8 || !plan->extract(pkt, len - 8, r.key.data)) {
+					skip++;
+					continue;
+				}
+				r.timestamp = pcap_file::tail_timestamp(pkt, len);
+				if (!is_pre) {
+					r.timestamp = drift.apply(r.timestamp, segment);
+				}
+				pcap_worker& w = *workers[pcap_key_hash()(r.key) % workers.size()];
+				pcap_ring& ring = is_pre ? w.pre : w.post;
+				while (!ring.push(r)) {
+					std::this_thread::yield();
+				}
+			}
+			for (auto& w : workers) {
+				(is_pre ? w->pre : w->post).finish();
+			}
+			skipped += skip;
+		}
+
+		void insert(pcap_worker& w, const pcap_record& r) {
+			auto res = w.map.emplace(r.key, r.timestamp);
+			if (!res.second) {
+				// the previous packet with this key was not matched
+				w.stats.overwrites++;
+				res.first->second = r.timestamp;
+			}
+			w.fifo.push_back(r);
+			w.stats.pre_pkts++;
+			if (w.series) {
+				w.series->add_pre(r.timestamp);
+			}
+		}
+
+		void match(pcap_worker& w, const pcap_record& r) {
+			w.stats.post_pkts++;
+			auto it = w.map.find(r.key);
+			if (it == w.map.end()) {
+				w.stats.misses++;
+			} else {
+				int64_t diff = r.timestamp - it->second;
+				if (w.series) {
+					w.series->add_hit(it->second, diff, diff >= cfg.thresh);
+				}
+				w.map.erase(it);
+				w.stats.hits++;
+				if (diff < cfg.thresh) {
+					w.stats.inval_ts++;
+				} else {
+					w.hist.update(diff);
+				}
+			}
+			expire(w, r.timestamp);
+			if (w.series) {
+				submit_series(w);
+			}
+		}
+
+		/**
+		 * Pre-DUT packets older than the oldest one in the FIFO can not be matched anymore and new ones are not older
+		 * than the last inserted one.
+		 */
+		void submit_series(pcap_worker& w) {
+			if (w.fifo.empty()) {
+				return;
+			}
+			uint64_t watermark = w.fifo.front().timestamp;
+			if (watermark / cfg.series_window > w.series_done) {
+				w.series_done = watermark / cfg.series_window;
+				series->submit(w.id, watermark);
+			}
+		}
+
+		void expire(pcap_worker& w, uint64_t now) {
+			while (!w.fifo.empty() && w.fifo.front().timestamp + cfg.expiry < now) {
+				const pcap_record& old = w.fifo.front();
+				auto it = w.map.find(old.key);
+				// only if it was neither matched nor overwritten
+				if (it != w.map.end() && it->second == old.timestamp) {
+					w.map.erase(it);
+					w.stats.expired++;
+				}
+				w.fifo.pop_front();
+			}
+		}
+
+		void work(pcap_worker* worker) {
+			pcap_worker& w = *worker;
+			while (true) {
+				bool post_done = w.post.finished();
+				const pcap_record* p = w.post.peek();
+				bool pre_done = w.pre.finished();
+				const pcap_record* q = w.pre.peek();
+				if (!p) {
+					if (q) {
+						insert(w, *q);
+						w.pre.pop();
+					} else if (post_done && pre_done) {
+						break;
+					} else {
+						std::this_thread::yield();
+					}
+					continue;
+				}
+				// all pre-DUT packets up to the post-DUT packet (and the tolerated negative latency) go first
+				if (q && q->timestamp <= p->timestamp + slack) {
+					insert(w, *q);
+					w.pre.pop();
+				} else if (q || pre_done) {
+					match(w, *p);
+					w.post.pop();
+				} else {
+					std::this_thread::yield();
+				}
+			}
+			// unmatched pre-DUT packets at the end of the capture
+			w.stats.expired += w.map.size();
+			if (series) {
+				series->submit(w.id, std::numeric_limits<uint64_t>::max());
+			}
+		}
+	};
+}
+
+extern "C" {
+
+/**
+ * Match two mscap files (version 1 or 2) with several threads, see examples/moonsniff/arrmatch.lua.
+ * The latencies are added to the histogram of the hs_* API which must be initialized.
+ * Returns false if a file cannot be read.
+ */
+bool ms_match_mscap(const char* pre_file, const char* post_file, const moonsniff::ms_match_config* cfg, moonsniff::ms_match_stats* stats) {
+	if (!hist) {
+		std::cerr << "[MoonSniff] histogram is not initialized\n";
+		return false;
+	}
+	moonsniff::mscap_matcher matcher(cfg, hist->get_bucket_size());
+	return matcher.run(pre_file, post_file, stats);
+}
+
+/**
+ * Match two pcap files written by sniffer.lua --capture with several threads, see examples/moonsniff/tbbmatch.lua.
+ * The latencies are added to the histogram of the hs_* API which must be initialized.
+ * Returns false if a file cannot be read.
+ */
+bool ms_match_pcap(const char* pre_file, const char* post_file, const moonsniff::key_plan* plan, const moonsniff::ms_pcap_match_config* cfg, moonsniff::ms_match_stats* stats) {
+	if (!hist) {
+		std::cerr << "[MoonSniff] histogram is not initialized\n";
+		return false;
+	}
+	std::unique_ptr<moonsniff::pcap_matcher> matcher(new moonsniff::pcap_matcher(cfg, plan, hist->get_bucket_size()));
+	return matcher->run(pre_file, post_file, stats);
+}
+
+}
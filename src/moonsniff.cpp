@@ -2,14 +2,28 @@
 #include <string>
 #include <iostream>
 #include <mutex>
-#include <fstream>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <rte_ethdev.h>
 #include <rte_mbuf.h>
 #include "lifecycle.hpp"
+#include "log-histogram.hpp"
+#include "key-extractor.hpp"
+#include "mscap.hpp"
 
-#define UINT24_MAX 16777215
-#define INDEX_MASK (uint32_t) 0x00FFFFFF
+// default number of identifier bits used to index the matching table
+#define DEFAULT_ID_BITS 24
+#define MAX_ID_BITS 32
+// maximum number of threads that can run live matching concurrently
+#define MAX_MATCH_THREADS 128
 
 
 /*
@@ -21,12 +35,6 @@ namespace moonsniff {
 	// values smaller than thresh are ignored
 	int64_t thresh = 0; // default: ignore all negative measurements
 
-	// vars for live average computation
-	uint64_t count = 0;
-	double m2 = 0;
-	double mean = 0;
-	double variance = 0;
-
 	/**
 	 * Statistics which are exposed to applications
 	 */
@@ -36,19 +44,201 @@ namespace moonsniff {
 		uint32_t hits = 0;
 		uint32_t misses = 0;
 		uint32_t inval_ts = 0;
-	} stats;
+		// percentiles are accurate to 1.6%
+		int64_t p50_latency = 0;
+		int64_t p99_latency = 0;
+		int64_t p999_latency = 0;
+		int64_t max_latency = 0;
+	};
+
+	/**
+	 * Statistics of the interval since the previous snapshot
+	 */
+	struct ms_snapshot {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t inval_ts;
+		// number of valid latencies
+		uint64_t count;
+		double average_latency;
+		int64_t p50_latency;
+		int64_t p90_latency;
+		int64_t p99_latency;
+		int64_t p999_latency;
+		int64_t max_latency;
+	};
+
+	/**
+	 * Live statistics of a single matching thread, the mean and variance are computed with Welford's algorithm.
+	 * Latencies are also recorded in a log-linear histogram for percentiles, negative latencies are counted as 0.
+	 * Only the owning thread writes, relaxed atomics allow fetching the statistics while the capture is running.
+	 */
+	struct alignas(64) core_stats {
+		std::atomic<uint64_t> hits{0};
+		std::atomic<uint64_t> misses{0};
+		std::atomic<uint64_t> inval_ts{0};
+		std::atomic<uint64_t> count{0};
+		std::atomic<double> mean{0};
+		std::atomic<double> m2{0};
+		// for interval averages of snapshots
+		std::atomic<double> sum{0};
+		std::atomic<int64_t> max{INT64_MIN};
+		loghist::concurrent hist;
+
+		inline void add(int64_t diff) {
+			uint64_t n = count.load(std::memory_order_relaxed) + 1;
+			double old_mean = mean.load(std::memory_order_relaxed);
+			double delta = diff - old_mean;
+			double new_mean = old_mean + delta / n;
+			m2.store(m2.load(std::memory_order_relaxed) + delta * (diff - new_mean), std::memory_order_relaxed);
+			mean.store(new_mean, std::memory_order_relaxed);
+			sum.store(sum.load(std::memory_order_relaxed) + diff, std::memory_order_relaxed);
+			if (diff > max.load(std::memory_order_relaxed)) {
+				max.store(diff, std::memory_order_relaxed);
+			}
+			hist.record(diff > 0 ? diff : 0);
+			count.store(n, std::memory_order_relaxed);
+		}
+
+		template<typename T>
+		static inline void inc(std::atomic<T>& v) {
+			v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+	};
+
+	core_stats thread_stats[MAX_MATCH_THREADS];
+	std::atomic<uint32_t> num_thread_stats{0};
+
+	/**
+	 * Statistics slot of the calling thread, assigned on first use.
+	 */
+	static core_stats& local_stats() {
+		static thread_local core_stats* slot = nullptr;
+		if (!slot) {
+			uint32_t id = num_thread_stats.fetch_add(1);
+			if (id >= MAX_MATCH_THREADS) {
+				std::cerr << "[MoonSniff] more than " << MAX_MATCH_THREADS << " matching threads\n";
+				abort();
+			}
+			slot = &thread_stats[id];
+		}
+		return *slot;
+	}
 
 	/**
 	 * Entry of the hit_list which stores the pre-DUT data
+	 * Entries are read and written as a whole with 128 bit compare-and-swap, a timestamp of 0 marks an empty entry.
 	 */
-	struct entry {
-		uint64_t timestamp;
-		uint64_t identifier;
+	union alignas(16) entry {
+		struct {
+			uint64_t timestamp;
+			uint64_t identifier;
+		};
+		unsigned __int128 raw;
 	};
+	static_assert(sizeof(entry) == 16, "struct size mismatch");
+
+	/**
+	 * Correction of the post-DUT clock relative to the pre-DUT clock, updated by the clock tracking task.
+	 * corrected = timestamp + offset + drift * (timestamp - ref_time)
+	 * Readers retry if seq is odd or changed while reading (seqlock), so they never block the writer.
+	 */
+	struct clock_correction {
+		std::atomic<uint32_t> seq{0};
+		std::atomic<int64_t> ref_time{0};
+		std::atomic<int64_t> offset{0};
+		std::atomic<double> drift{0};
+	} correction;
+
+	static void set_correction(int64_t ref_time, int64_t offset, double drift) {
+		uint32_t seq = correction.seq.load(std::memory_order_relaxed);
+		correction.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		correction.ref_time.store(ref_time, std::memory_order_relaxed);
+		correction.offset.store(offset, std::memory_order_relaxed);
+		correction.drift.store(drift, std::memory_order_relaxed);
+		correction.seq.store(seq + 2, std::memory_order_release);
+	}
+
+	static uint64_t correct(uint64_t timestamp) {
+		uint32_t seq = correction.seq.load(std::memory_order_acquire);
+		if (seq == 0) {
+			// no correction set
+			return timestamp;
+		}
+		int64_t ref_time, offset;
+		double drift;
+		do {
+			seq = correction.seq.load(std::memory_order_acquire);
+			ref_time = correction.ref_time.load(std::memory_order_relaxed);
+			offset = correction.offset.load(std::memory_order_relaxed);
+			drift = correction.drift.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while ((seq & 1) || seq != correction.seq.load(std::memory_order_relaxed));
+		return timestamp + offset + (int64_t) (drift * ((int64_t) timestamp - ref_time));
+	}
+
+	/**
+	 * The matching table, indexed by the lower id_bits of the identification.
+	 * Allocated on first use from hugepages if available, pages are zeroed by the kernel and only touched when used.
+	 */
+	struct table {
+		std::atomic<entry*> entries{nullptr};
+		uint32_t index_mask = 0;
+		size_t size = 0;
+		std::mutex init_mtx;
+	} hit_list;
+
+	/**
+	 * Allocate zeroed memory from hugepages, falls back to transparent hugepages.
+	 * Size is rounded up to 2 MiB. Returns nullptr on failure.
+	 */
+	static void* alloc_huge(size_t& size) {
+		size = ((size - 1) | ((1 << 21) - 1)) + 1;
+		void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+		if (mem == MAP_FAILED) {
+			mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (mem == MAP_FAILED) {
+				return nullptr;
+			}
+			madvise(mem, size, MADV_HUGEPAGE);
+		}
+		return mem;
+	}
+
+	static void init_table(uint32_t id_bits) {
+		std::lock_guard<std::mutex> lock(hit_list.init_mtx);
+		if (hit_list.entries.load(std::memory_order_relaxed)) {
+			return;
+		}
+		id_bits = std::min(std::max(id_bits, 1u), (uint32_t) MAX_ID_BITS);
+		size_t num_entries = 1ULL << id_bits;
+		size_t size = num_entries * sizeof(entry);
+		void* mem = alloc_huge(size);
+		if (!mem) {
+			std::cerr << "[MoonSniff] could not allocate matching table of " << size << " bytes\n";
+			abort();
+		}
+		hit_list.index_mask = (uint32_t) (num_entries - 1);
+		hit_list.size = size;
+		hit_list.entries.store(static_cast<entry*>(mem), std::memory_order_release);
+	}
+
+	static inline entry* get_table() {
+		entry* entries = hit_list.entries.load(std::memory_order_acquire);
+		if (unlikely(!entries)) {
+			init_table(DEFAULT_ID_BITS);
+			entries = hit_list.entries.load(std::memory_order_acquire);
+		}
+		return entries;
+	}
 
-	// initialize array and as many mutexes to ensure memory order
-	struct entry hit_list[UINT24_MAX + 1] = {{0, 0}};
-	std::mutex mtx[UINT24_MAX + 1];
+	static inline entry load_entry(entry* e) {
+		entry old;
+		// a CAS that replaces 0 with 0 is an atomic 128 bit load
+		old.raw = __sync_val_compare_and_swap(&e->raw, (unsigned __int128) 0, (unsigned __int128) 0);
+		return old;
+	}
 
 	/**
 	 * Add a pre DUT timestamp to the array.
@@ -56,12 +246,16 @@ namespace moonsniff {
 	 * @param identification The identifier associated with this timestamp
 	 * @param timestamp The timestamp
 	 */
-	static void add_entry(uint32_t identification, uint64_t timestamp) {
-		uint32_t index = identification & INDEX_MASK;
-		while (!mtx[index].try_lock());
-		hit_list[index].timestamp = timestamp;
-		hit_list[index].identifier = identification;
-		mtx[index].unlock();
+	static void add_entry(uint64_t identification, uint64_t timestamp) {
+		entry* e = get_table() + (identification & hit_list.index_mask);
+		entry new_entry;
+		new_entry.timestamp = timestamp;
+		new_entry.identifier = identification;
+		entry old = load_entry(e);
+		unsigned __int128 prev;
+		while ((prev = __sync_val_compare_and_swap(&e->raw, old.raw, new_entry.raw)) != old.raw) {
+			old.raw = prev;
+		}
 	}
 
 	/**
@@ -69,37 +263,84 @@ namespace moonsniff {
 	 * Updates current mean and variance estimation..
 	 *
 	 * @param identification Identifier for which an entry is searched
-	 * @param timestamp The post timestamp
-	 */
-	static void test_for(uint32_t identification, uint64_t timestamp) {
-		uint32_t index = identification & INDEX_MASK;
-		while (!mtx[index].try_lock());
-		uint64_t old_ts = hit_list[index].identifier == identification ? hit_list[index].timestamp : 0;
-		hit_list[index].timestamp = 0;
-		hit_list[index].identifier = 0;
-		mtx[index].unlock();
+	 * @param timestamp The post timestamp, the clock correction is applied to it
+	 */
+	static void test_for(uint64_t identification, uint64_t timestamp) {
+		timestamp = correct(timestamp);
+		entry* e = get_table() + (identification & hit_list.index_mask);
+		entry old = load_entry(e);
+		uint64_t old_ts = 0;
+		// only take the entry if it belongs to this identification, otherwise leave it for its own post packet
+		while (old.timestamp != 0 && old.identifier == identification) {
+			unsigned __int128 prev = __sync_val_compare_and_swap(&e->raw, old.raw, (unsigned __int128) 0);
+			if (prev == old.raw) {
+				old_ts = old.timestamp;
+				break;
+			}
+			old.raw = prev;
+		}
+		core_stats& stats = local_stats();
 		if (old_ts != 0) {
-			++stats.hits;
+			core_stats::inc(stats.hits);
 			// diff overflow improbable
 			int64_t diff = timestamp - old_ts;
 			if (diff < thresh) {
-				std::cerr << "Measured latency below " << thresh
-						  << " (Threshold). Ignoring...\n";
-			}
-			++count;
-			double delta = diff - mean;
-			mean = mean + delta / count;
-			double delta2 = diff - mean;
-			m2 = m2 + delta * delta2;
+				// the packet did not get a (valid) timestamp on one of the ports
+				core_stats::inc(stats.inval_ts);
+			} else {
+				stats.add(diff);
+			}
 		} else {
-			++stats.misses;
+			core_stats::inc(stats.misses);
 		}
 	}
 
 	/**
-	 * Fetch statistics. Finalizes variance computation..
+	 * Merge the latency histograms of all threads.
+	 */
+	static void merge_histograms(loghist::counts& out, loghist::counts& tmp, uint32_t threads) {
+		out.clear();
+		for (uint32_t i = 0; i < threads; i++) {
+			thread_stats[i].hist.read(tmp);
+			out.add(tmp);
+		}
+	}
+
+	static uint32_t active_threads() {
+		return std::min<uint32_t>(num_thread_stats.load(), MAX_MATCH_THREADS);
+	}
+
+	/**
+	 * Fetch statistics. Merges the per-thread statistics and finalizes variance computation.
+	 * Partial means and variances are combined with the parallel algorithm of Chan et al.
 	 */
 	static ms_stats fetch_stats() {
+		ms_stats stats;
+		uint64_t hits = 0, misses = 0, inval_ts = 0;
+		uint64_t count = 0;
+		double mean = 0, m2 = 0;
+		int64_t max = 0;
+		uint32_t threads = active_threads();
+		for (uint32_t i = 0; i < threads; i++) {
+			core_stats& cs = thread_stats[i];
+			max = std::max(max, cs.max.load(std::memory_order_relaxed));
+			hits += cs.hits.load(std::memory_order_relaxed);
+			misses += cs.misses.load(std::memory_order_relaxed);
+			inval_ts += cs.inval_ts.load(std::memory_order_relaxed);
+			uint64_t n = cs.count.load(std::memory_order_relaxed);
+			if (n == 0) {
+				continue;
+			}
+			double core_mean = cs.mean.load(std::memory_order_relaxed);
+			double core_m2 = cs.m2.load(std::memory_order_relaxed);
+			uint64_t total = count + n;
+			double delta = core_mean - mean;
+			mean += delta * n / total;
+			m2 += core_m2 + delta * delta * ((double) count * n / total);
+			count = total;
+		}
+
+		double variance = 0;
 		if (count < 2) {
 			std::cerr << "Not enough members to calculate mean and variance\n";
 		} else {
@@ -109,47 +350,332 @@ namespace moonsniff {
 		// Implicit cast from double to int64_t -> sub-nanosecond parts are discarded
 		stats.average_latency = mean;
 		stats.variance_latency = variance;
+		stats.hits = hits;
+		stats.misses = misses;
+		stats.inval_ts = inval_ts;
+
+		// about 18 KiB each, too large for the stack of a task
+		std::unique_ptr<loghist::counts> hist(new loghist::counts), tmp(new loghist::counts);
+		merge_histograms(*hist, *tmp, threads);
+		stats.p50_latency = hist->quantile(0.5);
+		stats.p99_latency = hist->quantile(0.99);
+		stats.p999_latency = hist->quantile(0.999);
+		stats.max_latency = max;
 		return stats;
 	}
 
 	/**
-	 * Log packets.
+	 * State of the previous snapshot, snapshots can be fetched from any thread.
 	 */
-	void ms_log_pkts(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** rx_pkts, uint16_t nb_pkts, uint32_t seqnum_offset, const char* filename) {
-		std::ofstream out (filename, std::ofstream::binary | std::ofstream::app);
+	struct snapshot_state {
+		std::mutex mtx;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t inval_ts = 0;
+		uint64_t count = 0;
+		double sum = 0;
+		loghist::counts hist = {};
+		loghist::counts cur = {};
+		loghist::counts tmp = {};
+	} last_snapshot;
+
+	/**
+	 * Fetch the statistics of the interval since the previous call without interrupting the capture.
+	 * The first call covers the time since the start of the capture.
+	 */
+	static void fetch_snapshot(ms_snapshot* snap) {
+		std::lock_guard<std::mutex> lock(last_snapshot.mtx);
+		uint64_t hits = 0, misses = 0, inval_ts = 0, count = 0;
+		double sum = 0;
+		int64_t max = 0;
+		uint32_t threads = active_threads();
+		for (uint32_t i = 0; i < threads; i++) {
+			core_stats& cs = thread_stats[i];
+			hits += cs.hits.load(std::memory_order_relaxed);
+			misses += cs.misses.load(std::memory_order_relaxed);
+			inval_ts += cs.inval_ts.load(std::memory_order_relaxed);
+			count += cs.count.load(std::memory_order_relaxed);
+			sum += cs.sum.load(std::memory_order_relaxed);
+			max = std::max(max, cs.max.load(std::memory_order_relaxed));
+		}
+		loghist::counts& cur = last_snapshot.cur;
+		loghist::counts& interval = last_snapshot.tmp;
+		merge_histograms(cur, interval, threads);
+		interval = cur;
+		interval.subtract(last_snapshot.hist);
+		last_snapshot.hist = cur;
+
+		snap->hits = hits - last_snapshot.hits;
+		snap->misses = misses - last_snapshot.misses;
+		snap->inval_ts = inval_ts - last_snapshot.inval_ts;
+		snap->count = count - last_snapshot.count;
+		snap->average_latency = snap->count ? (sum - last_snapshot.sum) / snap->count : 0;
+		snap->p50_latency = interval.quantile(0.5);
+		snap->p90_latency = interval.quantile(0.9);
+		snap->p99_latency = interval.quantile(0.99);
+		snap->p999_latency = interval.quantile(0.999);
+		// the histogram only knows the bucket, the exact maximum is only tracked for the whole capture
+		snap->max_latency = std::min<int64_t>(interval.max(), max);
+		last_snapshot.hits = hits;
+		last_snapshot.misses = misses;
+		last_snapshot.inval_ts = inval_ts;
+		last_snapshot.count = count;
+		last_snapshot.sum = sum;
+	}
+
+	/**
+	 * Writes mscap records from a capture thread to a version 2 file, see src/mscap.hpp.
+	 * The capture thread fills large hugepage-backed buffers, full buffers are passed through a bounded
+	 * single-producer/single-consumer queue to a writer thread which encodes them into blocks and writes them out.
+	 * The capture thread never touches the file, encoding and writeback only stall the writer thread.
+	 * If all buffers are in flight, the capture thread waits for the writer (backpressure via the RX ring).
+	 */
+	class mscap_writer {
+	public:
+		static constexpr uint32_t num_buffers = 16;
+		static constexpr size_t buffer_records = (4 << 20) / sizeof(mscap::record);
+
+		mscap_writer(const char* filename, uint8_t port_id, uint16_t queue_id, uint8_t id_bits) {
+			if (!file.open(filename, port_id, queue_id, id_bits, mscap::CLOCK_NIC)) {
+				return;
+			}
+			for (uint32_t i = 0; i < num_buffers; i++) {
+				size_t size = buffer_records * sizeof(mscap::record);
+				buffers[i] = static_cast<mscap::record*>(alloc_huge(size));
+				if (!buffers[i]) {
+					std::cerr << "[MoonSniff] could not allocate writer buffers\n";
+					return;
+				}
+				free_queue.push(i);
+			}
+			free_queue.pop(current);
+			thread = std::thread(&mscap_writer::run, this);
+			ok = true;
+		}
+
+		~mscap_writer() {
+			if (ok) {
+				if (fill) {
+					submit();
+				}
+				done.store(true, std::memory_order_release);
+				thread.join();
+			}
+			file.close();
+			for (auto buffer : buffers) {
+				if (buffer) {
+					munmap(buffer, ((buffer_records * sizeof(mscap::record) - 1) | ((1 << 21) - 1)) + 1);
+				}
+			}
+		}
+
+		bool is_ok() const {
+			return ok;
+		}
+
+		uint64_t get_stalls() const {
+			return stalls;
+		}
+
+		inline void add(uint64_t timestamp, uint64_t identification) {
+			mscap::record& r = buffers[current][fill++];
+			r.timestamp = timestamp;
+			r.identification = identification;
+			if (fill == buffer_records) {
+				submit();
+			}
+		}
+
+	private:
+		/**
+		 * Bounded queue of buffer indices, one producer, one consumer
+		 */
+		struct spsc_queue {
+			std::atomic<uint32_t> head{0};
+			std::atomic<uint32_t> tail{0};
+			uint32_t slots[num_buffers];
+
+			bool push(uint32_t v) {
+				uint32_t t = tail.load(std::memory_order_relaxed);
+				if (t - head.load(std::memory_order_acquire) == num_buffers) {
+					return false;
+				}
+				slots[t % num_buffers] = v;
+				tail.store(t + 1, std::memory_order_release);
+				return true;
+			}
+
+			bool pop(uint32_t& v) {
+				uint32_t h = head.load(std::memory_order_relaxed);
+				if (h == tail.load(std::memory_order_acquire)) {
+					return false;
+				}
+				v = slots[h % num_buffers];
+				head.store(h + 1, std::memory_order_release);
+				return true;
+			}
+		};
+
+		mscap::writer file;
+		bool ok = false;
+		mscap::record* buffers[num_buffers] = {};
+		// buffer currently filled by the capture thread
+		uint32_t current = 0;
+		size_t fill = 0;
+		uint64_t stalls = 0;
+		spsc_queue free_queue;
+		spsc_queue full_queue;
+		// records in each buffer, written before the buffer is pushed to full_queue
+		size_t fills[num_buffers] = {};
+		std::atomic<bool> done{false};
+		std::thread thread;
+
+		void submit() {
+			fills[current] = fill;
+			// cannot fail, there are only num_buffers buffers
+			full_queue.push(current);
+			if (!free_queue.pop(current)) {
+				stalls++;
+				while (!free_queue.pop(current)) {
+					std::this_thread::yield();
+				}
+			}
+			fill = 0;
+		}
+
+		void run() {
+			while (true) {
+				// read done before polling, so the last buffer is never missed
+				bool finished = done.load(std::memory_order_acquire);
+				uint32_t idx;
+				if (full_queue.pop(idx)) {
+					// the fill level is published by the push of the buffer
+					size_t records = fills[idx];
+					for (size_t i = 0; i < records; i++) {
+						file.add(buffers[idx][i].timestamp, buffers[idx][i].identification);
+					}
+					free_queue.push(idx);
+				} else if (finished) {
+					return;
+				} else {
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+				}
+			}
+		}
+	};
+
+	/**
+	 * Read the hardware timestamp appended to a packet (nanoseconds, seconds).
+	 * PKT_RX_TIMESTAMP is not accepted, it marks timestamps in the mbuf in a driver-specific unit.
+	 *
+	 * @return The timestamp in nanoseconds, 0 if the packet has no timestamp
+	 */
+	static inline uint64_t tail_timestamp(const struct rte_mbuf* pkt) {
+		if (!(pkt->ol_flags & PKT_RX_IEEE1588_TMST) || pkt->data_len < 8) {
+			return 0;
+		}
+		const uint32_t* timestamp32 = rte_pktmbuf_mtod_offset(pkt, const uint32_t*, pkt->data_len - 8);
+		return (uint64_t) timestamp32[1] * 1000000000 + timestamp32[0];
+	}
+
+	/**
+	 * Add the pre-DUT packets of a burst to the matching table.
+	 * Packets without timestamp or key are ignored.
+	 */
+	static void add_pkts(const key_plan* plan, struct rte_mbuf** pkts, uint16_t n) {
+		for (uint16_t i = 0; i < n; i++) {
+			uint64_t timestamp = tail_timestamp(pkts[i]);
+			uint64_t identification;
+			if (timestamp && plan->extract64(pkts[i], &identification)) {
+				add_entry(identification, timestamp);
+			}
+		}
+	}
+
+	/**
+	 * Match the post-DUT packets of a burst.
+	 * Packets without key are counted as misses, packets without timestamp as invalid.
+	 */
+	static void test_pkts(const key_plan* plan, struct rte_mbuf** pkts, uint16_t n) {
+		for (uint16_t i = 0; i < n; i++) {
+			uint64_t identification;
+			if (plan->extract64(pkts[i], &identification)) {
+				test_for(identification, tail_timestamp(pkts[i]));
+			} else {
+				core_stats::inc(local_stats().misses);
+			}
+		}
+	}
+
+	static void log_pkts(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** rx_pkts, uint16_t nb_pkts, const key_plan* plan, const char* filename) {
+		mscap_writer out(filename, port_id, queue_id, plan->id_bits());
+		if (!out.is_ok()) {
+			return;
+		}
+		uint64_t no_timestamp = 0, no_key = 0;
 
 		while (libmoon::is_running(0)) {
 			uint16_t rx = rte_eth_rx_burst(port_id, queue_id, rx_pkts, nb_pkts);
 
 			for (int i = 0; i < rx; i++) {
-				if ((rx_pkts[i]->ol_flags | PKT_RX_IEEE1588_TMST) != 0) {
-					uint32_t* timestamp32 = (uint32_t*)((uint8_t*)rx_pkts[i]->buf_addr + rx_pkts[i]->data_off + rx_pkts[i]->pkt_len - 8);
-					uint32_t low = timestamp32[0];
-					uint32_t high = timestamp32[1];
-					uint64_t timestamp = high * 1000000000 + low;
-
-					if (seqnum_offset < rx_pkts[i]->pkt_len) {
-						uint32_t identifier = *(uint32_t*)((uint8_t*)rx_pkts[i]->buf_addr + rx_pkts[i]->data_off + seqnum_offset);
-
-						out.write((char*)&timestamp, sizeof(timestamp));
-						out.write((char*)&identifier, sizeof(identifier));
-					} else {
-						std::cerr << "Offset of sequence number greater than packet size\n";
-					}
+				struct rte_mbuf* pkt = rx_pkts[i];
+				uint64_t timestamp = tail_timestamp(pkt);
+				uint64_t identification;
+				if (!timestamp) {
+					no_timestamp++;
+				} else if (!plan->extract64(pkt, &identification)) {
+					no_key++;
+				} else {
+					out.add(timestamp, identification);
 				}
-
-				rte_pktmbuf_free(rx_pkts[i]);
+				rte_pktmbuf_free(pkt);
 			}
 		}
+		if (no_timestamp) {
+			std::cerr << "[MoonSniff] ignored " << no_timestamp << " packets without timestamp\n";
+		}
+		if (no_key) {
+			std::cerr << "[MoonSniff] could not extract the identification of " << no_key << " packets\n";
+		}
+		if (out.get_stalls()) {
+			std::cerr << "[MoonSniff] capture waited " << out.get_stalls() << " times for the writer thread\n";
+		}
+	}
+
+	/**
+	 * Log packets, the identification is the uint32_t at seqnum_offset.
+	 */
+	void ms_log_pkts(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** rx_pkts, uint16_t nb_pkts, uint32_t seqnum_offset, const char* filename) {
+		ms_key_spec spec = {};
+		spec.num_fields = 1;
+		spec.fields[0].base = MS_KEY_BASE_PACKET;
+		spec.fields[0].length = 4;
+		spec.fields[0].offset = seqnum_offset;
+		std::unique_ptr<key_plan> plan(key_plan::compile(&spec));
+		log_pkts(port_id, queue_id, rx_pkts, nb_pkts, plan.get(), filename);
 	}
 }
 
 extern "C" {
 
+/**
+ * Allocate the matching table of the live mode. Optional, it is allocated with DEFAULT_ID_BITS on first use otherwise.
+ * Has no effect once the table exists.
+ *
+ * @param id_bits Number of lower bits of the identification used to index the table
+ */
+void ms_init(uint32_t id_bits) {
+	moonsniff::init_table(id_bits);
+}
+
 void ms_set_thresh(int64_t thresh) {
 	moonsniff::thresh = thresh;
 }
 
+void ms_set_clock_correction(int64_t ref_time, int64_t offset, double drift) {
+	moonsniff::set_correction(ref_time, offset, drift);
+}
+
 void ms_add_entry(uint32_t identification, uint64_t timestamp) {
 	moonsniff::add_entry(identification, timestamp);
 }
@@ -162,7 +688,45 @@ moonsniff::ms_stats ms_fetch_stats() {
 	return moonsniff::fetch_stats();
 }
 
+void ms_fetch_snapshot(moonsniff::ms_snapshot* snap) {
+	moonsniff::fetch_snapshot(snap);
+}
+
 void ms_log_pkts(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** rx_pkts, uint16_t nb_pkts, uint32_t seqnum_offset, const char* filename) {
 	moonsniff::ms_log_pkts(port_id, queue_id, rx_pkts, nb_pkts, seqnum_offset, filename);
 }
+
+void ms_log_pkts_key(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** rx_pkts, uint16_t nb_pkts, const moonsniff::key_plan* plan, const char* filename) {
+	moonsniff::log_pkts(port_id, queue_id, rx_pkts, nb_pkts, plan, filename);
+}
+
+/**
+ * Compile a key spec, returns NULL if it is invalid.
+ */
+moonsniff::key_plan* ms_key_compile(const ms_key_spec* spec) {
+	return moonsniff::key_plan::compile(spec);
+}
+
+void ms_key_free(moonsniff::key_plan* plan) {
+	delete plan;
+}
+
+bool ms_key_extract(const moonsniff::key_plan* plan, const struct rte_mbuf* pkt, uint8_t* key) {
+	return plan->extract(pkt, key);
+}
+
+bool ms_key_extract64(const moonsniff::key_plan* plan, const struct rte_mbuf* pkt, uint64_t* identification) {
+	return plan->extract64(pkt, identification);
+}
+
+/**
+ * Live mode without per-packet Lua, the timestamps are read from the end of the packets.
+ */
+void ms_add_pkts(const moonsniff::key_plan* plan, struct rte_mbuf** pkts, uint16_t n) {
+	moonsniff::add_pkts(plan, pkts, n);
+}
+
+void ms_test_pkts(const moonsniff::key_plan* plan, struct rte_mbuf** pkts, uint16_t n) {
+	moonsniff::test_pkts(plan, pkts, n);
+}
 }
@@ -0,0 +1,81 @@
+#include <cstdint>
+
+#include "mscap.hpp"
+
+/*
+ * C API of the mscap reader and writer for lua/moonsniff-io.lua
+ */
+extern "C" {
+
+/**
+ * Open a version 1 or 2 file, returns NULL on errors.
+ */
+mscap::reader* mscap_reader_open(const char* filename) {
+	mscap::reader* r = new mscap::reader();
+	if (!r->open(filename)) {
+		delete r;
+		return nullptr;
+	}
+	return r;
+}
+
+void mscap_reader_close(mscap::reader* r) {
+	delete r;
+}
+
+/**
+ * Header of the file, synthesized for version 1 files.
+ */
+const mscap::file_header* mscap_reader_info(const mscap::reader* r) {
+	return &r->info();
+}
+
+uint64_t mscap_reader_blocks(const mscap::reader* r) {
+	return r->blocks();
+}
+
+uint32_t mscap_reader_max_records(const mscap::reader* r) {
+	return r->max_records();
+}
+
+/**
+ * Decode a block into out which must hold mscap_reader_max_records() records.
+ * Returns the number of records, 0 if there is no such block.
+ */
+uint32_t mscap_reader_decode(const mscap::reader* r, uint64_t block, mscap::record* out) {
+	return r->decode(block, out);
+}
+
+uint64_t mscap_reader_find_block(const mscap::reader* r, uint64_t timestamp) {
+	return r->find_block(timestamp);
+}
+
+/**
+ * Create a version 2 file, returns NULL on errors.
+ *
+ * @param id_bits Width of the identifications, 32 or 64
+ * @param clock Clock source of the timestamps, see mscap::clock_source
+ */
+mscap::writer* mscap_writer_open(const char* filename, uint16_t port, uint16_t queue, uint8_t id_bits, uint8_t clock) {
+	mscap::writer* w = new mscap::writer();
+	if (!w->open(filename, port, queue, id_bits, clock)) {
+		delete w;
+		return nullptr;
+	}
+	return w;
+}
+
+void mscap_writer_add(mscap::writer* w, uint64_t timestamp, uint64_t identification) {
+	w->add(timestamp, identification);
+}
+
+/**
+ * Finish the file and free the writer, returns false if any write failed.
+ */
+bool mscap_writer_close(mscap::writer* w) {
+	bool ok = w->close();
+	delete w;
+	return ok;
+}
+
+}
@@ -0,0 +1,534 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * MoonSniff capture files (mscap), see lua/moonsniff-io.lua.
+ *
+ * Version 1 is a headerless stream of packed 12 byte records (uint64_t timestamp, uint32_t identification).
+ *
+ * Version 2 starts with a file header, followed by blocks of block_size bytes and the block index.
+ * A block starts with a block header which holds the first record, the other records follow as two varints each:
+ * the zigzag-encoded differences to the timestamp and identification of the previous record. Identification
+ * differences are computed modulo 2^id_bits. Blocks can therefore be decoded independently, unused bytes at the end
+ * of a block are zero. The index has one entry per block and is written when the file is closed, index_offset is 0
+ * before, readers then rebuild the index from the block headers.
+ */
+namespace mscap {
+	// "MSCAP" followed by three zero bytes, never a plausible timestamp of a version 1 file
+	constexpr uint64_t magic = 0x000000504143534DULL;
+	constexpr uint32_t version = 2;
+	constexpr uint32_t default_block_size = 64 * 1024;
+	// version 1 files are split into pseudo-blocks of this many records for parallel access
+	constexpr uint32_t v1_block_records = 64 * 1024;
+	constexpr uint32_t v1_record_size = 12;
+	// two varints of at most 10 bytes each
+	constexpr uint32_t max_record_size = 20;
+
+	enum clock_source : uint8_t {
+		CLOCK_UNKNOWN = 0,
+		// hardware timestamps of the NIC in nanoseconds, the clocks of both ports are synchronized at start
+		CLOCK_NIC = 1,
+		// nanoseconds since the epoch
+		CLOCK_WALL = 2,
+	};
+
+	struct file_header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t header_size;
+		uint32_t block_size;
+		// 32 or 64
+		uint8_t id_bits;
+		uint8_t clock;
+		uint16_t port;
+		uint16_t queue;
+		uint16_t reserved0;
+		uint32_t reserved1;
+		uint64_t num_records;
+		uint64_t num_blocks;
+		// 0 if the file was not closed properly
+		uint64_t index_offset;
+		uint64_t first_timestamp;
+	};
+	static_assert(sizeof(file_header) == 64, "struct size mismatch");
+
+	struct block_header {
+		uint64_t timestamp;
+		uint64_t identification;
+		uint32_t num_records;
+		// bytes used including this header
+		uint32_t size;
+	};
+	static_assert(sizeof(block_header) == 24, "struct size mismatch");
+
+	struct index_entry {
+		uint64_t offset;
+		uint64_t first_timestamp;
+		// number of records in all previous blocks
+		uint64_t first_record;
+	};
+	static_assert(sizeof(index_entry) == 24, "struct size mismatch");
+
+	/*
+	 * Decoded record, independent of the file version
+	 */
+	struct record {
+		uint64_t timestamp;
+		uint64_t identification;
+	};
+
+	inline uint64_t zigzag(int64_t v) {
+		return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+	}
+
+	inline int64_t unzigzag(uint64_t v) {
+		return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+	}
+
+	inline uint32_t put_varint(uint8_t* p, uint64_t v) {
+		uint32_t n = 0;
+		while (v >= 0x80) {
+			p[n++] = (uint8_t) v | 0x80;
+			v >>= 7;
+		}
+		p[n++] = (uint8_t) v;
+		return n;
+	}
+
+	// returns nullptr if the varint exceeds end
+	inline const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, uint64_t& v) {
+		v = 0;
+		for (uint32_t shift = 0; p < end && shift < 64; shift += 7) {
+			uint8_t b = *p++;
+			v |= (uint64_t) (b & 0x7F) << shift;
+			if (!(b & 0x80)) {
+				return p;
+			}
+		}
+		return nullptr;
+	}
+
+	/*
+	 * Difference of two identifications modulo 2^id_bits as signed value
+	 */
+	inline int64_t id_delta(uint64_t id, uint64_t prev, bool wide) {
+		return wide ? (int64_t) (id - prev) : (int64_t) (int32_t) (uint32_t) (id - prev);
+	}
+
+	inline uint32_t max_block_records(uint32_t block_size) {
+		// every record after the first takes at least two bytes
+		return (block_size - sizeof(block_header)) / 2 + 1;
+	}
+
+	/*
+	 * Encodes records into a single block.
+	 */
+	class block_encoder {
+	public:
+		block_encoder(uint32_t block_size, bool wide) : block_size(block_size), wide(wide) {
+		}
+
+		void reset(uint8_t* block) {
+			this->block = block;
+			used = sizeof(block_header);
+			count = 0;
+		}
+
+		/*
+		 * Returns false if the block is full, the record is not added then.
+		 */
+		inline bool add(uint64_t timestamp, uint64_t identification) {
+			if (!wide) {
+				identification = (uint32_t) identification;
+			}
+			if (count == 0) {
+				block_header* hdr = reinterpret_cast<block_header*>(block);
+				hdr->timestamp = timestamp;
+				hdr->identification = identification;
+			} else {
+				if (used + max_record_size > block_size) {
+					return false;
+				}
+				used += put_varint(block + used, zigzag((int64_t) (timestamp - prev_timestamp)));
+				used += put_varint(block + used, zigzag(id_delta(identification, prev_id, wide)));
+			}
+			prev_timestamp = timestamp;
+			prev_id = identification;
+			count++;
+			return true;
+		}
+
+		uint32_t records() const {
+			return count;
+		}
+
+		uint64_t first_timestamp() const {
+			return reinterpret_cast<const block_header*>(block)->timestamp;
+		}
+
+		// fills in the block header and zeroes the unused bytes
+		void finish() {
+			block_header* hdr = reinterpret_cast<block_header*>(block);
+			hdr->num_records = count;
+			hdr->size = used;
+			memset(block + used, 0, block_size - used);
+		}
+
+	private:
+		uint8_t* block = nullptr;
+		uint32_t block_size;
+		bool wide;
+		uint32_t used = 0;
+		uint32_t count = 0;
+		uint64_t prev_timestamp = 0;
+		uint64_t prev_id = 0;
+	};
+
+	/*
+	 * Decode a version 2 block, out must hold max_block_records(block_size) records.
+	 * Returns the number of decoded records, stops early at corrupted data.
+	 */
+	inline uint32_t decode_block(const uint8_t* block, uint32_t block_size, bool wide, record* out) {
+		const block_header* hdr = reinterpret_cast<const block_header*>(block);
+		if (hdr->num_records == 0 || hdr->size > block_size || hdr->size < sizeof(block_header)) {
+			return 0;
+		}
+		const uint8_t* p = block + sizeof(block_header);
+		const uint8_t* end = block + hdr->size;
+		uint64_t timestamp = hdr->timestamp;
+		uint64_t identification = hdr->identification;
+		out[0].timestamp = timestamp;
+		out[0].identification = identification;
+		uint32_t n = 1;
+		uint32_t max = std::min(hdr->num_records, max_block_records(block_size));
+		while (n < max) {
+			uint64_t dt, did;
+			if (!(p = get_varint(p, end, dt)) || !(p = get_varint(p, end, did))) {
+				break;
+			}
+			timestamp += unzigzag(dt);
+			identification += unzigzag(did);
+			if (!wide) {
+				identification = (uint32_t) identification;
+			}
+			out[n].timestamp = timestamp;
+			out[n].identification = identification;
+			n++;
+		}
+		return n;
+	}
+
+	/*
+	 * Writes version 2 files sequentially, blocks are written in batches.
+	 * Not thread-safe, the capture path runs it on its writer thread.
+	 */
+	class writer {
+	public:
+		static constexpr uint32_t batch_blocks = 16;
+
+		writer(uint32_t block_size = default_block_size) : block_size(block_size) {
+		}
+
+		writer(const writer&) = delete;
+		writer& operator=(const writer&) = delete;
+
+		~writer() {
+			close();
+		}
+
+		/*
+		 * Create the file, existing files are never overwritten. Returns false on errors.
+		 */
+		bool open(const char* filename, uint16_t port, uint16_t queue, uint8_t id_bits, uint8_t clock) {
+			fd = ::open(filename, O_CREAT | O_EXCL | O_WRONLY, 0666);
+			if (fd < 0 && errno == EEXIST) {
+				std::cerr << "[MoonSniff] " << filename << " already exists, remove it or choose another file name\n";
+				return false;
+			}
+			if (fd < 0) {
+				std::cerr << "[MoonSniff] could not open " << filename << ": " << strerror(errno) << "\n";
+				return false;
+			}
+			memset(&header, 0, sizeof(header));
+			header.magic = magic;
+			header.version = version;
+			header.header_size = sizeof(file_header);
+			header.block_size = block_size;
+			header.id_bits = id_bits > 32 ? 64 : 32;
+			header.clock = clock;
+			header.port = port;
+			header.queue = queue;
+			encoder = block_encoder(block_size, header.id_bits == 64);
+			batch.resize((size_t) block_size * batch_blocks);
+			batch_fill = 0;
+			encoder.reset(batch.data());
+			offset = sizeof(file_header);
+			// the header is rewritten on close, but readers can identify unfinished files
+			return write_all(&header, sizeof(header), 0);
+		}
+
+		inline void add(uint64_t timestamp, uint64_t identification) {
+			if (__builtin_expect(!encoder.add(timestamp, identification), 0)) {
+				next_block();
+				encoder.add(timestamp, identification);
+			}
+			header.num_records++;
+		}
+
+		/*
+		 * Write the last block, the index, and the final header. Returns false on errors.
+		 */
+		bool close() {
+			if (fd < 0) {
+				return ok;
+			}
+			if (encoder.records()) {
+				finish_block();
+			}
+			flush();
+			header.index_offset = offset;
+			header.num_blocks = index.size();
+			header.first_timestamp = index.empty() ? 0 : index[0].first_timestamp;
+			write_all(index.data(), index.size() * sizeof(index_entry), offset);
+			write_all(&header, sizeof(header), 0);
+			if (fsync(fd)) {
+				std::cerr << "[MoonSniff] fsync failed: " << strerror(errno) << "\n";
+				ok = false;
+			}
+			::close(fd);
+			fd = -1;
+			return ok;
+		}
+
+		uint64_t records() const {
+			return header.num_records;
+		}
+
+	private:
+		int fd = -1;
+		bool ok = true;
+		uint32_t block_size;
+		file_header header = {};
+		block_encoder encoder{default_block_size, false};
+		std::vector<uint8_t> batch;
+		uint32_t batch_fill = 0;
+		// file offset of the first block in batch
+		uint64_t offset = 0;
+		std::vector<index_entry> index;
+		uint64_t last_block_records = 0;
+
+		bool write_all(const void* data, size_t len, uint64_t pos) {
+			const uint8_t* p = static_cast<const uint8_t*>(data);
+			while (len) {
+				ssize_t n = pwrite(fd, p, len, pos);
+				if (n < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					std::cerr << "[MoonSniff] write failed: " << strerror(errno) << "\n";
+					ok = false;
+					return false;
+				}
+				p += n;
+				pos += n;
+				len -= n;
+			}
+			return true;
+		}
+
+		void finish_block() {
+			encoder.finish();
+			index_entry e;
+			e.offset = offset + (uint64_t) batch_fill * block_size;
+			e.first_timestamp = encoder.first_timestamp();
+			e.first_record = index.empty() ? 0 : index.back().first_record + last_block_records;
+			last_block_records = encoder.records();
+			index.push_back(e);
+			batch_fill++;
+		}
+
+		void flush() {
+			if (batch_fill) {
+				write_all(batch.data(), (size_t) batch_fill * block_size, offset);
+				offset += (uint64_t) batch_fill * block_size;
+				batch_fill = 0;
+			}
+		}
+
+		void next_block() {
+			finish_block();
+			if (batch_fill == batch_blocks) {
+				flush();
+			}
+			encoder.reset(batch.data() + (size_t) batch_fill * block_size);
+		}
+	};
+
+	/*
+	 * Reads version 1 and 2 files through mmap.
+	 * Blocks are independent, so several threads can decode different blocks of the same reader at once.
+	 */
+	class reader {
+	public:
+		reader() = default;
+		reader(const reader&) = delete;
+		reader& operator=(const reader&) = delete;
+
+		~reader() {
+			if (data) {
+				munmap(const_cast<uint8_t*>(data), size);
+			}
+		}
+
+		/*
+		 * Returns false if the file cannot be read.
+		 */
+		bool open(const char* filename) {
+			int fd = ::open(filename, O_RDONLY);
+			if (fd < 0) {
+				std::cerr << "[MoonSniff] could not open " << filename << ": " << strerror(errno) << "\n";
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st)) {
+				::close(fd);
+				return false;
+			}
+			size = st.st_size;
+			if (size) {
+				void* mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mem == MAP_FAILED) {
+					std::cerr << "[MoonSniff] mmap failed: " << strerror(errno) << "\n";
+					::close(fd);
+					return false;
+				}
+				data = static_cast<const uint8_t*>(mem);
+				madvise(mem, size, MADV_SEQUENTIAL);
+			}
+			::close(fd);
+			if (size >= sizeof(file_header) && reinterpret_cast<const file_header*>(data)->magic == magic) {
+				return open_v2(filename);
+			}
+			open_v1();
+			return true;
+		}
+
+		const file_header& info() const {
+			return header;
+		}
+
+		uint64_t blocks() const {
+			return index.size();
+		}
+
+		uint32_t max_records() const {
+			return header.version == 1 ? v1_block_records : max_block_records(header.block_size);
+		}
+
+		const index_entry& block_info(uint64_t block) const {
+			return index[block];
+		}
+
+		/*
+		 * Decode a block, out must hold max_records() records. Returns the number of records.
+		 */
+		uint32_t decode(uint64_t block, record* out) const {
+			if (block >= index.size()) {
+				return 0;
+			}
+			const uint8_t* p = data + index[block].offset;
+			if (header.version == 1) {
+				uint64_t remaining = header.num_records - index[block].first_record;
+				uint32_t n = (uint32_t) std::min<uint64_t>(remaining, v1_block_records);
+				for (uint32_t i = 0; i < n; i++) {
+					memcpy(&out[i].timestamp, p, 8);
+					uint32_t id;
+					memcpy(&id, p + 8, 4);
+					out[i].identification = id;
+					p += v1_record_size;
+				}
+				return n;
+			}
+			return decode_block(p, header.block_size, header.id_bits == 64, out);
+		}
+
+		/*
+		 * Index of the last block starting at or before the timestamp, 0 if there is none.
+		 * Assumes that timestamps are mostly increasing, as in captures.
+		 */
+		uint64_t find_block(uint64_t timestamp) const {
+			auto it = std::upper_bound(index.begin(), index.end(), timestamp, [](uint64_t ts, const index_entry& e) {
+				return ts < e.first_timestamp;
+			});
+			return it == index.begin() ? 0 : it - index.begin() - 1;
+		}
+
+	private:
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		file_header header = {};
+		std::vector<index_entry> index;
+
+		void open_v1() {
+			memset(&header, 0, sizeof(header));
+			header.version = 1;
+			header.id_bits = 32;
+			header.clock = CLOCK_NIC;
+			header.num_records = size / v1_record_size;
+			header.block_size = v1_block_records * v1_record_size;
+			for (uint64_t r = 0; r < header.num_records; r += v1_block_records) {
+				index_entry e;
+				e.offset = r * v1_record_size;
+				memcpy(&e.first_timestamp, data + e.offset, 8);
+				e.first_record = r;
+				index.push_back(e);
+			}
+			if (header.num_records) {
+				header.first_timestamp = index[0].first_timestamp;
+			}
+		}
+
+		bool open_v2(const char* filename) {
+			memcpy(&header, data, sizeof(header));
+			if (header.version != version || header.header_size < sizeof(file_header)
+			|| header.block_size <= sizeof(block_header) + max_record_size) {
+				std::cerr << "[MoonSniff] unsupported mscap file " << filename << " (version " << header.version << ")\n";
+				return false;
+			}
+			uint64_t index_size = header.num_blocks * sizeof(index_entry);
+			if (header.index_offset && header.index_offset + index_size <= size) {
+				const index_entry* entries = reinterpret_cast<const index_entry*>(data + header.index_offset);
+				index.assign(entries, entries + header.num_blocks);
+				return true;
+			}
+			// not closed properly, recover all complete blocks
+			std::cerr << "[MoonSniff] " << filename << " has no index, scanning blocks\n";
+			header.num_records = 0;
+			for (uint64_t off = header.header_size; off + header.block_size <= size; off += header.block_size) {
+				const block_header* hdr = reinterpret_cast<const block_header*>(data + off);
+				if (hdr->num_records == 0 || hdr->size > header.block_size) {
+					break;
+				}
+				index_entry e;
+				e.offset = off;
+				e.first_timestamp = hdr->timestamp;
+				e.first_record = header.num_records;
+				index.push_back(e);
+				header.num_records += hdr->num_records;
+			}
+			header.num_blocks = index.size();
+			header.first_timestamp = index.empty() ? 0 : index[0].first_timestamp;
+			return true;
+		}
+	};
+}
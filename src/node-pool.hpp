@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include <sys/mman.h>
+#include <tbb/spin_mutex.h>
+
+// memory is mapped in multiples of the huge page size
+#define NODE_POOL_CHUNK (2 * 1024 * 1024)
+// bytes a thread takes from the shared region at once
+#define NODE_POOL_REFILL (64 * 1024)
+// threads are mapped to caches by their index modulo this
+#define NODE_POOL_CACHES 64
+
+namespace hash_map {
+	/*
+	 * Fixed-size slots for the nodes of a map, carved from huge page backed memory.
+	 * Each thread allocates from and frees to its own cache, only taking a new part of the shared region needs the
+	 * global lock. Memory is returned to the system when the pool is destroyed.
+	 */
+	class node_pool {
+	public:
+		/*
+		 * @param slot_size bytes per node, multiple of 16
+		 * @param expected nodes to map and populate up front
+		 * @param hugetlb use explicit huge pages (MAP_HUGETLB) instead of transparent ones if available
+		 */
+		node_pool(size_t slot_size, size_t expected, bool hugetlb) : slot_size(slot_size), hugetlb(hugetlb) {
+			if (expected) {
+				add_region(expected * slot_size, true);
+			}
+		}
+
+		~node_pool() {
+			for (auto& c : chunks) {
+				munmap(c.first, c.second);
+			}
+		}
+
+		size_t get_slot_size() const {
+			return slot_size;
+		}
+
+		// mapped bytes
+		size_t bytes() const {
+			return mapped.load(std::memory_order_relaxed);
+		}
+
+		void* allocate() {
+			cache& c = local_cache();
+			tbb::spin_mutex::scoped_lock lock(c.mutex);
+			if (c.free) {
+				free_slot* s = c.free;
+				c.free = s->next;
+				return s;
+			}
+			if (c.bump + slot_size > c.end) {
+				refill(c);
+			}
+			void* p = c.bump;
+			c.bump += slot_size;
+			return p;
+		}
+
+		void deallocate(void* p) {
+			cache& c = local_cache();
+			tbb::spin_mutex::scoped_lock lock(c.mutex);
+			free_slot* s = static_cast<free_slot*>(p);
+			s->next = c.free;
+			c.free = s;
+		}
+
+	private:
+		struct free_slot {
+			free_slot* next;
+		};
+
+		// padded to a cache line, not aligned as the pool is heap allocated
+		struct cache {
+			tbb::spin_mutex mutex;
+			free_slot* free = nullptr;
+			uint8_t* bump = nullptr;
+			uint8_t* end = nullptr;
+			uint8_t pad[32];
+		};
+
+		size_t slot_size;
+		bool hugetlb;
+		cache caches[NODE_POOL_CACHES];
+		tbb::spin_mutex region_mutex;
+		uint8_t* region = nullptr;
+		uint8_t* region_end = nullptr;
+		std::vector<std::pair<void*, size_t>> chunks;
+		std::atomic<size_t> mapped{0};
+
+		static cache& thread_cache(cache* caches) {
+			static std::atomic<uint32_t> next_thread{0};
+			static thread_local uint32_t index = next_thread++ % NODE_POOL_CACHES;
+			return caches[index];
+		}
+
+		cache& local_cache() {
+			return thread_cache(caches);
+		}
+
+		void refill(cache& c) {
+			tbb::spin_mutex::scoped_lock lock(region_mutex);
+			size_t size = NODE_POOL_REFILL / slot_size * slot_size;
+			if (region + size > region_end) {
+				add_region(NODE_POOL_CHUNK, false);
+			}
+			c.bump = region;
+			c.end = region + size;
+			region += size;
+		}
+
+		// the rest of the previous region is dropped
+		void add_region(size_t size, bool populate) {
+			size = (size + NODE_POOL_CHUNK - 1) / NODE_POOL_CHUNK * NODE_POOL_CHUNK;
+			int flags = MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0);
+			void* mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+			if (hugetlb) {
+				mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+			}
+#endif
+			if (mem == MAP_FAILED) {
+				mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+				if (mem == MAP_FAILED) {
+					std::cerr << "[hashmap] could not map " << size << " bytes for the node pool\n";
+					throw std::bad_alloc();
+				}
+				madvise(mem, size, MADV_HUGEPAGE);
+			}
+			chunks.emplace_back(mem, size);
+			mapped += size;
+			region = static_cast<uint8_t*>(mem);
+			region_end = region + size;
+		}
+	};
+
+	/*
+	 * Allocator for the TBB maps: single objects up to the slot size come from the pool, everything else (and all
+	 * allocations without a pool) from operator new.
+	 */
+	template<typename T>
+	struct pool_allocator {
+		typedef T value_type;
+		typedef T* pointer;
+		typedef const T* const_pointer;
+		typedef T& reference;
+		typedef const T& const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+
+		template<typename U>
+		struct rebind {
+			typedef pool_allocator<U> other;
+		};
+
+		node_pool* pool = nullptr;
+
+		pool_allocator() = default;
+
+		explicit pool_allocator(node_pool* pool) : pool(pool) {
+		}
+
+		template<typename U>
+		pool_allocator(const pool_allocator<U>& other) : pool(other.pool) {
+		}
+
+		inline bool pooled(size_t n) const {
+			return pool && n == 1 && sizeof(T) <= pool->get_slot_size() && alignof(T) <= 16;
+		}
+
+		T* allocate(size_t n, const void* = nullptr) {
+			if (pooled(n)) {
+				return static_cast<T*>(pool->allocate());
+			}
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+
+		void deallocate(T* p, size_t n) {
+			if (pooled(n)) {
+				pool->deallocate(p);
+			} else {
+				::operator delete(p);
+			}
+		}
+
+		size_t max_size() const {
+			return size_t(-1) / sizeof(T);
+		}
+
+		template<typename U, typename... Args>
+		void construct(U* p, Args&&... args) {
+			::new((void*) p) U(std::forward<Args>(args)...);
+		}
+
+		template<typename U>
+		void destroy(U* p) {
+			p->~U();
+		}
+	};
+
+	template<typename T, typename U>
+	inline bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b) {
+		return a.pool == b.pool;
+	}
+
+	template<typename T, typename U>
+	inline bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b) {
+		return a.pool != b.pool;
+	}
+}
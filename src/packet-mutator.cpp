@@ -0,0 +1,114 @@
+#include <cstdint>
+#include <vector>
+#include <rte_config.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+#include "packet-mutator.hpp"
+
+// the number of packets is limited by the size of a bufArray
+#define MUTATOR_MAX_BURST 512
+
+/*
+ * Precomputed packets which are sent over and over again.
+ * The cycle holds a reference to each packet, sending one only takes another reference, so the packets are never
+ * written to or freed by the driver.
+ */
+struct packet_cycle {
+	std::vector<struct rte_mbuf*> pkts;
+	size_t next = 0;
+};
+
+extern "C" {
+	mutator::engine* mg_mutator_create(uint32_t mode, uint32_t skip, uint64_t seed) {
+		return new mutator::engine(static_cast<mutator::update_mode>(mode), skip, seed);
+	}
+
+	void mg_mutator_delete(mutator::engine* m) {
+		delete m;
+	}
+
+	uint32_t mg_mutator_add_field(mutator::engine* m, uint32_t offset, uint32_t width, bool big_endian) {
+		return m->add_field(offset, width, big_endian);
+	}
+
+	void mg_mutator_set_counter(mutator::engine* m, uint32_t field, int64_t start, int64_t step, uint64_t count, uint64_t index, int64_t value) {
+		m->set_counter(field, start, step, count, index, value);
+	}
+
+	void mg_mutator_set_random(mutator::engine* m, uint32_t field, int64_t min, int64_t max, int64_t value) {
+		m->set_random(field, min, max, value);
+	}
+
+	void mg_mutator_set_list(mutator::engine* m, uint32_t field, const int64_t* values, uint32_t n, bool random, uint64_t index, int64_t value) {
+		m->set_list(field, reinterpret_cast<const uint64_t*>(values), n, random, index, value);
+	}
+
+	bool mg_mutator_add_checksum(mutator::engine* m, uint32_t field, uint32_t offset, bool udp) {
+		return m->add_checksum(field, offset, udp);
+	}
+
+	// update the fields of n packets
+	void mg_mutator_apply(mutator::engine* m, struct rte_mbuf** bufs, uint32_t n) {
+		uint8_t* pkts[MUTATOR_MAX_BURST];
+		while (n) {
+			uint32_t batch = n < MUTATOR_MAX_BURST ? n : MUTATOR_MAX_BURST;
+			for (uint32_t i = 0; i < batch; i++) {
+				pkts[i] = rte_pktmbuf_mtod(bufs[i], uint8_t*);
+			}
+			m->apply(pkts, batch);
+			bufs += batch;
+			n -= batch;
+		}
+	}
+
+	uint64_t mg_mutator_period(mutator::engine* m, uint64_t max) {
+		return m->period(max);
+	}
+
+	// fill consecutive packets from the first one which must be filled already, see engine::generate()
+	void mg_mutator_generate(mutator::engine* m, struct rte_mbuf** bufs, uint32_t n) {
+		std::vector<uint8_t*> pkts(n);
+		for (uint32_t i = 0; i < n; i++) {
+			pkts[i] = rte_pktmbuf_mtod(bufs[i], uint8_t*);
+		}
+		m->generate(pkts.data(), n, n ? rte_pktmbuf_data_len(bufs[0]) : 0);
+	}
+
+	// takes over the references to the packets
+	packet_cycle* mg_cycle_create(struct rte_mbuf** bufs, uint32_t n) {
+		packet_cycle* cycle = new packet_cycle;
+		cycle->pkts.assign(bufs, bufs + n);
+		return cycle;
+	}
+
+	void mg_cycle_delete(packet_cycle* cycle) {
+		for (auto pkt : cycle->pkts) {
+			rte_pktmbuf_free(pkt);
+		}
+		delete cycle;
+	}
+
+	// fill bufs with the next n packets of the cycle, each with a new reference
+	void mg_cycle_next(packet_cycle* cycle, struct rte_mbuf** bufs, uint32_t n) {
+		size_t next = cycle->next;
+		size_t size = cycle->pkts.size();
+		for (uint32_t i = 0; i < n; i++) {
+			struct rte_mbuf* pkt = cycle->pkts[next];
+			rte_mbuf_refcnt_update(pkt, 1);
+			bufs[i] = pkt;
+			if (++next == size) {
+				next = 0;
+			}
+		}
+		cycle->next = next;
+	}
+
+	// bytes of the mempool of the packets
+	uint64_t mg_cycle_memory(packet_cycle* cycle) {
+		if (cycle->pkts.empty()) {
+			return 0;
+		}
+		struct rte_mempool* pool = cycle->pkts[0]->pool;
+		return (uint64_t) pool->size * (pool->header_size + pool->elt_size + pool->trailer_size);
+	}
+}
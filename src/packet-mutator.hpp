@@ -0,0 +1,411 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "arrival-process.hpp"
+
+/*
+ * Native replacement for the per-packet Lua updates of the dynamic fields of a flow (interface/flow/dynvars.lua).
+ * Each field is an integer of 1 to 8 bytes at a fixed offset in the packet with a generator for its values:
+ * counters, uniformly distributed random values, or lists of values which are cycled through or picked randomly.
+ * Checksums covering a field are updated incrementally (RFC 1624) when it is written.
+ * Random numbers are generated in chunks by the four-lane xoshiro256+ of the arrival processes.
+ */
+namespace mutator {
+	enum class generator : uint32_t {
+		counter = 0,
+		random = 1,
+		list = 2,
+		random_list = 3,
+	};
+
+	// same semantics as the modes of interface/options/mode.lua
+	enum class update_mode : uint32_t {
+		// update and write all fields
+		all = 0,
+		// update one field after another, write all fields
+		single = 1,
+		// update and write one field after another
+		alternating = 2,
+		// update a random field, write all fields
+		random = 3,
+		// update and write a random field
+		random_alt = 4,
+	};
+
+	struct checksum {
+		uint32_t offset;
+		// UDP checksums of 0 are not used and must not become 0
+		bool udp;
+	};
+
+	// where and how a field is written
+	struct target {
+		uint32_t offset;
+		uint32_t width;
+		bool big_endian;
+		// a field is covered by at most the IPv4 header and the L4 checksum
+		uint32_t num_checksums;
+		checksum checksums[2];
+	};
+
+	struct field {
+		target dst = {};
+		generator gen = generator::counter;
+		// counter: value = start + index * step, wrapping after count values (0: never)
+		uint64_t start = 0;
+		uint64_t step = 0;
+		uint64_t count = 0;
+		uint64_t index = 0;
+		// random: start + [0, span), 0 means the full 64 bit range
+		uint64_t span = 0;
+		std::vector<uint64_t> values;
+		uint64_t value = 0;
+	};
+
+	class engine {
+	public:
+		static constexpr uint32_t ring_size = 4096;
+		static constexpr uint32_t chunk_size = 256;
+
+		/*
+		 * skip: number of packets to leave unchanged at the start
+		 */
+		engine(update_mode mode, uint32_t skip, uint64_t seed) : mode(mode), skip(skip), rng(seed), head(0), tail(0) {
+		}
+
+		// returns the index of the field, width must be 1 to 8 bytes
+		uint32_t add_field(uint32_t offset, uint32_t width, bool big_endian) {
+			field f;
+			f.dst.offset = offset;
+			f.dst.width = width;
+			f.dst.big_endian = big_endian;
+			fields.push_back(f);
+			return fields.size() - 1;
+		}
+
+		/*
+		 * index: position of the next value, value: value currently in the packets
+		 */
+		void set_counter(uint32_t i, uint64_t start, uint64_t step, uint64_t count, uint64_t index, uint64_t value) {
+			field& f = fields[i];
+			f.gen = generator::counter;
+			f.start = start;
+			f.step = step;
+			f.count = count;
+			f.index = index;
+			f.value = value;
+		}
+
+		void set_random(uint32_t i, uint64_t min, uint64_t max, uint64_t value) {
+			field& f = fields[i];
+			f.gen = generator::random;
+			f.start = min;
+			f.span = max - min + 1;
+			f.value = value;
+		}
+
+		void set_list(uint32_t i, const uint64_t* values, uint32_t n, bool random, uint64_t index, uint64_t value) {
+			field& f = fields[i];
+			f.gen = random ? generator::random_list : generator::list;
+			f.values.assign(values, values + n);
+			f.index = n ? index % n : 0;
+			f.value = value;
+		}
+
+		bool add_checksum(uint32_t i, uint32_t offset, bool udp) {
+			target& t = fields[i].dst;
+			if (t.num_checksums == 2) {
+				return false;
+			}
+			t.checksums[t.num_checksums++] = {offset, udp};
+			return true;
+		}
+
+		/*
+		 * Update and write the fields of the packets in the order of the array, n must not exceed ring_size
+		 */
+		void apply(uint8_t** pkts, uint32_t n) {
+			uint32_t num = fields.size();
+			uint32_t skipped = std::min(skip, n);
+			skip -= skipped;
+			pkts += skipped;
+			n -= skipped;
+			if (num == 0 || n == 0) {
+				return;
+			}
+			if (mode == update_mode::all) {
+				// the fields are independent, go through the packets once per field to dispatch only once per batch
+				for (auto& f : fields) {
+					switch (f.gen) {
+					case generator::counter:
+						apply_field<generator::counter>(f, pkts, n);
+						break;
+					case generator::random:
+						apply_field<generator::random>(f, pkts, n);
+						break;
+					case generator::list:
+						apply_field<generator::list>(f, pkts, n);
+						break;
+					case generator::random_list:
+						apply_field<generator::random_list>(f, pkts, n);
+						break;
+					}
+				}
+				return;
+			}
+			for (uint32_t i = 0; i < n; i++) {
+				uint8_t* pkt = pkts[i];
+				// one random number for the field and one to pick it
+				prepare(2);
+				switch (mode) {
+				case update_mode::all:
+				case update_mode::single:
+				case update_mode::random:
+					update(fields[pick(num)]);
+					for (auto& f : fields) {
+						write(f.dst, f.value, pkt);
+					}
+					break;
+				case update_mode::alternating:
+				case update_mode::random_alt: {
+					field& f = fields[pick(num)];
+					update(f);
+					write(f.dst, f.value, pkt);
+					break;
+				}
+				}
+			}
+		}
+
+		/*
+		 * Number of packets after which the sequence of packets repeats, 0 if it does not or only after more than max.
+		 * Random values and modes never repeat, counters without a limit only after 2^64 packets.
+		 */
+		uint64_t period(uint64_t max) const {
+			if (mode == update_mode::random || mode == update_mode::random_alt || fields.empty()) {
+				return fields.empty() ? 1 : 0;
+			}
+			uint64_t p = 1;
+			for (auto& f : fields) {
+				uint64_t n = 0;
+				if (f.gen == generator::counter) {
+					n = f.count;
+				} else if (f.gen == generator::list) {
+					n = f.values.size();
+				}
+				if (n == 0) {
+					return 0;
+				}
+				p = p / gcd(p, n) * n;
+				if (p > max) {
+					return 0;
+				}
+			}
+			// all fields have gone through their values after each field was updated p times
+			if (mode != update_mode::all) {
+				p *= fields.size();
+			}
+			return p > max ? 0 : p;
+		}
+
+		/*
+		 * Write consecutive packets: each packet starts as a copy of its predecessor, so fields which are not written
+		 * in the alternating mode keep their values. The first packet must be filled already.
+		 */
+		void generate(uint8_t** pkts, uint32_t n, uint32_t length) {
+			for (uint32_t i = 0; i < n; i++) {
+				if (i > 0) {
+					memcpy(pkts[i], pkts[i - 1], length);
+				}
+				apply(pkts + i, 1);
+			}
+		}
+
+	private:
+		update_mode mode;
+		uint32_t skip;
+		uint32_t next_field = 0;
+		std::vector<field> fields;
+		arrival::xoshiro256p_x4 rng;
+		uint32_t head;
+		uint32_t tail;
+		uint64_t randoms[ring_size];
+
+		static uint64_t gcd(uint64_t a, uint64_t b) {
+			while (b) {
+				uint64_t t = a % b;
+				a = b;
+				b = t;
+			}
+			return a;
+		}
+
+		inline void prepare(uint32_t n) {
+			while (tail - head < n) {
+				uint64_t* out = randoms + (tail & (ring_size - 1));
+				for (uint32_t i = 0; i < chunk_size; i += arrival::xoshiro256p_x4::lanes) {
+					rng.next_u64(out + i);
+				}
+				tail += chunk_size;
+			}
+		}
+
+		// uniform in [0, span) from the upper bits (Lemire's multiply-shift), span 0 is the full range
+		inline uint64_t random(uint64_t span) {
+			uint64_t r = randoms[head++ & (ring_size - 1)];
+			return span ? (uint64_t) (((unsigned __int128) r * span) >> 64) : r;
+		}
+
+		inline uint32_t pick(uint32_t num) {
+			if (mode == update_mode::random || mode == update_mode::random_alt) {
+				return random(num);
+			}
+			uint32_t i = next_field;
+			next_field = i + 1 == num ? 0 : i + 1;
+			return i;
+		}
+
+		// next value of a field, index is the position in the counter or list
+		template<generator gen>
+		inline uint64_t next_value(const field& f, uint64_t& index) {
+			uint64_t value = 0;
+			switch (gen) {
+			case generator::counter:
+				value = f.start + index * f.step;
+				if (++index == f.count) {
+					index = 0;
+				}
+				break;
+			case generator::random:
+				value = f.start + random(f.span);
+				break;
+			case generator::list:
+				value = f.values[index];
+				if (++index == f.values.size()) {
+					index = 0;
+				}
+				break;
+			case generator::random_list:
+				value = f.values[random(f.values.size())];
+				break;
+			}
+			return value;
+		}
+
+		inline void update(field& f) {
+			switch (f.gen) {
+			case generator::counter:
+				f.value = next_value<generator::counter>(f, f.index);
+				break;
+			case generator::random:
+				f.value = next_value<generator::random>(f, f.index);
+				break;
+			case generator::list:
+				f.value = next_value<generator::list>(f, f.index);
+				break;
+			case generator::random_list:
+				f.value = next_value<generator::random_list>(f, f.index);
+				break;
+			}
+		}
+
+		template<generator gen>
+		void apply_field(field& f, uint8_t** pkts, uint32_t n) {
+			if (gen == generator::random || gen == generator::random_list) {
+				prepare(n);
+			}
+			// the state is kept in locals, the writes to the packets could alias the members of f
+			const target dst = f.dst;
+			uint64_t index = f.index;
+			uint64_t value = f.value;
+			for (uint32_t i = 0; i < n; i++) {
+				value = next_value<gen>(f, index);
+				write(dst, value, pkts[i]);
+			}
+			f.index = index;
+			f.value = value;
+		}
+
+		/*
+		 * One's complement sum of the 16 bit words of a field in host byte order, which gives the same checksum
+		 * (RFC 1071). Checksummed data starts at even offsets, at odd offsets the bytes of the words are swapped.
+		 */
+		static inline uint32_t sum16(uint64_t raw, uint32_t offset) {
+			uint32_t sum = fold((raw & 0xFFFF) + ((raw >> 16) & 0xFFFF) + ((raw >> 32) & 0xFFFF) + (raw >> 48));
+			return offset & 1 ? ((sum & 0xFF) << 8) | (sum >> 8) : sum;
+		}
+
+		static inline uint32_t fold(uint32_t sum) {
+			sum = (sum & 0xFFFF) + (sum >> 16);
+			return (sum & 0xFFFF) + (sum >> 16);
+		}
+
+		static inline uint64_t read_bytes(const uint8_t* src, uint32_t width) {
+			uint64_t raw = 0;
+			switch (width) {
+			case 2:
+				memcpy(&raw, src, 2);
+				break;
+			case 4:
+				memcpy(&raw, src, 4);
+				break;
+			default:
+				memcpy(&raw, src, width);
+				break;
+			}
+			return raw;
+		}
+
+		static inline void write_bytes(uint8_t* dst, uint64_t raw, uint32_t width) {
+			switch (width) {
+			case 2:
+				memcpy(dst, &raw, 2);
+				break;
+			case 4:
+				memcpy(dst, &raw, 4);
+				break;
+			case 6:
+				memcpy(dst, &raw, 4);
+				memcpy(dst + 4, reinterpret_cast<uint8_t*>(&raw) + 4, 2);
+				break;
+			case 8:
+				memcpy(dst, &raw, 8);
+				break;
+			default:
+				memcpy(dst, &raw, width);
+				break;
+			}
+		}
+
+		static inline void write(const target& t, uint64_t value, uint8_t* pkt) {
+			uint8_t* dst = pkt + t.offset;
+			// little endian host: the lower width bytes of raw are the bytes in the packet
+			uint64_t raw = t.big_endian ? __builtin_bswap64(value) >> (64 - 8 * t.width) : value;
+			if (!t.num_checksums) {
+				write_bytes(dst, raw, t.width);
+				return;
+			}
+			uint32_t old_sum = sum16(read_bytes(dst, t.width), t.offset);
+			uint32_t new_sum = sum16(raw, t.offset);
+			write_bytes(dst, raw, t.width);
+			for (uint32_t i = 0; i < t.num_checksums; i++) {
+				const checksum& c = t.checksums[i];
+				uint16_t hc;
+				memcpy(&hc, pkt + c.offset, 2);
+				if (c.udp && hc == 0) {
+					continue;
+				}
+				// HC' = ~(~HC + ~m + m')
+				hc = ~fold((uint16_t) ~hc + (~old_sum & 0xFFFF) + new_sum);
+				if (c.udp && hc == 0) {
+					hc = 0xFFFF;
+				}
+				memcpy(pkt + c.offset, &hc, 2);
+			}
+		}
+	};
+}
@@ -7,12 +7,29 @@
 #include <rte_mempool.h>
 #include <rte_ether.h>
 #include <rte_cycles.h>
-#include <random>
 #include <atomic>
 #include <iostream>
 #include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <memory>
+#include <cstdio>
+#include <ctime>
 #include "ring.h"
 #include "lifecycle.hpp"
+#include "arrival-process.hpp"
+
+// CRC-invalid filler packets, see crc-rate-limiter.c
+extern "C" {
+	uint16_t moongen_get_gap_fillers(struct rte_mempool* pool, uint32_t gap, uint32_t min_pkt_size, struct rte_mbuf** pkts, uint16_t max_pkts);
+	void moongen_add_bad_pkts_sent(uint8_t port_id, uint16_t queue_id, uint32_t num_pkts, uint32_t num_bytes);
+	uint64_t moongen_get_bad_pkts_sent(uint8_t port_id);
+	uint64_t moongen_get_bad_bytes_sent(uint8_t port_id);
+	uint64_t moongen_get_bad_pkts_sent_queue(uint8_t port_id, uint16_t queue_id);
+	uint64_t moongen_get_bad_bytes_sent_queue(uint8_t port_id, uint16_t queue_id);
+}
 
 // required for gcc 4.7 for some reason
 // ???
@@ -26,10 +43,46 @@
 // FIXME: duplicate code (needed for a paper, so the usual quick & dirty hacks)
 namespace rate_limiter {
 	constexpr int batch_size = 64;
+	// bucket 0: on time, bucket i: [2^(i-1), 2^i) TSC cycles late, the last bucket also holds everything above
+	constexpr int lateness_buckets = 32;
+
+	/*
+	 * Scheduling errors of a limiter thread, collected locally and published to the limiter_control once per batch
+	 */
+	struct sched_stats {
+		uint64_t lateness[lateness_buckets] = {};
+		uint64_t max_lag = 0;
+		uint64_t tx_zero = 0;
+		uint64_t resets = 0;
+
+		inline void record(uint64_t scheduled, uint64_t actual) {
+			uint64_t lag = actual > scheduled ? actual - scheduled : 0;
+			int bucket = lag ? std::min(64 - __builtin_clzll(lag), lateness_buckets - 1) : 0;
+			lateness[bucket]++;
+			max_lag = std::max(max_lag, lag);
+		}
+	};
 
 	struct limiter_control {
 		std::atomic<uint64_t> count = {0};
 		std::atomic<uint64_t> stop = {0};
+		// burst mode only: number of sub-bursts handed to the NIC and
+		// how far packets departed ahead of their schedule (in TSC cycles)
+		std::atomic<uint64_t> bursts = {0};
+		std::atomic<uint64_t> early_cycles = {0};
+		std::atomic<uint64_t> max_early_cycles = {0};
+		// scheduling errors: number of 10 ms rate control restarts, tx_burst calls that returned 0,
+		// and how late packets were passed to the NIC (in TSC cycles)
+		std::atomic<uint64_t> resets = {0};
+		std::atomic<uint64_t> tx_zero = {0};
+		std::atomic<uint64_t> max_lag_cycles = {0};
+		std::atomic<uint64_t> lateness[lateness_buckets];
+
+		limiter_control() {
+			for (auto& bucket : lateness) {
+				bucket.store(0, std::memory_order_relaxed);
+			}
+		}
 
 		inline bool running() {
 			return libmoon::is_running(0) && !stop.load(std::memory_order_relaxed);
@@ -38,9 +91,235 @@ namespace rate_limiter {
 		inline void count_packets(uint64_t n) {
 			count.fetch_add(n, std::memory_order_relaxed);
 		};
+
+		inline void count_bursts(uint64_t n, uint64_t early, uint64_t max_early) {
+			bursts.fetch_add(n, std::memory_order_relaxed);
+			early_cycles.fetch_add(early, std::memory_order_relaxed);
+			// single writer, no need for a CAS loop
+			if (max_early > max_early_cycles.load(std::memory_order_relaxed)) {
+				max_early_cycles.store(max_early, std::memory_order_relaxed);
+			}
+		};
+
+		// there is only a single writer, so plain load/store pairs suffice and readers never block it
+		inline void publish(sched_stats& stats) {
+			for (int i = 0; i < lateness_buckets; i++) {
+				if (stats.lateness[i]) {
+					lateness[i].store(lateness[i].load(std::memory_order_relaxed) + stats.lateness[i], std::memory_order_relaxed);
+					stats.lateness[i] = 0;
+				}
+			}
+			if (stats.max_lag > max_lag_cycles.load(std::memory_order_relaxed)) {
+				max_lag_cycles.store(stats.max_lag, std::memory_order_relaxed);
+			}
+			if (stats.tx_zero) {
+				tx_zero.store(tx_zero.load(std::memory_order_relaxed) + stats.tx_zero, std::memory_order_relaxed);
+				stats.tx_zero = 0;
+			}
+			if (stats.resets) {
+				resets.store(resets.load(std::memory_order_relaxed) + stats.resets, std::memory_order_relaxed);
+				stats.resets = 0;
+			}
+		};
+	};
+	static_assert(sizeof(limiter_control) == 64 + 8 * lateness_buckets, "struct size mismatch");
+
+	/*
+	 * Configuration of the burst mode of the cbr and poisson limiters
+	 * threshold_ns: packets scheduled within this time after the first packet of a sub-burst are sent with it
+	 * min_filler_size: smallest CRC-invalid filler packet in bytes on the wire
+	 * filler_pool: mempool for filler packets, gaps inside sub-bursts are not filled if this is NULL
+	 */
+	struct limiter_burst_config {
+		uint32_t threshold_ns;
+		uint32_t min_filler_size;
+		struct rte_mempool* filler_pool;
+	};
+	static_assert(sizeof(limiter_burst_config) == 16, "struct size mismatch");
+
+	// max number of packets (including fillers) passed to a single tx_burst call in burst mode
+	constexpr int max_sub_burst = 256;
+
+	struct burst_params {
+		uint64_t threshold_cycles;
+		double cycles_per_byte;
+		uint32_t min_filler_size;
+		struct rte_mempool* filler_pool;
+
+		burst_params(const limiter_burst_config* cfg, uint32_t link_speed) {
+			uint64_t tsc_hz = rte_get_tsc_hz();
+			threshold_cycles = (uint64_t) (cfg->threshold_ns * (tsc_hz / 1000000000.0));
+			// link_speed is in Mbit/s, bytes on the wire to TSC cycles
+			cycles_per_byte = link_speed ? tsc_hz * 8.0 / (link_speed * 1000000.0) : 0;
+			min_filler_size = cfg->min_filler_size;
+			filler_pool = link_speed ? cfg->filler_pool : nullptr;
+		}
+	};
+
+	/*
+	 * Inter-departure times of the stochastic limiters.
+	 * Inter-packet gaps are drawn from the arrival process and scaled so that the average
+	 * inter-departure time matches target, IDTs < packet_time are physically impossible.
+	 */
+	struct stochastic_schedule {
+		double target_cycles;
+		double cycles_per_byte;
+		arrival::process* proc;
+
+		stochastic_schedule() = default;
+
+		stochastic_schedule(uint32_t target, uint32_t link_speed, arrival::process* proc) : proc(proc) {
+			uint64_t tsc_hz = rte_get_tsc_hz();
+			target_cycles = target * (tsc_hz / 1000000000.0);
+			cycles_per_byte = tsc_hz * 8.0 / (link_speed * 1000000.0);
+		}
+
+		// cycles from the departure of pkt to the next departure, requires a prior proc->prepare()
+		inline uint64_t next(const struct rte_mbuf* pkt) {
+			// 24 bytes CRC, preamble, SFD, and IFG
+			double pkt_time = (pkt->pkt_len + 24) * cycles_per_byte;
+			double avg = target_cycles - pkt_time;
+			double delay = proc->next();
+			return (uint64_t) (pkt_time + (avg <= 0 ? 0 : avg * delay));
+		}
 	};
-	static_assert(sizeof(limiter_control) == 16, "struct size mismatch");
 	
+	struct limiter_feedback_config {
+		// correction interval
+		uint32_t interval_ms;
+		// fraction of the measured relative rate error corrected per interval (0..1]
+		float gain;
+		// CSV trace of all corrections, empty to disable
+		char trace_file[256];
+	};
+	static_assert(sizeof(limiter_feedback_config) == 264, "struct size mismatch");
+
+	/*
+	 * Closed-loop rate correction based on the TX counters of the NIC.
+	 * The counters are read between batches, i.e., outside of the timing-critical loop, and the achieved rate is
+	 * compared against CLOCK_MONOTONIC_RAW instead of the TSC so that TSC frequency errors are corrected as well.
+	 * Ports with a single tx queue use the port counters, the other queues of a port would be included in them
+	 * otherwise, so ports with multiple tx queues use the per-queue counters. CRC-invalid fillers are not counted.
+	 * Intervals during which the limiter ran out of packets are not corrected as the limiter did not limit the rate.
+	 */
+	class rate_feedback {
+	public:
+		// factor applied to the nominal inter-departure time
+		double factor = 1.0;
+
+		rate_feedback(const limiter_feedback_config* cfg, uint8_t device, uint16_t queue, uint32_t target) : device(device), queue(queue) {
+			if (!cfg || !target || !cfg->interval_ms) {
+				return;
+			}
+			struct rte_eth_dev_info info;
+			rte_eth_dev_info_get(device, &info);
+			per_queue = info.nb_tx_queues > 1;
+			if (per_queue && queue >= RTE_ETHDEV_QUEUE_STAT_CNTRS) {
+				std::cerr << "[rate_feedback] no per-queue counters for tx queue " << queue << ", rate feedback disabled" << std::endl;
+				return;
+			}
+			enabled = true;
+			interval_cycles = (uint64_t) (cfg->interval_ms * (rte_get_tsc_hz() / 1000.0));
+			gain = std::min(std::max((double) cfg->gain, 0.01), 1.0);
+			target_pps = 1000000000.0 / target;
+			if (cfg->trace_file[0]) {
+				trace = fopen(cfg->trace_file, "w");
+				if (trace) {
+					fprintf(trace, "time,packets,bytes,rate_pps,target_pps,factor,state\n");
+				} else {
+					std::cerr << "[rate_feedback] could not open trace file " << cfg->trace_file << std::endl;
+				}
+			}
+		}
+
+		~rate_feedback() {
+			if (trace) {
+				fclose(trace);
+			}
+		}
+
+		rate_feedback(const rate_feedback&) = delete;
+		rate_feedback& operator=(const rate_feedback&) = delete;
+
+		// call once per dequeue attempt, returns true if the factor changed
+		inline bool poll(uint64_t cur, bool starved) {
+			if (!enabled) {
+				return false;
+			}
+			this->starved |= starved;
+			if (cur < next_update) {
+				return false;
+			}
+			next_update = cur + interval_cycles;
+			return update();
+		}
+
+	private:
+		uint8_t device;
+		uint16_t queue;
+		bool enabled = false;
+		bool per_queue = false;
+		bool initialized = false;
+		bool starved = false;
+		uint64_t interval_cycles = 0;
+		uint64_t next_update = 0;
+		double gain = 0;
+		double target_pps = 0;
+		double start_time = 0;
+		double last_time = 0;
+		uint64_t last_pkts = 0, last_bytes = 0;
+		uint64_t last_filler_pkts = 0, last_filler_bytes = 0;
+		FILE* trace = nullptr;
+
+		static double now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+			return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+		}
+
+		bool update() {
+			struct rte_eth_stats stats;
+			if (rte_eth_stats_get(device, &stats)) {
+				return false;
+			}
+			double time = now();
+			uint64_t total_pkts = per_queue ? stats.q_opackets[queue] : stats.opackets;
+			uint64_t total_bytes = per_queue ? stats.q_obytes[queue] : stats.obytes;
+			uint64_t filler_pkts = per_queue ? moongen_get_bad_pkts_sent_queue(device, queue) : moongen_get_bad_pkts_sent(device);
+			uint64_t filler_bytes = per_queue ? moongen_get_bad_bytes_sent_queue(device, queue) : moongen_get_bad_bytes_sent(device);
+			bool was_starved = starved;
+			starved = false;
+			if (!initialized) {
+				initialized = true;
+				start_time = time;
+			} else {
+				// fillers are counted when they are passed to the NIC, they can show up in its counters an interval later
+				uint64_t pkts = std::max<int64_t>((total_pkts - last_pkts) - (filler_pkts - last_filler_pkts), 0);
+				uint64_t bytes = std::max<int64_t>((total_bytes - last_bytes) - (filler_bytes - last_filler_bytes), 0);
+				double rate = pkts / (time - last_time);
+				const char* state = "corrected";
+				if (was_starved) {
+					state = "starved";
+				} else if (!pkts) {
+					state = "no_tx";
+				} else {
+					// sending too fast means the inter-departure time must grow
+					double error = rate / target_pps - 1;
+					factor = std::min(std::max(factor * (1 + gain * error), 0.5), 2.0);
+				}
+				if (trace) {
+					fprintf(trace, "%.6f,%lu,%lu,%.1f,%.1f,%.9f,%s\n", time - start_time, (unsigned long) pkts, (unsigned long) bytes, rate, target_pps, factor, state);
+				}
+			}
+			last_time = time;
+			last_pkts = total_pkts;
+			last_bytes = total_bytes;
+			last_filler_pkts = filler_pkts;
+			last_filler_bytes = filler_bytes;
+			return !was_starved;
+		}
+	};
+
 	/*
 	 * Arbitrary time software rate control main
 	 * link_speed: DPDK link speed is expressed in Mbit/s
@@ -52,6 +331,7 @@ namespace rate_limiter {
 		double link_bps = link_speed * 1000000.0;
 		uint64_t cur = rte_get_tsc_cycles();
 		uint64_t next_send = cur;
+		sched_stats stats;
 		while (libmoon::is_running(0)) {
 			int cur_batch_size = batch_size;
 			int n = ring_dequeue(ring, reinterpret_cast<void**>(bufs), cur_batch_size);
@@ -65,13 +345,16 @@ namespace rate_limiter {
 					id_cycles = ((uint64_t) bufs[i]->udata64 * 8 / link_bps) * tsc_hz;
 					next_send += id_cycles;
 					while ((cur = rte_get_tsc_cycles()) < next_send);
+					stats.record(next_send, cur);
 					while (rte_eth_tx_burst(device, queue, bufs + i, 1) == 0) {
+						stats.tx_zero++;
 						if (!ctl->running()) {
 							return;
 						}
 					}
 				}
 				ctl->count_packets(n);
+				ctl->publish(stats);
 			} else if (!ctl->running()) {
 				return;
 			}
@@ -79,59 +362,74 @@ namespace rate_limiter {
 		return;
 	}
 	
-	static inline void main_loop_poisson(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, limiter_control* ctl) {
+	static inline void main_loop_stochastic(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, arrival::process* proc, const limiter_feedback_config* fb_cfg, limiter_control* ctl) {
 		uint64_t tsc_hz = rte_get_tsc_hz();
-		// control IPGs instead of IDT as IDTs < packet_time are physically impossible
-		std::default_random_engine rand;
+		stochastic_schedule schedule(target, link_speed, proc);
+		double target_cycles = schedule.target_cycles;
+		rate_feedback feedback(fb_cfg, device, queue, target);
 		uint64_t next_send = 0;
+		sched_stats stats;
 		struct rte_mbuf* bufs[batch_size];
 		while (libmoon::is_running(0)) {
 			int n = ring_dequeue(ring, reinterpret_cast<void**>(bufs), batch_size);
 			uint64_t cur = rte_get_tsc_cycles();
 			// nothing sent for 10 ms, restart rate control
 			if (((int64_t) cur - (int64_t) next_send) > (int64_t) tsc_hz / 100) {
+				// the very first batch always restarts, that is not an error
+				stats.resets += next_send != 0;
 				next_send = cur;
 			}
+			if (feedback.poll(cur, !n)) {
+				schedule.target_cycles = target_cycles * feedback.factor;
+			}
 			if (n) {
+				proc->prepare(n);
 				for (int i = 0; i < n; i++) {
-					uint64_t pkt_time = (bufs[i]->pkt_len + 24) * 8 / (link_speed / 1000);
-					// ns to cycles
-					pkt_time *= (double) tsc_hz / 1000000000.0;
-					int64_t avg = (int64_t) (tsc_hz / (1000000000.0 / target) - pkt_time);
 					while ((cur = rte_get_tsc_cycles()) < next_send);
-					std::exponential_distribution<double> distribution(1.0 / avg);
-					double delay = (avg <= 0) ? 0 : distribution(rand);
-					next_send += pkt_time + delay;
+					stats.record(next_send, cur);
+					next_send += schedule.next(bufs[i]);
 					while (rte_eth_tx_burst(device, queue, bufs + i, 1) == 0) {
+						stats.tx_zero++;
 						if (!ctl->running()) {
 							return;
 						}
 					}
 				}
 				ctl->count_packets(n);
+				ctl->publish(stats);
 			} else if (!ctl->running()) {
 				return;
 			}
 		}
 	}
 
-	static inline void main_loop_cbr(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, limiter_control* ctl) {
+	static inline void main_loop_cbr(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, const limiter_feedback_config* fb_cfg, limiter_control* ctl) {
 		uint64_t tsc_hz = rte_get_tsc_hz();
-		uint64_t id_cycles = (uint64_t) (target / (1000000000.0 / ((double) tsc_hz)));
+		double target_cycles = target / (1000000000.0 / ((double) tsc_hz));
+		uint64_t id_cycles = (uint64_t) target_cycles;
+		rate_feedback feedback(fb_cfg, device, queue, target);
 		uint64_t next_send = 0;
+		sched_stats stats;
 		struct rte_mbuf* bufs[batch_size];
 		while (libmoon::is_running(0)) {
 			int n = ring_dequeue(ring, reinterpret_cast<void**>(bufs), batch_size);
 			uint64_t cur = rte_get_tsc_cycles();
 			// nothing sent for 10 ms, restart rate control
 			if (((int64_t) cur - (int64_t) next_send) > (int64_t) tsc_hz / 100) {
+				// the very first batch always restarts, that is not an error
+				stats.resets += next_send != 0;
 				next_send = cur;
 			}
+			if (feedback.poll(cur, !n)) {
+				id_cycles = (uint64_t) (target_cycles * feedback.factor);
+			}
 			if (n) {
 				for (int i = 0; i < n; i++) {
 					while ((cur = rte_get_tsc_cycles()) < next_send);
+					stats.record(next_send, cur);
 					next_send += id_cycles;
 					while (rte_eth_tx_burst(device, queue, bufs + i, 1) == 0) {
+						stats.tx_zero++;
 						// mellanox nics like to not accept packets when stopping for... reasons
 						if (!ctl->running()) {
 							return;
@@ -139,24 +437,315 @@ namespace rate_limiter {
 					}
 				}
 				ctl->count_packets(n);
+				ctl->publish(stats);
 			} else if (!ctl->running()) {
 				return;
 			}
 		}
 	}
+
+	/*
+	 * Send a batch of packets with precomputed departure times (TSC cycles).
+	 * Packets scheduled close to the first packet of a sub-burst are sent with a single tx_burst call,
+	 * the gaps between them are filled with CRC-invalid packets if a filler pool is available.
+	 * Packets that still leave ahead of their schedule are accounted as lost precision,
+	 * the lateness of a sub-burst is the lateness of its first packet.
+	 * Returns false if the limiter was stopped while sending.
+	 */
+	static inline bool send_scheduled(uint8_t device, uint16_t queue, struct rte_mbuf** bufs, const uint64_t* departure, int n, const burst_params& p, sched_stats& stats, limiter_control* ctl) {
+		struct rte_mbuf* burst[max_sub_burst];
+		uint64_t num_bursts = 0, early_sum = 0, early_max = 0;
+		uint32_t num_fillers = 0, filler_bytes = 0;
+		int i = 0;
+		while (i < n) {
+			int j = i + 1;
+			while (j < n && departure[j] - departure[i] <= p.threshold_cycles) {
+				j++;
+			}
+			// wire keeps track of when the next packet of this sub-burst starts on the wire
+			double wire = departure[i];
+			int cnt = 0;
+			for (int k = i; k < j; k++) {
+				if (k > i && p.filler_pool && departure[k] > wire) {
+					uint32_t gap = (uint32_t) ((departure[k] - wire) / p.cycles_per_byte);
+					// leave room for the remaining packets of this sub-burst
+					uint16_t num = moongen_get_gap_fillers(p.filler_pool, gap, p.min_filler_size, burst + cnt, max_sub_burst - cnt - (j - k));
+					for (int f = cnt; f < cnt + num; f++) {
+						// fillers carry no CRC, 20 bytes preamble, SFD, and IFG
+						wire += (burst[f]->pkt_len + 20) * p.cycles_per_byte;
+						filler_bytes += burst[f]->pkt_len;
+					}
+					cnt += num;
+					num_fillers += num;
+				}
+				if (departure[k] > wire) {
+					uint64_t early = departure[k] - (uint64_t) wire;
+					early_sum += early;
+					early_max = std::max(early_max, early);
+				}
+				burst[cnt++] = bufs[k];
+				// 24 bytes CRC, preamble, SFD, and IFG
+				wire += (bufs[k]->pkt_len + 24) * p.cycles_per_byte;
+			}
+			uint64_t cur;
+			while ((cur = rte_get_tsc_cycles()) < departure[i]);
+			stats.record(departure[i], cur);
+			int sent = 0;
+			while ((sent += rte_eth_tx_burst(device, queue, burst + sent, cnt - sent)) < cnt) {
+				stats.tx_zero++;
+				if (!ctl->running()) {
+					return false;
+				}
+			}
+			num_bursts++;
+			i = j;
+		}
+		if (num_fillers) {
+			moongen_add_bad_pkts_sent(device, queue, num_fillers, filler_bytes);
+		}
+		ctl->count_bursts(num_bursts, early_sum, early_max);
+		return true;
+	}
+
+	static inline void main_loop_cbr_burst(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, const limiter_burst_config* cfg, const limiter_feedback_config* fb_cfg, limiter_control* ctl) {
+		uint64_t tsc_hz = rte_get_tsc_hz();
+		double target_cycles = target / (1000000000.0 / ((double) tsc_hz));
+		uint64_t id_cycles = (uint64_t) target_cycles;
+		rate_feedback feedback(fb_cfg, device, queue, target);
+		burst_params params(cfg, link_speed);
+		uint64_t next_send = 0;
+		sched_stats stats;
+		struct rte_mbuf* bufs[batch_size];
+		uint64_t departure[batch_size];
+		while (libmoon::is_running(0)) {
+			int n = ring_dequeue(ring, reinterpret_cast<void**>(bufs), batch_size);
+			uint64_t cur = rte_get_tsc_cycles();
+			// nothing sent for 10 ms, restart rate control
+			if (((int64_t) cur - (int64_t) next_send) > (int64_t) tsc_hz / 100) {
+				// the very first batch always restarts, that is not an error
+				stats.resets += next_send != 0;
+				next_send = cur;
+			}
+			if (feedback.poll(cur, !n)) {
+				id_cycles = (uint64_t) (target_cycles * feedback.factor);
+			}
+			if (n) {
+				for (int i = 0; i < n; i++) {
+					departure[i] = next_send;
+					next_send += id_cycles;
+				}
+				if (!send_scheduled(device, queue, bufs, departure, n, params, stats, ctl)) {
+					return;
+				}
+				ctl->count_packets(n);
+				ctl->publish(stats);
+			} else if (!ctl->running()) {
+				return;
+			}
+		}
+	}
+
+	static inline void main_loop_stochastic_burst(struct rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, arrival::process* proc, const limiter_burst_config* cfg, const limiter_feedback_config* fb_cfg, limiter_control* ctl) {
+		uint64_t tsc_hz = rte_get_tsc_hz();
+		stochastic_schedule schedule(target, link_speed, proc);
+		double target_cycles = schedule.target_cycles;
+		rate_feedback feedback(fb_cfg, device, queue, target);
+		burst_params params(cfg, link_speed);
+		uint64_t next_send = 0;
+		sched_stats stats;
+		struct rte_mbuf* bufs[batch_size];
+		uint64_t departure[batch_size];
+		while (libmoon::is_running(0)) {
+			int n = ring_dequeue(ring, reinterpret_cast<void**>(bufs), batch_size);
+			uint64_t cur = rte_get_tsc_cycles();
+			// nothing sent for 10 ms, restart rate control
+			if (((int64_t) cur - (int64_t) next_send) > (int64_t) tsc_hz / 100) {
+				// the very first batch always restarts, that is not an error
+				stats.resets += next_send != 0;
+				next_send = cur;
+			}
+			if (feedback.poll(cur, !n)) {
+				schedule.target_cycles = target_cycles * feedback.factor;
+			}
+			if (n) {
+				proc->prepare(n);
+				for (int i = 0; i < n; i++) {
+					departure[i] = next_send;
+					next_send += schedule.next(bufs[i]);
+				}
+				if (!send_scheduled(device, queue, bufs, departure, n, params, stats, ctl)) {
+					return;
+				}
+				ctl->count_packets(n);
+				ctl->publish(stats);
+			} else if (!ctl->running()) {
+				return;
+			}
+		}
+	}
+
+	enum class mux_mode : uint8_t {
+		cbr = 0,
+		stochastic = 1,
+	};
+
+	/*
+	 * A (ring, port, queue) served by a shared limiter thread
+	 */
+	struct mux_entry {
+		struct rte_ring* ring;
+		uint8_t device;
+		uint16_t queue;
+		mux_mode mode;
+		limiter_control* ctl;
+		sched_stats stats;
+		uint64_t id_cycles;
+		uint64_t next_send;
+		arrival::process* proc;
+		// the process is owned by the mux, a poisson process is created if none is passed
+		std::unique_ptr<arrival::process> own_proc;
+		stochastic_schedule schedule;
+		// currently dequeued batch, bufs[i] is the next packet to send
+		int n;
+		int i;
+		struct rte_mbuf* bufs[batch_size];
+	};
+
+	/*
+	 * Multiplexes many cbr/poisson rate limiters onto a single thread.
+	 * The next departures of all queues are kept in a min-heap, the thread always serves the queue that is due first.
+	 */
+	struct limiter_mux {
+		std::vector<mux_entry> entries;
+	};
+
+	// advance the schedule of a multiplexed queue after sending pkt
+	static inline void mux_advance(mux_entry& e, struct rte_mbuf* pkt) {
+		if (e.mode == mux_mode::cbr) {
+			e.next_send += e.id_cycles;
+		} else {
+			e.next_send += e.schedule.next(pkt);
+		}
+	}
+
+	static inline void main_loop_mux(limiter_mux* mux) {
+		typedef std::pair<uint64_t, size_t> departure;
+		uint64_t tsc_hz = rte_get_tsc_hz();
+		std::priority_queue<departure, std::vector<departure>, std::greater<departure>> heap;
+		for (size_t idx = 0; idx < mux->entries.size(); idx++) {
+			mux->entries[idx].next_send = 0;
+			mux->entries[idx].n = mux->entries[idx].i = 0;
+			heap.push(departure(0, idx));
+		}
+		while (libmoon::is_running(0) && !heap.empty()) {
+			departure next = heap.top();
+			heap.pop();
+			mux_entry& e = mux->entries[next.second];
+			uint64_t cur = rte_get_tsc_cycles();
+			if (e.i == e.n) {
+				e.i = 0;
+				e.n = ring_dequeue(e.ring, reinterpret_cast<void**>(e.bufs), batch_size);
+				if (!e.n) {
+					// idle queues are polled again once all queues that are due have been served
+					if (e.ctl->running()) {
+						heap.push(departure(cur, next.second));
+					}
+					continue;
+				}
+				// nothing sent for 10 ms, restart rate control
+				if (((int64_t) cur - (int64_t) e.next_send) > (int64_t) tsc_hz / 100) {
+					e.stats.resets += e.next_send != 0;
+					e.next_send = cur;
+				}
+				if (e.proc) {
+					e.proc->prepare(e.n);
+				}
+				heap.push(departure(e.next_send, next.second));
+				continue;
+			}
+			while ((cur = rte_get_tsc_cycles()) < e.next_send);
+			if (rte_eth_tx_burst(e.device, e.queue, e.bufs + e.i, 1) == 0) {
+				e.stats.tx_zero++;
+				// don't block the other queues, retry once they have been served
+				if (e.ctl->running()) {
+					heap.push(departure(e.next_send, next.second));
+				} else {
+					for (int i = e.i; i < e.n; i++) {
+						rte_pktmbuf_free(e.bufs[i]);
+					}
+				}
+				continue;
+			}
+			// retried packets are only accounted once they have been sent
+			e.stats.record(e.next_send, cur);
+			mux_advance(e, e.bufs[e.i]);
+			if (++e.i == e.n) {
+				e.ctl->count_packets(e.n);
+				e.ctl->publish(e.stats);
+			}
+			heap.push(departure(e.next_send, next.second));
+		}
+	}
 }
 
 extern "C" {
-	void mg_rate_limiter_cbr_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, rate_limiter::limiter_control* ctl) {
-		rate_limiter::main_loop_cbr(ring, device, queue, target, ctl);
+	// fb: optional closed-loop rate correction, may be null
+	void mg_rate_limiter_cbr_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, rate_limiter::limiter_feedback_config* fb, rate_limiter::limiter_control* ctl) {
+		rate_limiter::main_loop_cbr(ring, device, queue, target, fb, ctl);
 	}
 
-	void mg_rate_limiter_poisson_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, rate_limiter::limiter_control* ctl) {
-		rate_limiter::main_loop_poisson(ring, device, queue, target, link_speed, ctl);
+	void mg_rate_limiter_poisson_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, rate_limiter::limiter_feedback_config* fb, rate_limiter::limiter_control* ctl) {
+		arrival::process proc(arrival::distribution::exponential, 0, 0);
+		rate_limiter::main_loop_stochastic(ring, device, queue, target, link_speed, &proc, fb, ctl);
+	}
+
+	void mg_rate_limiter_pattern_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, arrival::process* proc, rate_limiter::limiter_feedback_config* fb, rate_limiter::limiter_control* ctl) {
+		rate_limiter::main_loop_stochastic(ring, device, queue, target, link_speed, proc, fb, ctl);
 	}
 
 	void mg_rate_limiter_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t link_speed, rate_limiter::limiter_control* ctl) {
 		rate_limiter::main_loop(ring, device, queue, link_speed, ctl);
 	}
+
+	void mg_rate_limiter_cbr_burst_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, rate_limiter::limiter_burst_config* cfg, rate_limiter::limiter_feedback_config* fb, rate_limiter::limiter_control* ctl) {
+		rate_limiter::main_loop_cbr_burst(ring, device, queue, target, link_speed, cfg, fb, ctl);
+	}
+
+	void mg_rate_limiter_poisson_burst_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, rate_limiter::limiter_burst_config* cfg, rate_limiter::limiter_feedback_config* fb, rate_limiter::limiter_control* ctl) {
+		arrival::process proc(arrival::distribution::exponential, 0, 0);
+		rate_limiter::main_loop_stochastic_burst(ring, device, queue, target, link_speed, &proc, cfg, fb, ctl);
+	}
+
+	void mg_rate_limiter_pattern_burst_main_loop(rte_ring* ring, uint8_t device, uint16_t queue, uint32_t target, uint32_t link_speed, arrival::process* proc, rate_limiter::limiter_burst_config* cfg, rate_limiter::limiter_feedback_config* fb, rate_limiter::limiter_control* ctl) {
+		rate_limiter::main_loop_stochastic_burst(ring, device, queue, target, link_speed, proc, cfg, fb, ctl);
+	}
+
+	rate_limiter::limiter_mux* mg_rate_limiter_mux_create() {
+		return new rate_limiter::limiter_mux;
+	}
+
+	// mode: 0 = cbr, 1 = stochastic, proc defaults to a poisson process for stochastic queues and is freed with the mux
+	void mg_rate_limiter_mux_add(rate_limiter::limiter_mux* mux, rte_ring* ring, uint8_t device, uint16_t queue, uint8_t mode, uint32_t target, uint32_t link_speed, arrival::process* proc, rate_limiter::limiter_control* ctl) {
+		rate_limiter::mux_entry e;
+		e.ring = ring;
+		e.device = device;
+		e.queue = queue;
+		e.mode = static_cast<rate_limiter::mux_mode>(mode);
+		e.ctl = ctl;
+		e.id_cycles = (uint64_t) (target / (1000000000.0 / ((double) rte_get_tsc_hz())));
+		e.proc = nullptr;
+		if (e.mode == rate_limiter::mux_mode::stochastic) {
+			e.own_proc.reset(proc ? proc : new arrival::process(arrival::distribution::exponential, 0, 0, mux->entries.size() + 1));
+			e.proc = e.own_proc.get();
+			e.schedule = rate_limiter::stochastic_schedule(target, link_speed, e.proc);
+		}
+		mux->entries.push_back(std::move(e));
+	}
+
+	// the mux is deleted once the loop exits
+	void mg_rate_limiter_mux_main_loop(rate_limiter::limiter_mux* mux) {
+		rate_limiter::main_loop_mux(mux);
+		delete mux;
+	}
 }
 
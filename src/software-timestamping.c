@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <time.h>
 
 #include <rte_config.h>
 #include <rte_ethdev.h> 
@@ -19,3 +20,83 @@ void moongen_send_packet_with_timestamp(uint8_t port_id, uint16_t queue_id, stru
 	}
 }
 
+
+/*
+ * Send a batch of packets with software timestamps.
+ * Timestamps are taken right before the tx_burst call, packets that are not accepted by the NIC are stamped again
+ * before the next attempt. Returns the number of packets sent, this is only less than num_pkts if the task was stopped.
+ */
+uint16_t moongen_send_packets_with_timestamp(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** pkts, uint16_t num_pkts, uint16_t offs) {
+	uint16_t sent = 0;
+	while (sent < num_pkts && is_running(0)) {
+		for (uint16_t i = sent; i < num_pkts; i++) {
+			rte_pktmbuf_mtod_offset(pkts[i], uint64_t*, 0)[offs] = read_rdtsc();
+		}
+		sent += rte_eth_tx_burst(port_id, queue_id, pkts + sent, num_pkts - sent);
+	}
+	return sent;
+}
+
+/*
+ * Receive a batch of packets and store a software timestamp in their udata64 field.
+ * All packets of a batch get the same timestamp, taken right after the rx_burst call returned.
+ */
+uint16_t moongen_recv_packets_with_timestamp(uint8_t port_id, uint16_t queue_id, struct rte_mbuf** pkts, uint16_t num_pkts) {
+	uint16_t rx = rte_eth_rx_burst(port_id, queue_id, pkts, num_pkts);
+	if (rx) {
+		uint64_t tsc = read_rdtsc();
+		for (uint16_t i = 0; i < rx; i++) {
+			pkts[i]->udata64 = tsc;
+		}
+	}
+	return rx;
+}
+
+/*
+ * Conversion of TSC cycles to nanoseconds of CLOCK_MONOTONIC_RAW.
+ * The nominal TSC frequency is usually off by a few ppm, the calibration measures the actual frequency against the
+ * system clock over the whole time since the calibration was initialized and gets more accurate with every update.
+ * ns = ns_base + (tsc - tsc_base) * ns_per_cycle
+ */
+struct tsc_calibration {
+	uint64_t tsc_base;
+	uint64_t ns_base;
+	double ns_per_cycle;
+	uint64_t tsc_start;
+	uint64_t ns_start;
+};
+
+// read the TSC and the system clock at (almost) the same time, keeps the sample with the shortest clock_gettime() call
+static void sample_clocks(uint64_t* tsc, uint64_t* ns) {
+	uint64_t best = UINT64_MAX;
+	for (int i = 0; i < 8; i++) {
+		struct timespec ts;
+		uint64_t before = read_rdtsc();
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		uint64_t after = read_rdtsc();
+		if (after - before < best) {
+			best = after - before;
+			*tsc = before + (after - before) / 2;
+			*ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+	}
+}
+
+void moongen_tsc_calibration_init(struct tsc_calibration* cal) {
+	sample_clocks(&cal->tsc_start, &cal->ns_start);
+	cal->tsc_base = cal->tsc_start;
+	cal->ns_base = cal->ns_start;
+	cal->ns_per_cycle = 1000000000.0 / rte_get_tsc_hz();
+}
+
+// call periodically (e.g. once per second), the reference point moves to the current time
+void moongen_tsc_calibration_update(struct tsc_calibration* cal) {
+	uint64_t tsc, ns;
+	sample_clocks(&tsc, &ns);
+	if (tsc <= cal->tsc_start || ns <= cal->ns_start) {
+		return;
+	}
+	cal->ns_per_cycle = (double) (ns - cal->ns_start) / (tsc - cal->tsc_start);
+	cal->tsc_base = tsc;
+	cal->ns_base = ns;
+}